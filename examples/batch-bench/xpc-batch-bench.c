@@ -0,0 +1,247 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Traces the latency/throughput curve of message batching, to choose a
+ * batching window. For each window, the client sends a stream of small
+ * messages stamped with the time they were sent; the server reports how
+ * long they took to arrive on average. Then it measures the round trip
+ * of a lone message, which waits out the window. Windows are given in
+ * microseconds, 0 meaning no batching; the transport is picked with
+ * XPC_TRANSPORT as usual.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dispatch/dispatch.h>
+#include <xpc/xpc.h>
+#include "../bench.h"
+
+#define	SERVICE		"xpc-batch-bench"
+#define	NMESSAGES	200000
+#define	NPINGS		2000
+#define	MESSAGE_SIZE	64
+#define	BATCH_MAX	16384
+
+static const uint64_t windows[] = { 0, 10, 25, 50, 100, 200 };
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Adds up how long stamped messages took to arrive, and answers those
+ * asking for an ack with the mean so far.
+ */
+static void
+server(void)
+{
+	xpc_connection_t listener;
+
+	listener = xpc_connection_create_mach_service(SERVICE, NULL,
+	    XPC_CONNECTION_MACH_SERVICE_LISTENER);
+	if (listener == NULL) {
+		perror("xpc_connection_create_mach_service");
+		exit(1);
+	}
+
+	xpc_connection_set_event_handler(listener, ^(xpc_object_t peer) {
+		__block uint64_t total = 0, count = 0;
+
+		xpc_connection_set_event_handler(peer, ^(xpc_object_t event) {
+			xpc_object_t resp;
+			uint64_t sent;
+
+			if (xpc_get_type(event) != XPC_TYPE_DICTIONARY)
+				return;
+
+			sent = xpc_dictionary_get_uint64(event, "sent");
+			if (sent != 0) {
+				total += now_nsec() - sent;
+				count++;
+			}
+
+			if (xpc_dictionary_get_value(event, "ack") != NULL) {
+				resp = xpc_dictionary_create(NULL, NULL, 0);
+				xpc_dictionary_set_uint64(resp, "delay",
+				    count != 0 ? total / count : 0);
+				xpc_connection_send_message(peer, resp);
+				total = count = 0;
+			}
+
+			xpc_release(event);
+		});
+
+		xpc_connection_resume(peer);
+	});
+
+	xpc_connection_resume(listener);
+	dispatch_main();
+}
+
+static xpc_connection_t
+connect_service(dispatch_semaphore_t acked, uint64_t *delay)
+{
+	xpc_connection_t conn;
+	int i;
+
+	/* The server may not be listening yet */
+	for (i = 0; i < 100; i++) {
+		conn = xpc_connection_create_mach_service(SERVICE, NULL, 0);
+		if (conn != NULL)
+			break;
+
+		usleep(20000);
+	}
+
+	if (conn == NULL)
+		return (NULL);
+
+	xpc_connection_set_event_handler(conn, ^(xpc_object_t event) {
+		if (xpc_get_type(event) != XPC_TYPE_DICTIONARY)
+			return;
+
+		*delay = xpc_dictionary_get_uint64(event, "delay");
+		xpc_release(event);
+		dispatch_semaphore_signal(acked);
+	});
+
+	xpc_connection_resume(conn);
+	return (conn);
+}
+
+static xpc_object_t
+message(uint64_t sent, bool ack)
+{
+	/* Data objects do not copy their bytes */
+	static char payload[MESSAGE_SIZE];
+	xpc_object_t msg, data;
+
+	memset(payload, 'x', sizeof(payload));
+	data = xpc_data_create(payload, sizeof(payload));
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(msg, "payload", data);
+	xpc_release(data);
+	xpc_dictionary_set_uint64(msg, "sent", sent);
+	if (ack)
+		xpc_dictionary_set_bool(msg, "ack", true);
+
+	return (msg);
+}
+
+/* Each message is stamped when it is queued, not when it is sent */
+static void
+stream(xpc_connection_t conn, dispatch_semaphore_t acked, uint64_t *delay,
+    double *rate, double *mean)
+{
+	xpc_object_t msg;
+	uint64_t start;
+	int i;
+
+	start = now_nsec();
+	for (i = 0; i < NMESSAGES; i++) {
+		msg = message(now_nsec(), i == NMESSAGES - 1);
+		xpc_connection_send_message(conn, msg);
+		xpc_release(msg);
+	}
+
+	dispatch_semaphore_wait(acked, DISPATCH_TIME_FOREVER);
+	*rate = NMESSAGES / ((now_nsec() - start) / 1e9);
+	*mean = *delay / 1e3;
+}
+
+static void
+ping(xpc_connection_t conn, dispatch_semaphore_t acked, double *p50,
+    double *p99)
+{
+	xpc_object_t msg;
+	uint64_t *samples, start;
+	int i;
+
+	samples = malloc(NPINGS * sizeof(uint64_t));
+	msg = message(0, true);
+	for (i = 0; i < NPINGS; i++) {
+		start = now_nsec();
+		xpc_connection_send_message(conn, msg);
+		dispatch_semaphore_wait(acked, DISPATCH_TIME_FOREVER);
+		samples[i] = now_nsec() - start;
+	}
+
+	qsort(samples, NPINGS, sizeof(uint64_t), compare);
+	*p50 = samples[NPINGS / 2] / 1e3;
+	*p99 = samples[NPINGS * 99 / 100] / 1e3;
+	xpc_release(msg);
+	free(samples);
+}
+
+int
+main(int argc, char *argv[])
+{
+	xpc_connection_t conn;
+	dispatch_semaphore_t acked;
+	uint64_t delay;
+	double rate, mean, p50, p99;
+	uint64_t window;
+	int i, count;
+	pid_t pid;
+
+	count = argc > 1 ? argc - 1 : sizeof(windows) / sizeof(windows[0]);
+	if ((pid = fork()) == 0)
+		server();
+
+	acked = dispatch_semaphore_create(0);
+	if ((conn = connect_service(acked, &delay)) == NULL) {
+		fprintf(stderr, "cannot connect to %s\n", SERVICE);
+		kill(pid, SIGKILL);
+		return (1);
+	}
+
+	printf("%10s %12s %14s %12s %12s\n", "window us", "msgs/s",
+	    "delivery us", "rtt p50 us", "rtt p99 us");
+	for (i = 0; i < count; i++) {
+		window = argc > 1 ? strtoull(argv[i + 1], NULL, 10) :
+		    windows[i];
+		xpc_connection_set_batching(conn, window * 1000, BATCH_MAX);
+		stream(conn, acked, &delay, &rate, &mean);
+		ping(conn, acked, &p50, &p99);
+		printf("%10lu %12.0f %14.1f %12.1f %12.1f\n", window, rate,
+		    mean, p50, p99);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return (0);
+}
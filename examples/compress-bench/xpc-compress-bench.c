@@ -0,0 +1,354 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Prints a matrix of payload type x size x codec: the bytes each codec
+ * saves and the CPU time it costs per message to compress and inflate.
+ * Payloads are encoded exactly as they go over the wire, and the codecs
+ * are called the way xpc_pack() calls them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lz4.h>
+#include <zstd.h>
+#include <xpc/xpc.h>
+#include "payload.h"
+#include "../bench.h"
+
+#define	ZSTD_LEVEL	1	/* as in the library */
+#define	MIN_SECONDS	0.2
+#define	NSAMPLES	1000
+
+static const char *hosts[] = {
+	"web01.example.com", "web02.example.com", "db01.example.com",
+	"cache01.example.com", "batch07.example.com"
+};
+
+static const char *services[] = {
+	"nginx", "postgres", "memcached", "cron", "sshd"
+};
+
+static const size_t sizes[] = { 256, 4096, 65536 };
+
+struct payload {
+	const char *	name;
+	char *		(*build)(size_t target, size_t *size);
+};
+
+struct codec {
+	const char *	name;
+	size_t		(*compress)(const char *src, size_t len, char *dst,
+			    size_t cap);
+	size_t		(*decompress)(const char *src, size_t len, char *dst,
+			    size_t cap);
+};
+
+static ZSTD_CCtx *cctx;
+static ZSTD_DCtx *dctx;
+static ZSTD_CDict *cdict;
+static ZSTD_DDict *ddict;
+
+static void
+fill_telemetry(struct telemetry *t, int i)
+{
+
+	t->hostname = (char *)hosts[i % 5];
+	t->service = (char *)services[(i / 5) % 5];
+	t->timestamp = 1420070400 + i;
+	t->cpu = (i * 37) % 100;
+	t->load = (i % 400) / 100.0;
+}
+
+static char *
+build_telemetry(size_t target, size_t *size)
+{
+	struct telemetry_batch batch;
+	struct telemetry one;
+	char *buf;
+	size_t i;
+
+	/* A single record is the smallest payload; larger ones are batches */
+	if (target <= 256) {
+		fill_telemetry(&one, 1);
+		if (telemetry_serialize(&one, &buf, size) != 0)
+			abort();
+
+		return (buf);
+	}
+
+	batch.items_count = target / 90;
+	batch.items = calloc(batch.items_count, sizeof(*batch.items));
+	for (i = 0; i < batch.items_count; i++)
+		fill_telemetry(&batch.items[i], (int)i);
+
+	if (telemetry_batch_serialize(&batch, &buf, size) != 0)
+		abort();
+
+	free(batch.items);
+	return (buf);
+}
+
+static char *
+build_blob(const char *name, char *data, size_t target, size_t *size)
+{
+	struct blob blob;
+	char *buf;
+
+	blob.name = (char *)name;
+	blob.payload.ptr = data;
+	blob.payload.length = target;
+	if (blob_serialize(&blob, &buf, size) != 0)
+		abort();
+
+	free(data);
+	return (buf);
+}
+
+static char *
+build_text(size_t target, size_t *size)
+{
+	char *data;
+	size_t i, n;
+
+	data = malloc(target + 128);
+	for (i = 0; i < target; i += n)
+		n = sprintf(data + i, "%s %s[%zu]: request served in %zu ms\n",
+		    hosts[i % 5], services[i % 3], 1000 + i % 97, i % 250);
+
+	return (build_blob("log", data, target, size));
+}
+
+static char *
+build_random(size_t target, size_t *size)
+{
+	char *data;
+	size_t i;
+
+	data = malloc(target);
+	for (i = 0; i < target; i++)
+		data[i] = (char)random();
+
+	return (build_blob("random", data, target, size));
+}
+
+static char *
+build_series(size_t target, size_t *size)
+{
+	struct series series;
+	char *buf;
+	double v;
+	size_t i;
+
+	series.metric = "cpu.load";
+	series.samples_count = target / 8;
+	series.samples = malloc(series.samples_count * sizeof(double));
+	for (i = 0, v = 1.0; i < series.samples_count; i++) {
+		v += (random() % 200 - 100) / 1000.0;
+		series.samples[i] = v;
+	}
+
+	if (series_serialize(&series, &buf, size) != 0)
+		abort();
+
+	free(series.samples);
+	return (buf);
+}
+
+static size_t
+lz4_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+
+	return (LZ4_compress_default(src, dst, (int)len, (int)cap));
+}
+
+static size_t
+lz4_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+	int n;
+
+	n = LZ4_decompress_safe(src, dst, (int)len, (int)cap);
+	return (n < 0 ? 0 : (size_t)n);
+}
+
+static size_t
+zstd_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+	size_t n;
+
+	n = ZSTD_compressCCtx(cctx, dst, cap, src, len, ZSTD_LEVEL);
+	return (ZSTD_isError(n) ? 0 : n);
+}
+
+static size_t
+zstd_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+	size_t n;
+
+	n = ZSTD_decompressDCtx(dctx, dst, cap, src, len);
+	return (ZSTD_isError(n) ? 0 : n);
+}
+
+static size_t
+zdict_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+	size_t n;
+
+	n = ZSTD_compress_usingCDict(cctx, dst, cap, src, len, cdict);
+	return (ZSTD_isError(n) ? 0 : n);
+}
+
+static size_t
+zdict_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+	size_t n;
+
+	n = ZSTD_decompress_usingDDict(dctx, dst, cap, src, len, ddict);
+	return (ZSTD_isError(n) ? 0 : n);
+}
+
+static const struct payload payloads[] = {
+	{ "telemetry", build_telemetry },
+	{ "text", build_text },
+	{ "random", build_random },
+	{ "series", build_series },
+};
+
+static const struct codec codecs[] = {
+	{ "lz4", lz4_compress, lz4_decompress },
+	{ "zstd", zstd_compress, zstd_decompress },
+	{ "zstd+dict", zdict_compress, zdict_decompress },
+};
+
+/*
+ * The dictionary is trained with the library on telemetry records,
+ * built as dictionaries the way a sender would.
+ */
+static xpc_object_t
+train(void)
+{
+	struct telemetry t;
+	xpc_object_t samples, msg, dict;
+	int i;
+
+	samples = xpc_array_create(NULL, 0);
+	for (i = 0; i < NSAMPLES; i++) {
+		fill_telemetry(&t, i * 7);
+		msg = xpc_dictionary_create(NULL, NULL, 0);
+		xpc_dictionary_set_string(msg, "hostname", t.hostname);
+		xpc_dictionary_set_string(msg, "service", t.service);
+		xpc_dictionary_set_int64(msg, "timestamp", t.timestamp);
+		xpc_dictionary_set_int64(msg, "cpu", t.cpu);
+		xpc_dictionary_set_value(msg, "load",
+		    xpc_double_create(t.load));
+		xpc_array_append_value(samples, msg);
+		xpc_release(msg);
+	}
+
+	dict = xpc_compression_train_dictionary(samples, 16384);
+	xpc_release(samples);
+	return (dict);
+}
+
+static void
+measure(const struct codec *codec, const char *src, size_t size)
+{
+	char *dst, *out;
+	size_t cap, n;
+	double start, comp, decomp;
+	long i, iterations;
+
+	cap = ZSTD_compressBound(size) + LZ4_compressBound((int)size);
+	dst = malloc(cap);
+	out = malloc(size);
+	if ((n = codec->compress(src, size, dst, cap)) == 0) {
+		printf("  %-10s failed\n", codec->name);
+		goto out;
+	}
+
+	/* Run each codec for about MIN_SECONDS */
+	iterations = 0;
+	start = now();
+	do {
+		codec->compress(src, size, dst, cap);
+		iterations++;
+	} while ((comp = now() - start) < MIN_SECONDS);
+	comp /= iterations;
+
+	iterations = 0;
+	start = now();
+	do {
+		if (codec->decompress(dst, n, out, size) != size)
+			abort();
+		iterations++;
+	} while ((decomp = now() - start) < MIN_SECONDS);
+	decomp /= iterations;
+
+	printf("  %-10s %8zu %6.1f%% %10.0f %10.0f %8.0f\n", codec->name, n,
+	    100.0 * ((double)size - n) / size, comp * 1e9, decomp * 1e9,
+	    size / comp / 1e6);
+out:
+	free(dst);
+	free(out);
+}
+
+int
+main(void)
+{
+	xpc_object_t dict;
+	char *buf;
+	size_t i, j, k, size;
+
+	if ((dict = train()) == NULL) {
+		perror("xpc_compression_train_dictionary");
+		return (1);
+	}
+
+	cctx = ZSTD_createCCtx();
+	dctx = ZSTD_createDCtx();
+	cdict = ZSTD_createCDict(xpc_data_get_bytes_ptr(dict),
+	    xpc_data_get_length(dict), ZSTD_LEVEL);
+	ddict = ZSTD_createDDict(xpc_data_get_bytes_ptr(dict),
+	    xpc_data_get_length(dict));
+
+	printf("  %-10s %8s %7s %10s %10s %8s\n", "codec", "wire", "saved",
+	    "comp ns", "inflate ns", "MB/s");
+	for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			buf = payloads[i].build(sizes[j], &size);
+			printf("%s, %zu bytes encoded\n", payloads[i].name,
+			    size);
+			for (k = 0; k < sizeof(codecs) / sizeof(codecs[0]); k++)
+				measure(&codecs[k], buf, size);
+
+			free(buf);
+		}
+	}
+
+	return (0);
+}
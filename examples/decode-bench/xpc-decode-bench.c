@@ -0,0 +1,307 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Counts heap allocations on the receive path.  The process forks a
+ * client that sends number-only dictionaries as fast as it can; the
+ * parent listens, releases each message in its handler and reports,
+ * per message, how many allocations were made in total and how many of
+ * them were the output objects themselves.  Everything else is overhead:
+ * receive buffers, parse trees, dispatch.  With a warm decoder the only
+ * overhead left should be the Block the handler is dispatched in.
+ *
+ * Given "lz4" or "zstd", the client compresses every message and the
+ * samples repeat so that they do compress; inflating reuses the
+ * decoder's buffer, so the overhead should stay the same.
+ */
+
+#define	_GNU_SOURCE
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dispatch/dispatch.h>
+#include <xpc/xpc.h>
+#include "../bench.h"
+
+#define	SERVICE		"com.ixsystems.decode-bench"
+#define	WARMUP		1000
+#define	NMESSAGES	100000
+#define	NSAMPLES	64
+#define	ARENA_SIZE	4096
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void (*real_free)(void *);
+
+/* dlsym() may itself call calloc() before the real one is known */
+static char arena[ARENA_SIZE] __attribute__((aligned(16)));
+static size_t arena_used;
+
+static atomic_ulong allocations;
+static atomic_ulong releases;
+static __thread int releasing;
+static int resolving;
+static int codec = XPC_COMPRESSION_NONE;
+
+static void
+resolve(void)
+{
+
+	if (real_free != NULL || resolving)
+		return;
+
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+}
+
+static void *
+arena_alloc(size_t size)
+{
+	void *ptr;
+
+	size = (size + 15) & ~(size_t)15;
+	if (arena_used + size > ARENA_SIZE)
+		abort();
+
+	ptr = arena + arena_used;
+	arena_used += size;
+	return (ptr);
+}
+
+void *
+malloc(size_t size)
+{
+
+	resolve();
+	if (real_malloc == NULL)
+		return (arena_alloc(size));
+
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+
+	/* Arena memory is static, hence already zeroed */
+	resolve();
+	if (real_calloc == NULL)
+		return (arena_alloc(nmemb * size));
+
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return (real_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+
+	resolve();
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return (real_realloc(ptr, size));
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+
+	resolve();
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return (real_posix_memalign(ptr, alignment, size));
+}
+
+void
+free(void *ptr)
+{
+
+	if (ptr == NULL || ((char *)ptr >= arena &&
+	    (char *)ptr < arena + ARENA_SIZE))
+		return;
+
+	/* Every block freed while releasing a message was part of it */
+	if (releasing)
+		atomic_fetch_add_explicit(&releases, 1, memory_order_relaxed);
+
+	real_free(ptr);
+}
+
+static xpc_object_t
+build_message(int64_t i)
+{
+	xpc_object_t msg, stats, samples;
+	int j;
+
+	stats = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_int64(stats, "min", i - 10);
+	xpc_dictionary_set_int64(stats, "max", i + 10);
+	xpc_dictionary_set_value(stats, "mean", xpc_double_create(i / 3.0));
+
+	samples = xpc_array_create(NULL, 0);
+	for (j = 0; j < NSAMPLES; j++)
+		xpc_array_set_double(samples, XPC_ARRAY_APPEND,
+		    codec != XPC_COMPRESSION_NONE ? i : i + j / 8.0);
+
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_int64(msg, "sequence", i);
+	xpc_dictionary_set_uint64(msg, "timestamp", (uint64_t)time(NULL));
+	xpc_dictionary_set_bool(msg, "final", false);
+	xpc_dictionary_set_value(msg, "stats", stats);
+	xpc_dictionary_set_value(msg, "samples", samples);
+	xpc_release(stats);
+	xpc_release(samples);
+	return (msg);
+}
+
+static void
+client(void)
+{
+	xpc_connection_t conn;
+	xpc_object_t msg;
+	int64_t i;
+
+	/* Give the listener a moment to bind */
+	usleep(200000);
+	conn = xpc_connection_create_mach_service(SERVICE, NULL, 0);
+	if (conn == NULL) {
+		perror("xpc_connection_create_mach_service");
+		exit(1);
+	}
+
+	if (xpc_connection_set_compression(conn, codec, 0) != 0) {
+		/* The listener would wait for messages forever */
+		perror("xpc_connection_set_compression");
+		kill(getppid(), SIGTERM);
+		exit(1);
+	}
+
+	xpc_connection_set_event_handler(conn, ^(xpc_object_t event) {
+		(void)event;
+	});
+	xpc_connection_resume(conn);
+
+	msg = build_message(0);
+	for (i = 0;; i++) {
+		xpc_dictionary_set_int64(msg, "sequence", i);
+		xpc_connection_send_message(conn, msg);
+	}
+}
+
+static void
+report(unsigned long allocs, unsigned long outputs, double elapsed)
+{
+	xpc_object_t msg;
+
+	msg = build_message(0);
+	printf("%d %smessages of %zu bytes in %.3f s, %.0f msgs/s\n",
+	    NMESSAGES, codec == XPC_COMPRESSION_LZ4 ? "lz4 " :
+	    codec == XPC_COMPRESSION_ZSTD ? "zstd " : "",
+	    xpc_serialized_size(msg), elapsed, NMESSAGES / elapsed);
+	xpc_release(msg);
+	printf("  allocations per message: %8.2f\n",
+	    (double)allocs / NMESSAGES);
+	printf("  output objects:          %8.2f\n",
+	    (double)outputs / NMESSAGES);
+	printf("  overhead:                %8.2f\n",
+	    ((double)allocs - outputs) / NMESSAGES);
+}
+
+int
+main(int argc, char *argv[])
+{
+	xpc_connection_t listener;
+	__block unsigned long received, allocs, outputs;
+	__block double start;
+	pid_t pid;
+
+	if (argc > 1 && strcmp(argv[1], "lz4") == 0)
+		codec = XPC_COMPRESSION_LZ4;
+	else if (argc > 1 && strcmp(argv[1], "zstd") == 0)
+		codec = XPC_COMPRESSION_ZSTD;
+	else if (argc > 1) {
+		fprintf(stderr, "Usage: %s [lz4|zstd]\n", argv[0]);
+		return (1);
+	}
+
+	/* Fork before libdispatch starts any threads */
+	if ((pid = fork()) == 0)
+		client();
+
+	received = 0;
+	listener = xpc_connection_create_mach_service(SERVICE, NULL,
+	    XPC_CONNECTION_MACH_SERVICE_LISTENER);
+	if (listener == NULL) {
+		perror("xpc_connection_create_mach_service");
+		kill(pid, SIGKILL);
+		return (1);
+	}
+
+	xpc_connection_set_event_handler(listener, ^(xpc_object_t peer) {
+		xpc_connection_set_event_handler(peer, ^(xpc_object_t event) {
+			if (xpc_get_type(event) != XPC_TYPE_DICTIONARY)
+				return;
+
+			releasing = 1;
+			xpc_release(event);
+			releasing = 0;
+
+			if (++received == WARMUP) {
+				allocs = atomic_load(&allocations);
+				outputs = atomic_load(&releases);
+				start = now();
+				return;
+			}
+
+			if (received < WARMUP + NMESSAGES)
+				return;
+
+			report(atomic_load(&allocations) - allocs,
+			    atomic_load(&releases) - outputs, now() - start);
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			exit(0);
+		});
+
+		xpc_connection_resume(peer);
+	});
+
+	xpc_connection_resume(listener);
+	dispatch_main();
+}
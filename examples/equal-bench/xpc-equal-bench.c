@@ -0,0 +1,185 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Times xpc_equal() on a wide tree, one dictionary with many keys, and
+ * on a deep one, a chain of nested dictionaries. Each tree is compared
+ * with an equal copy and with one differing in a single leaf near the
+ * end of the walk, in three forms: mutable dictionaries, which never
+ * cache their hash; persistent dictionaries whose hash was not computed;
+ * and persistent dictionaries hashed beforehand, where a difference is
+ * found from the cached hashes without walking the tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "../bench.h"
+
+#define	WIDTH		1024
+#define	DEPTH		256
+
+struct shape {
+	const char *	name;
+	xpc_object_t	(*build)(bool differ);
+};
+
+static xpc_object_t
+build_wide(bool differ)
+{
+	xpc_object_t dict;
+	char key[32];
+	int i;
+
+	dict = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = 0; i < WIDTH; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		set_object(dict, key, xpc_string_create_with_format(
+		    "value %d", differ && i == WIDTH - 1 ? -1 : i));
+	}
+
+	return (dict);
+}
+
+static xpc_object_t
+build_deep(bool differ)
+{
+	xpc_object_t node, child;
+	int level;
+
+	child = NULL;
+	for (level = DEPTH - 1; level >= 0; level--) {
+		node = xpc_dictionary_create(NULL, NULL, 0);
+		xpc_dictionary_set_int64(node, "level", level);
+		set_object(node, "name", xpc_string_create_with_format(
+		    "node %d", level));
+		xpc_dictionary_set_int64(node, "leaf",
+		    differ && level == DEPTH - 1 ? -1 : level);
+		if (child != NULL)
+			set_object(node, "child", child);
+
+		child = node;
+	}
+
+	return (child);
+}
+
+/* Persistent dictionaries are shallow, so every level is converted */
+static xpc_object_t
+freeze(xpc_object_t obj)
+{
+	xpc_object_t copy, frozen;
+
+	if (xpc_get_type(obj) != XPC_TYPE_DICTIONARY)
+		return (xpc_retain(obj));
+
+	copy = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_apply(obj, ^(const char *key, xpc_object_t value) {
+		set_object(copy, key, freeze(value));
+		return ((bool)true);
+	});
+
+	frozen = xpc_pdictionary_create_from_dictionary(copy);
+	xpc_release(copy);
+	return (frozen);
+}
+
+static double
+time_equal(xpc_object_t a, xpc_object_t b, bool expected, long iterations)
+{
+	double start;
+	long i;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (xpc_equal(a, b) != expected)
+			abort();
+	}
+
+	return ((now() - start) * 1e9 / iterations);
+}
+
+static void
+report(const char *shape, const char *form, xpc_object_t a, xpc_object_t b,
+    xpc_object_t c, long iterations)
+{
+
+	printf("%-6s %-20s %12.1f %12.1f\n", shape, form,
+	    time_equal(a, b, true, iterations),
+	    time_equal(a, c, false, iterations));
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct shape shapes[] = {
+		{ "wide", build_wide },
+		{ "deep", build_deep }
+	};
+	xpc_object_t a, b, c, pa, pb, pc;
+	long iterations;
+	size_t i;
+
+	iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 10000;
+	printf("%-6s %-20s %12s %12s\n", "tree", "form", "equal ns",
+	    "unequal ns");
+
+	for (i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		a = shapes[i].build(false);
+		b = shapes[i].build(false);
+		c = shapes[i].build(true);
+		report(shapes[i].name, "mutable", a, b, c, iterations);
+
+		pa = freeze(a);
+		pb = freeze(b);
+		pc = freeze(c);
+		report(shapes[i].name, "persistent", pa, pb, pc, iterations);
+		xpc_release(pa);
+		xpc_release(pb);
+		xpc_release(pc);
+
+		/* Fresh copies, so that the form above stays unhashed */
+		pa = freeze(a);
+		pb = freeze(b);
+		pc = freeze(c);
+		(void)xpc_hash(pa);
+		(void)xpc_hash(pb);
+		(void)xpc_hash(pc);
+		report(shapes[i].name, "persistent, hashed", pa, pb, pc,
+		    iterations);
+		xpc_release(pa);
+		xpc_release(pb);
+		xpc_release(pc);
+
+		xpc_release(a);
+		xpc_release(b);
+		xpc_release(c);
+	}
+
+	return (0);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "sample.h"
+#include "../bench.h"
+
+#define	NVALUES		16
+
+static double values[NVALUES];
+
+static void
+fill_request(struct sample_request *req)
+{
+
+	memset(req, 0, sizeof(*req));
+	req->hdr.route = 42;
+	req->hdr.priority = -1;
+	req->hdr.origin = "xpc-idl-bench";
+	req->op = 7;
+	req->sequence = 123456789;
+	req->urgent = true;
+	req->weight = 0.75;
+	req->timestamp = 1420070400;
+	req->name = "sample";
+	req->path = "/var/db/sample";
+	req->cookie.ptr = "0123456789abcdef";
+	req->cookie.length = 16;
+	req->values = values;
+	req->values_count = NVALUES;
+}
+
+/*
+ * What a hand-written sender does today: one object per field, then the
+ * dictionary is serialized into a buffer of its exact size, which is the
+ * same work the generated encoder does.
+ */
+static void
+encode_by_hand(const struct sample_request *req)
+{
+	xpc_object_t msg, hdr, arr;
+	char *buf;
+	size_t size;
+
+	hdr = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_uint64(hdr, "route", req->hdr.route);
+	xpc_dictionary_set_int64(hdr, "priority", req->hdr.priority);
+	xpc_dictionary_set_string(hdr, "origin", req->hdr.origin);
+
+	arr = xpc_typed_array_create(XPC_ARRAY_TYPE_DOUBLE, req->values,
+	    req->values_count);
+
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(msg, "hdr", hdr);
+	xpc_dictionary_set_int64(msg, "op", req->op);
+	xpc_dictionary_set_uint64(msg, "sequence", req->sequence);
+	xpc_dictionary_set_bool(msg, "urgent", req->urgent);
+	set_object(msg, "weight", xpc_double_create(req->weight));
+	set_object(msg, "timestamp", xpc_date_create(req->timestamp));
+	xpc_dictionary_set_string(msg, "name", req->name);
+	xpc_dictionary_set_string(msg, "path", req->path);
+	set_object(msg, "cookie", xpc_data_create(req->cookie.ptr,
+	    req->cookie.length));
+	xpc_dictionary_set_value(msg, "values", arr);
+
+	size = xpc_serialized_size(msg);
+	if ((buf = malloc(size)) == NULL ||
+	    xpc_serialize(msg, buf, size) != size)
+		abort();
+
+	free(buf);
+	xpc_release(hdr);
+	xpc_release(arr);
+	xpc_release(msg);
+}
+
+static void
+encode_generated(const struct sample_request *req)
+{
+	char *buf;
+	size_t size;
+
+	if (sample_request_serialize(req, &buf, &size) != 0)
+		abort();
+
+	free(buf);
+}
+
+static void
+decode_generated(const char *buf, size_t size)
+{
+	struct sample_request req;
+
+	if (sample_request_decode(buf, size, &req) != 0)
+		abort();
+
+	sample_request_free(&req);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sample_request req;
+	double start, hand, gen, dec;
+	char *buf;
+	size_t size;
+	long i, iterations;
+	int j;
+
+	iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+	for (j = 0; j < NVALUES; j++)
+		values[j] = j * 0.5;
+
+	fill_request(&req);
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		encode_by_hand(&req);
+	hand = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		encode_generated(&req);
+	gen = now() - start;
+
+	if (sample_request_serialize(&req, &buf, &size) != 0) {
+		perror("sample_request_serialize");
+		return (1);
+	}
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		decode_generated(buf, size);
+	dec = now() - start;
+
+	printf("message size:                     %zu bytes\n", size);
+	printf("xpc_dictionary_set_* + serialize: %.1f ns/msg\n",
+	    hand * 1e9 / iterations);
+	printf("generated serialize:              %.1f ns/msg\n",
+	    gen * 1e9 / iterations);
+	printf("generated decode:                 %.1f ns/msg\n",
+	    dec * 1e9 / iterations);
+
+	free(buf);
+	return (0);
+}
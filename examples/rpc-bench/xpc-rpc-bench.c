@@ -0,0 +1,255 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Measures the round trip of a small call, answered by a forked server
+ * with xpc_dictionary_create_reply(): once through
+ * xpc_connection_send_message_with_reply() and a semaphore signaled from
+ * the reply handler, once through
+ * xpc_connection_send_message_with_reply_sync(). Both are run with
+ * handlers on the target queue, then with inline delivery on both ends,
+ * which also has to keep a burst of one-way messages in order. The
+ * transport is picked with XPC_TRANSPORT as usual.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dispatch/dispatch.h>
+#include <xpc/xpc.h>
+#include "../bench.h"
+
+#define	NCALLS		20000
+#define	NWARMUP		1000
+#define	NORDERED	100000
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Answers every call with its argument plus one. One-way messages carry
+ * a sequence number, and a call asking "ordered" learns whether they all
+ * came in order.
+ */
+static void
+server(const char *service, bool inline_delivery)
+{
+	xpc_connection_t listener;
+
+	listener = xpc_connection_create_mach_service(service, NULL,
+	    XPC_CONNECTION_MACH_SERVICE_LISTENER);
+	if (listener == NULL) {
+		perror("xpc_connection_create_mach_service");
+		exit(1);
+	}
+
+	xpc_connection_set_inline_delivery(listener, inline_delivery);
+	xpc_connection_set_event_handler(listener, ^(xpc_object_t peer) {
+		__block int64_t next = 0;
+		__block bool ordered = true;
+
+		xpc_connection_set_event_handler(peer, ^(xpc_object_t event) {
+			xpc_object_t reply;
+
+			if (xpc_get_type(event) != XPC_TYPE_DICTIONARY)
+				return;
+
+			if (xpc_dictionary_get_value(event, "seq") != NULL) {
+				if (xpc_dictionary_get_int64(event, "seq") !=
+				    next++)
+					ordered = false;
+
+				xpc_release(event);
+				return;
+			}
+
+			reply = xpc_dictionary_create_reply(event);
+			xpc_dictionary_set_int64(reply, "value",
+			    xpc_dictionary_get_int64(event, "value") + 1);
+			xpc_dictionary_set_bool(reply, "ordered", ordered);
+			xpc_connection_send_message(peer, reply);
+			xpc_release(reply);
+			xpc_release(event);
+		});
+
+		xpc_connection_resume(peer);
+	});
+
+	xpc_connection_resume(listener);
+	dispatch_main();
+}
+
+static xpc_connection_t
+connect_service(const char *service, bool inline_delivery)
+{
+	xpc_connection_t conn;
+	int i;
+
+	/* The server may not be listening yet */
+	for (i = 0; i < 100; i++) {
+		conn = xpc_connection_create_mach_service(service, NULL, 0);
+		if (conn != NULL)
+			break;
+
+		usleep(20000);
+	}
+
+	if (conn == NULL)
+		return (NULL);
+
+	xpc_connection_set_inline_delivery(conn, inline_delivery);
+	xpc_connection_set_event_handler(conn, ^(xpc_object_t event) {
+	});
+
+	xpc_connection_resume(conn);
+	return (conn);
+}
+
+static xpc_object_t
+call_async(xpc_connection_t conn, xpc_object_t msg)
+{
+	__block xpc_object_t result;
+	dispatch_semaphore_t sem;
+
+	sem = dispatch_semaphore_create(0);
+	xpc_connection_send_message_with_reply(conn, msg, NULL,
+	    ^(xpc_object_t reply) {
+		result = reply;
+		dispatch_semaphore_signal(sem);
+	});
+
+	dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
+	dispatch_release(sem);
+	return (result);
+}
+
+static void
+bench(const char *name, xpc_connection_t conn,
+    xpc_object_t (*call)(xpc_connection_t, xpc_object_t))
+{
+	xpc_object_t msg, reply;
+	double *samples, start;
+	int i;
+
+	samples = malloc(NCALLS * sizeof(double));
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = -NWARMUP; i < NCALLS; i++) {
+		xpc_dictionary_set_int64(msg, "value", i);
+		start = now();
+		reply = call(conn, msg);
+		if (i >= 0)
+			samples[i] = (now() - start) * 1e6;
+
+		if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY ||
+		    xpc_dictionary_get_int64(reply, "value") != i + 1) {
+			fprintf(stderr, "%s: bad reply to call %d\n", name, i);
+			exit(1);
+		}
+
+		xpc_release(reply);
+	}
+
+	qsort(samples, NCALLS, sizeof(double), compare);
+	printf("%-12s p50 %6.1f us  p90 %6.1f us  p99 %6.1f us\n", name,
+	    samples[NCALLS / 2], samples[NCALLS * 9 / 10],
+	    samples[NCALLS * 99 / 100]);
+	xpc_release(msg);
+	free(samples);
+}
+
+/* Sends a burst of one-way messages and asks whether they kept order */
+static bool
+check_order(xpc_connection_t conn)
+{
+	xpc_object_t msg, reply;
+	bool ordered;
+	int i;
+
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = 0; i < NORDERED; i++) {
+		xpc_dictionary_set_int64(msg, "seq", i);
+		xpc_connection_send_message(conn, msg);
+		xpc_release(msg);
+		msg = xpc_dictionary_create(NULL, NULL, 0);
+	}
+
+	reply = xpc_connection_send_message_with_reply_sync(conn, msg);
+	ordered = xpc_get_type(reply) == XPC_TYPE_DICTIONARY &&
+	    xpc_dictionary_get_bool(reply, "ordered");
+	xpc_release(reply);
+	xpc_release(msg);
+	return (ordered);
+}
+
+/* Returns whether the one-way messages kept their order */
+static bool
+run(const char *service, bool inline_delivery)
+{
+	xpc_connection_t conn;
+	pid_t pid;
+	bool ordered;
+
+	if ((pid = fork()) == 0)
+		server(service, inline_delivery);
+
+	if ((conn = connect_service(service, inline_delivery)) == NULL) {
+		fprintf(stderr, "cannot connect to %s\n", service);
+		kill(pid, SIGKILL);
+		exit(1);
+	}
+
+	printf("%s\n", inline_delivery ? "inline delivery" :
+	    "target queue delivery");
+	bench("async+sem", conn, call_async);
+	bench("sync", conn, xpc_connection_send_message_with_reply_sync);
+	ordered = check_order(conn);
+	printf("%-12s %d one-way messages %s\n", "order", NORDERED,
+	    ordered ? "in order" : "OUT OF ORDER");
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return (ordered);
+}
+
+int
+main(void)
+{
+	bool ordered;
+
+	ordered = run("xpc-rpc-bench", false);
+	ordered = run("xpc-rpc-bench-inline", true) && ordered;
+	return (ordered ? 0 : 1);
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Compares the two ways a service can take a message apart: decoding it
+ * into objects, as a connection without a schema does, and checking every
+ * key with getters; or letting xpc_schema_decode() validate it and store
+ * its values into a structure or into slots in one pass.
+ *
+ * Messages are decoded into objects the way the library does it, from a
+ * "dictionary" key that has no nested description: the message is
+ * wrapped in an envelope, so both paths parse the same bytes.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "../bench.h"
+
+struct request {
+	uint64_t		route;
+	int64_t			priority;
+	char *			origin;
+	int64_t			op;
+	uint64_t		sequence;
+	bool			urgent;
+	double			weight;
+	int64_t			timestamp;
+	char *			name;
+	char *			path;
+	struct xpc_schema_bytes	cookie;
+};
+
+static const struct {
+	const char *	key;
+	size_t		offset;
+} bindings[] = {
+	{ "hdr.route", offsetof(struct request, route) },
+	{ "hdr.priority", offsetof(struct request, priority) },
+	{ "hdr.origin", offsetof(struct request, origin) },
+	{ "op", offsetof(struct request, op) },
+	{ "sequence", offsetof(struct request, sequence) },
+	{ "urgent", offsetof(struct request, urgent) },
+	{ "weight", offsetof(struct request, weight) },
+	{ "timestamp", offsetof(struct request, timestamp) },
+	{ "name", offsetof(struct request, name) },
+	{ "path", offsetof(struct request, path) },
+	{ "cookie", offsetof(struct request, cookie) }
+};
+
+static xpc_schema_t envelope;
+static xpc_schema_t schema;
+static int sequence_slot;
+static int route_slot;
+
+static xpc_object_t
+build_message(void)
+{
+	xpc_object_t msg, hdr;
+
+	hdr = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_uint64(hdr, "route", 42);
+	xpc_dictionary_set_int64(hdr, "priority", -1);
+	xpc_dictionary_set_string(hdr, "origin", "xpc-schema-bench");
+
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(msg, "hdr", hdr);
+	xpc_dictionary_set_int64(msg, "op", 7);
+	xpc_dictionary_set_uint64(msg, "sequence", 123456789);
+	xpc_dictionary_set_bool(msg, "urgent", true);
+	set_object(msg, "weight", xpc_double_create(0.75));
+	set_object(msg, "timestamp", xpc_date_create(1420070400));
+	xpc_dictionary_set_string(msg, "name", "sample");
+	xpc_dictionary_set_string(msg, "path", "/var/db/sample");
+	set_object(msg, "cookie", xpc_data_create("0123456789abcdef", 16));
+	xpc_release(hdr);
+	return (msg);
+}
+
+static xpc_object_t
+build_description(void)
+{
+	xpc_object_t desc, hdr;
+
+	hdr = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_string(hdr, "route", "uint64");
+	xpc_dictionary_set_string(hdr, "priority", "int64");
+	xpc_dictionary_set_string(hdr, "origin", "string");
+
+	desc = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(desc, "hdr", hdr);
+	xpc_dictionary_set_string(desc, "op", "int64");
+	xpc_dictionary_set_string(desc, "sequence", "uint64");
+	xpc_dictionary_set_string(desc, "urgent", "bool");
+	xpc_dictionary_set_string(desc, "weight", "double");
+	xpc_dictionary_set_string(desc, "timestamp", "date");
+	xpc_dictionary_set_string(desc, "name", "string");
+	xpc_dictionary_set_string(desc, "path", "string");
+	xpc_dictionary_set_string(desc, "cookie", "data");
+	xpc_release(hdr);
+	return (desc);
+}
+
+static void *
+serialize(xpc_object_t msg, size_t *size)
+{
+	void *buf;
+
+	*size = xpc_serialized_size(msg);
+	if ((buf = malloc(*size)) == NULL ||
+	    xpc_serialize(msg, buf, *size) != *size)
+		abort();
+
+	return (buf);
+}
+
+/*
+ * The wire format keeps neither the signedness of integers nor dates,
+ * which travel as integers, so these are taken for one another as the
+ * schema does.
+ */
+static xpc_object_t
+get(xpc_object_t dict, const char *key, xpc_type_t type)
+{
+	xpc_object_t value;
+	xpc_type_t actual;
+
+	if ((value = xpc_dictionary_get_value(dict, key)) == NULL)
+		return (NULL);
+
+	actual = xpc_get_type(value);
+	if (actual == type)
+		return (value);
+
+	if ((type == XPC_TYPE_INT64 || type == XPC_TYPE_UINT64 ||
+	    type == XPC_TYPE_DATE) &&
+	    (actual == XPC_TYPE_INT64 || actual == XPC_TYPE_UINT64))
+		return (value);
+
+	return (NULL);
+}
+
+static int64_t
+integer(xpc_object_t value)
+{
+
+	if (xpc_get_type(value) == XPC_TYPE_UINT64)
+		return ((int64_t)xpc_uint64_get_value(value));
+
+	if (xpc_get_type(value) == XPC_TYPE_DATE)
+		return (xpc_date_get_value(value));
+
+	return (xpc_int64_get_value(value));
+}
+
+/*
+ * What a service does today once the message is an object: look every
+ * key up, check its type and copy it out.
+ */
+static bool
+validate_by_hand(xpc_object_t msg, struct request *req)
+{
+	xpc_object_t hdr, v[11];
+
+	if ((hdr = get(msg, "hdr", XPC_TYPE_DICTIONARY)) == NULL ||
+	    (v[0] = get(hdr, "route", XPC_TYPE_UINT64)) == NULL ||
+	    (v[1] = get(hdr, "priority", XPC_TYPE_INT64)) == NULL ||
+	    (v[2] = get(hdr, "origin", XPC_TYPE_STRING)) == NULL ||
+	    (v[3] = get(msg, "op", XPC_TYPE_INT64)) == NULL ||
+	    (v[4] = get(msg, "sequence", XPC_TYPE_UINT64)) == NULL ||
+	    (v[5] = get(msg, "urgent", XPC_TYPE_BOOL)) == NULL ||
+	    (v[6] = get(msg, "weight", XPC_TYPE_DOUBLE)) == NULL ||
+	    (v[7] = get(msg, "timestamp", XPC_TYPE_DATE)) == NULL ||
+	    (v[8] = get(msg, "name", XPC_TYPE_STRING)) == NULL ||
+	    (v[9] = get(msg, "path", XPC_TYPE_STRING)) == NULL ||
+	    (v[10] = get(msg, "cookie", XPC_TYPE_DATA)) == NULL)
+		return (false);
+
+	req->route = (uint64_t)integer(v[0]);
+	req->priority = integer(v[1]);
+	req->origin = (char *)xpc_string_get_string_ptr(v[2]);
+	req->op = integer(v[3]);
+	req->sequence = (uint64_t)integer(v[4]);
+	req->urgent = xpc_bool_get_value(v[5]);
+	req->weight = xpc_double_get_value(v[6]);
+	req->timestamp = integer(v[7]);
+	req->name = (char *)xpc_string_get_string_ptr(v[8]);
+	req->path = (char *)xpc_string_get_string_ptr(v[9]);
+	req->cookie.ptr = (void *)xpc_data_get_bytes_ptr(v[10]);
+	req->cookie.length = xpc_data_get_length(v[10]);
+	return (true);
+}
+
+static void
+decode_generic(const void *buf, size_t size)
+{
+	struct request req;
+	xpc_schema_value_t slot;
+	bool valid;
+
+	if (xpc_schema_decode(envelope, buf, size, &slot, NULL) != 0)
+		abort();
+
+	valid = validate_by_hand(slot.v.object, &req);
+	xpc_schema_values_clear(envelope, &slot, NULL);
+	if (!valid)
+		abort();
+}
+
+static void
+decode_struct(const void *buf, size_t size)
+{
+	struct request req;
+
+	if (xpc_schema_decode(schema, buf, size, NULL, &req) != 0 ||
+	    req.sequence != 123456789)
+		abort();
+
+	xpc_schema_values_clear(schema, NULL, &req);
+}
+
+static void
+decode_slots(const void *buf, size_t size, xpc_schema_value_t *slots)
+{
+
+	if (xpc_schema_decode(schema, buf, size, slots, NULL) != 0 ||
+	    slots[sequence_slot].v.u != 123456789 ||
+	    slots[route_slot].v.u != 42)
+		abort();
+
+	xpc_schema_values_clear(schema, slots, NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	xpc_object_t msg, wrapped, desc;
+	xpc_schema_value_t *slots;
+	double start, generic, bound, slotted;
+	void *buf, *wbuf;
+	size_t i, size, wsize;
+	long n, iterations;
+
+	iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+
+	desc = build_description();
+	schema = xpc_schema_create(desc);
+	xpc_release(desc);
+	desc = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_string(desc, "message", "dictionary");
+	envelope = xpc_schema_create(desc);
+	xpc_release(desc);
+	if (schema == NULL || envelope == NULL) {
+		perror("xpc_schema_create");
+		return (1);
+	}
+
+	for (i = 0; i < sizeof(bindings) / sizeof(bindings[0]); i++) {
+		if (xpc_schema_bind(schema, bindings[i].key,
+		    bindings[i].offset) != 0) {
+			perror("xpc_schema_bind");
+			return (1);
+		}
+	}
+
+	sequence_slot = xpc_schema_get_slot(schema, "sequence");
+	route_slot = xpc_schema_get_slot(schema, "hdr.route");
+	slots = calloc(xpc_schema_get_slot_count(schema), sizeof(*slots));
+	if (slots == NULL) {
+		perror("calloc");
+		return (1);
+	}
+
+	msg = build_message();
+	buf = serialize(msg, &size);
+	wrapped = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(wrapped, "message", msg);
+	wbuf = serialize(wrapped, &wsize);
+	xpc_release(wrapped);
+	xpc_release(msg);
+
+	start = now();
+	for (n = 0; n < iterations; n++)
+		decode_generic(wbuf, wsize);
+	generic = now() - start;
+
+	start = now();
+	for (n = 0; n < iterations; n++)
+		decode_struct(buf, size);
+	bound = now() - start;
+
+	start = now();
+	for (n = 0; n < iterations; n++)
+		decode_slots(buf, size, slots);
+	slotted = now() - start;
+
+	printf("message size:                   %zu bytes\n", size);
+	printf("decode to objects + getters:    %.1f ns/msg\n",
+	    generic * 1e9 / iterations);
+	printf("xpc_schema_decode into struct:  %.1f ns/msg\n",
+	    bound * 1e9 / iterations);
+	printf("xpc_schema_decode into slots:   %.1f ns/msg\n",
+	    slotted * 1e9 / iterations);
+
+	free(slots);
+	free(buf);
+	free(wbuf);
+	xpc_schema_free(schema);
+	xpc_schema_free(envelope);
+	return (0);
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Compares transports over loopback. For each transport a server is
+ * forked and the client measures round-trip latency with small
+ * messages, then one-way throughput for a range of message sizes.
+ * Transports are named as in XPC_TRANSPORT; by default unix,
+ * unix-stream and tcp are run in turn. The tcp transport takes its
+ * tuning from XPC_TCP_* as usual.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dispatch/dispatch.h>
+#include <xpc/xpc.h>
+#include "../bench.h"
+
+#define	UNIX_SERVICE	"xpc-transport-bench"
+#define	TCP_SERVICE	"127.0.0.1:47100"
+#define	NPINGS		10000
+#define	VOLUME		(256 * 1024 * 1024)
+#define	MAX_MESSAGES	200000
+#define	SEQPACKET_MAX	60000	/* a unix frame must fit the receive buffer */
+
+static const size_t sizes[] = { 64, 1024, 16384, 60000, 1048576 };
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* Answers every message that asks for an ack */
+static void
+server(const char *service)
+{
+	xpc_connection_t listener;
+
+	listener = xpc_connection_create_mach_service(service, NULL,
+	    XPC_CONNECTION_MACH_SERVICE_LISTENER);
+	if (listener == NULL) {
+		perror("xpc_connection_create_mach_service");
+		exit(1);
+	}
+
+	xpc_connection_set_event_handler(listener, ^(xpc_object_t peer) {
+		xpc_connection_set_event_handler(peer, ^(xpc_object_t event) {
+			xpc_object_t resp;
+
+			if (xpc_get_type(event) != XPC_TYPE_DICTIONARY)
+				return;
+
+			if (xpc_dictionary_get_value(event, "ack") != NULL) {
+				resp = xpc_dictionary_create(NULL, NULL, 0);
+				xpc_dictionary_set_bool(resp, "ack", true);
+				xpc_connection_send_message(peer, resp);
+			}
+
+			xpc_release(event);
+		});
+
+		xpc_connection_resume(peer);
+	});
+
+	xpc_connection_resume(listener);
+	dispatch_main();
+}
+
+static xpc_connection_t
+connect_service(const char *service, dispatch_semaphore_t acked)
+{
+	xpc_connection_t conn;
+	int i;
+
+	/* The server may not be listening yet */
+	for (i = 0; i < 100; i++) {
+		conn = xpc_connection_create_mach_service(service, NULL, 0);
+		if (conn != NULL)
+			break;
+
+		usleep(20000);
+	}
+
+	if (conn == NULL)
+		return (NULL);
+
+	xpc_connection_set_event_handler(conn, ^(xpc_object_t event) {
+		if (xpc_get_type(event) != XPC_TYPE_DICTIONARY)
+			return;
+
+		xpc_release(event);
+		dispatch_semaphore_signal(acked);
+	});
+
+	xpc_connection_resume(conn);
+	return (conn);
+}
+
+static void
+latency(xpc_connection_t conn, dispatch_semaphore_t acked)
+{
+	xpc_object_t ping;
+	double *samples, start, total;
+	int i;
+
+	samples = malloc(NPINGS * sizeof(double));
+	ping = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_bool(ping, "ack", true);
+	for (i = 0, total = 0; i < NPINGS; i++) {
+		start = now();
+		xpc_connection_send_message(conn, ping);
+		dispatch_semaphore_wait(acked, DISPATCH_TIME_FOREVER);
+		samples[i] = (now() - start) * 1e6;
+		total += samples[i];
+	}
+
+	qsort(samples, NPINGS, sizeof(double), compare);
+	printf("  round trip: mean %.1f us, p50 %.1f us, p99 %.1f us\n",
+	    total / NPINGS, samples[NPINGS / 2], samples[NPINGS * 99 / 100]);
+	xpc_release(ping);
+	free(samples);
+}
+
+static void
+throughput(xpc_connection_t conn, dispatch_semaphore_t acked, size_t size)
+{
+	xpc_object_t msg, last;
+	char *payload;
+	double start, elapsed;
+	size_t i, count;
+
+	count = VOLUME / size;
+	if (count > MAX_MESSAGES)
+		count = MAX_MESSAGES;
+
+	payload = malloc(size);
+	memset(payload, 'x', size);
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(msg, "payload", xpc_data_create(payload,
+	    size));
+	last = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(last, "payload", xpc_data_create(payload,
+	    size));
+	xpc_dictionary_set_bool(last, "ack", true);
+
+	/* Sends are queued in order, so the ack comes after all of them */
+	start = now();
+	for (i = 0; i < count - 1; i++)
+		xpc_connection_send_message(conn, msg);
+
+	xpc_connection_send_message(conn, last);
+	dispatch_semaphore_wait(acked, DISPATCH_TIME_FOREVER);
+	elapsed = now() - start;
+
+	printf("  %8zu bytes: %8zu msgs %10.0f msgs/s %9.1f MB/s\n", size,
+	    count, count / elapsed, count * size / elapsed / 1e6);
+	xpc_release(msg);
+	xpc_release(last);
+	free(payload);
+}
+
+static void
+bench(const char *transport)
+{
+	xpc_connection_t conn;
+	dispatch_semaphore_t acked;
+	const char *service;
+	size_t i;
+	pid_t pid;
+
+	/* Read once, when the library first needs a transport */
+	setenv("XPC_TRANSPORT", transport, 1);
+	service = strcmp(transport, "tcp") == 0 ? TCP_SERVICE : UNIX_SERVICE;
+	if ((pid = fork()) == 0)
+		server(service);
+
+	acked = dispatch_semaphore_create(0);
+	if ((conn = connect_service(service, acked)) == NULL) {
+		fprintf(stderr, "%s: cannot connect to %s\n", transport,
+		    service);
+		kill(pid, SIGKILL);
+		exit(1);
+	}
+
+	printf("%s\n", transport);
+	latency(conn, acked);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (strcmp(transport, "unix") == 0 && sizes[i] > SEQPACKET_MAX)
+			continue;
+
+		throughput(conn, acked, sizes[i]);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *defaults[] = { "unix", "unix-stream", "tcp" };
+	const char **transports;
+	int i, count;
+	pid_t pid;
+
+	transports = argc > 1 ? (const char **)argv + 1 : defaults;
+	count = argc > 1 ? argc - 1 : 3;
+
+	/* Each transport gets fresh processes, as the choice is global */
+	for (i = 0; i < count; i++) {
+		fflush(stdout);
+		if ((pid = fork()) == 0)
+			bench(transports[i]);
+
+		waitpid(pid, NULL, 0);
+	}
+
+	return (0);
+}
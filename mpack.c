@@ -1735,6 +1735,7 @@ void mpack_discard(mpack_reader_t* reader) {
                 if (mpack_reader_error(reader))
                     break;
             }
+            mpack_done_array(reader);
             break;
         }
         case mpack_type_map: {
@@ -1744,6 +1745,7 @@ void mpack_discard(mpack_reader_t* reader) {
                 if (mpack_reader_error(reader))
                     break;
             }
+            mpack_done_map(reader);
             break;
         }
         default:
@@ -28,22 +28,6 @@
 #include <xpc/xpc.h>
 #include "blocks_wrapper.h"
 
-bool xpc_dictionary_apply_f(xpc_object_t obj,
-    xpc_dictionary_applier_func_t func, void *context)
-{
-	return (xpc_dictionary_apply(obj, ^(const char *key, xpc_object_t val) {
-	    return func(key, val, context);
-	}));
-}
-
-bool xpc_array_apply_f(xpc_object_t obj, xpc_array_applier_func_t func,
-    void *context)
-{
-	return (xpc_array_apply(obj, ^(size_t index, xpc_object_t val) {
-	    return func(index, val, context);
-	}));
-}
-
 void xpc_connection_set_event_handler_f(xpc_connection_t conn,
     xpc_handler_func_t func, void *context)
 {
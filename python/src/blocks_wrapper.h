@@ -27,12 +27,7 @@
 
 #include <xpc/xpc.h>
 
-typedef bool (*xpc_dictionary_applier_func_t)(const char *, xpc_object_t, void *);
-typedef bool (*xpc_array_applier_func_t)(size_t, xpc_object_t, void *);
 typedef bool (*xpc_handler_func_t)(xpc_object_t, void *);
 
-bool xpc_dictionary_apply_f(xpc_object_t, xpc_dictionary_applier_func_t,
-    void *);
-bool xpc_array_apply_f(xpc_object_t, xpc_array_applier_func_t, void *);
 void xpc_connection_set_event_handler_f(xpc_connection_t, xpc_handler_func_t,
     void *);
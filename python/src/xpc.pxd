@@ -46,13 +46,8 @@ cdef extern from "dispatch/dispatch.h":
 
 
 cdef extern from "blocks_wrapper.h" nogil:
-    ctypedef int (*xpc_dictionary_applier_func_t)(const char *, xpc_object_t, void *)
-    ctypedef int (*xpc_array_applier_func_t)(size_t, xpc_object_t, void *)
     ctypedef void (*xpc_handler_func_t)(xpc_object_t, void *)
 
-    cdef int xpc_dictionary_apply_f(xpc_object_t, xpc_dictionary_applier_func_t,
-        void *)
-    cdef int xpc_array_apply_f(xpc_object_t, xpc_array_applier_func_t, void *)
     cdef void xpc_connection_set_event_handler_f(xpc_connection_t, xpc_handler_func_t,
         void *)
 
@@ -88,6 +83,9 @@ cdef extern from "xpc/xpc.h" nogil:
     enum:
         XPC_CONNECTION_MACH_SERVICE_LISTENER
 
+    ctypedef int (*xpc_dictionary_applier_func_t)(const char *, xpc_object_t, void *)
+    ctypedef int (*xpc_array_applier_func_t)(size_t, xpc_object_t, void *)
+
     cdef void xpc_retain(xpc_object_t object)
     cdef void xpc_release(xpc_object_t object)
     cdef xpc_object_t xpc_copy(xpc_object_t object)
@@ -128,6 +126,7 @@ cdef extern from "xpc/xpc.h" nogil:
     cdef void xpc_dictionary_set_value(xpc_object_t dictionary, const char *key, xpc_object_t value)
     cdef xpc_object_t xpc_dictionary_get_value(xpc_object_t dictionary, const char *key)
     cdef size_t xpc_dictionary_get_count(xpc_object_t dictionary)
+    cdef int xpc_dictionary_apply_f(xpc_object_t dictionary, xpc_dictionary_applier_func_t applier, void *context)
     cdef xpc_connection_t xpc_dictionary_get_remote_connection(xpc_object_t dictionary)
     cdef void xpc_dictionary_set_int(xpc_object_t dictionary, const char *key, int value)
     cdef void xpc_dictionary_set_int64(xpc_object_t dictionary, const char *key, int64_t value)
@@ -155,6 +154,7 @@ cdef extern from "xpc/xpc.h" nogil:
     cdef void xpc_array_append_value(xpc_object_t array, xpc_object_t value)
     cdef xpc_object_t xpc_array_get_value(xpc_object_t array, size_t index)
     cdef size_t xpc_array_get_count(xpc_object_t array)
+    cdef int xpc_array_apply_f(xpc_object_t array, xpc_array_applier_func_t applier, void *context)
     cdef void xpc_array_set_int(xpc_object_t array, size_t index, int value)
     cdef void xpc_array_set_int64(xpc_object_t array, size_t index, int64_t value)
     cdef void xpc_array_set_uint64(xpc_object_t array, size_t index, uint64_t value)
@@ -146,15 +146,20 @@ mach_create_server_source(xpc_port_t port, void *context, dispatch_queue_t tq)
 }
 
 static int
-mach_send(xpc_port_t local, xpc_port_t remote, void *buf, size_t len,
-    struct xpc_resource *res, size_t nres)
+mach_send(xpc_port_t local, xpc_port_t remote, const struct iovec *iov,
+    int iovcnt, struct xpc_resource *res, size_t nres)
 {
 	mach_port_t src, dst;
 	struct xpc_object *xo;
-	size_t size, msg_size;
+	size_t size, msg_size, len;
 	struct xpc_message *message;
 	kern_return_t kr;
-	int err = 0;
+	char *p;
+	int err = 0, i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 
 	message = malloc(sizeof(struct xpc_message) + len);
 	src = (mach_port_t)local;
@@ -168,7 +173,13 @@ mach_send(xpc_port_t local, xpc_port_t remote, void *buf, size_t len,
 	    MACH_MSG_TYPE_MAKE_SEND);
 	message->header.msgh_remote_port = dst;
 	message->header.msgh_local_port = src;
-	memcpy(&message->body, buf, len);
+	/* Inline message bodies have to be gathered here */
+	p = (char *)&message->body;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
 	kr = mach_msg_send(&message->header);
 
 	if (kr != KERN_SUCCESS) {
@@ -0,0 +1,455 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * TCP transport. Service names are "host:port", with the host in
+ * brackets if it is an IPv6 address; a listener with no host binds all
+ * addresses. Frames are sent back to back as on unix-stream, and the
+ * connection reassembles them from the byte stream. TCP carries no
+ * credentials, so those of a peer are left zeroed.
+ *
+ * Tuning comes from the environment:
+ *   XPC_TCP_SNDBUF	SO_SNDBUF of every socket, in bytes
+ *   XPC_TCP_RCVBUF	SO_RCVBUF of every socket, in bytes
+ *   XPC_TCP_ZEROCOPY	send frames of at least this many bytes with
+ *			MSG_ZEROCOPY, where the system has it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dispatch/dispatch.h>
+#include <xpc/xpc.h>
+#ifdef SO_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+#include "../xpc_internal.h"
+
+static int tcp_lookup(const char *name, xpc_port_t *local, xpc_port_t *remote);
+static int tcp_listen(const char *name, xpc_port_t *port);
+static int tcp_release(xpc_port_t port);
+static char *tcp_port_to_string(xpc_port_t port);
+static int tcp_port_compare(xpc_port_t p1, xpc_port_t p2);
+static dispatch_source_t tcp_create_client_source(xpc_port_t port, void *,
+    dispatch_queue_t tq);
+static dispatch_source_t tcp_create_server_source(xpc_port_t port, void *,
+    dispatch_queue_t tq);
+static int tcp_send(xpc_port_t local, xpc_port_t remote,
+    const struct iovec *iov, int iovcnt, struct xpc_resource *res,
+    size_t nres);
+static int tcp_recv(xpc_port_t local, xpc_port_t *remote, void *buf,
+    size_t len, struct xpc_resource **res, size_t *nres,
+    struct xpc_credentials *creds);
+
+static int tcp_sndbuf;
+static int tcp_rcvbuf;
+static size_t tcp_zerocopy;
+static pthread_once_t tcp_config_once = PTHREAD_ONCE_INIT;
+
+static void
+tcp_config(void)
+{
+	char *env;
+
+	if ((env = getenv("XPC_TCP_SNDBUF")) != NULL)
+		tcp_sndbuf = (int)strtol(env, NULL, 0);
+
+	if ((env = getenv("XPC_TCP_RCVBUF")) != NULL)
+		tcp_rcvbuf = (int)strtol(env, NULL, 0);
+
+	if ((env = getenv("XPC_TCP_ZEROCOPY")) != NULL)
+		tcp_zerocopy = (size_t)strtoull(env, NULL, 0);
+}
+
+/*
+ * Sockets are non-blocking: a read source may fire with nothing to
+ * read, for instance for zero-copy completions, and must not stall the
+ * receive queue.
+ */
+static void
+tcp_setup(int fd)
+{
+	int on = 1;
+
+	pthread_once(&tcp_config_once, tcp_config);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (tcp_sndbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tcp_sndbuf,
+		    sizeof(tcp_sndbuf));
+
+	if (tcp_rcvbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tcp_rcvbuf,
+		    sizeof(tcp_rcvbuf));
+
+#ifdef SO_ZEROCOPY
+	if (tcp_zerocopy > 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0)
+		debugf("SO_ZEROCOPY failed: %s", strerror(errno));
+#endif
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int
+tcp_resolve(const char *name, bool passive, struct addrinfo **res)
+{
+	struct addrinfo hints;
+	char *host, *port;
+	int err;
+
+	if ((host = strdup(name)) == NULL)
+		return (-1);
+
+	if ((port = strrchr(host, ':')) == NULL) {
+		free(host);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	err = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, res);
+	free(host);
+	if (err != 0) {
+		debugf("cannot resolve %s: %s", name, gai_strerror(err));
+		errno = ENOENT;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+tcp_lookup(const char *name, xpc_port_t *port, xpc_port_t *unused __unused)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (tcp_resolve(name, false, &res) != 0)
+		return (-1);
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		debugf("connect failed: %s", strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd == -1)
+		return (-1);
+
+	tcp_setup(fd);
+	*port = (xpc_port_t)(long)fd;
+	return (0);
+}
+
+static int
+tcp_listen(const char *name, xpc_port_t *port)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1, on = 1;
+
+	if (tcp_resolve(name, true, &res) != 0)
+		return (-1);
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, SOMAXCONN) == 0)
+			break;
+
+		debugf("bind failed: %s", strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd == -1)
+		return (-1);
+
+	*port = (xpc_port_t)(long)fd;
+	return (0);
+}
+
+static int
+tcp_release(xpc_port_t port)
+{
+	int fd = (int)port;
+
+	if (fd != -1)
+		close(fd);
+
+	return (0);
+}
+
+static char *
+tcp_port_to_string(xpc_port_t port)
+{
+	int fd = (int)port;
+	char *ret;
+
+	if (fd == -1) {
+		asprintf(&ret, "<invalid>");
+		return (ret);
+	}
+
+	asprintf(&ret, "<%d>", fd);
+	return (ret);
+}
+
+static int
+tcp_port_compare(xpc_port_t p1, xpc_port_t p2)
+{
+	return (int)p1 == (int)p2;
+}
+
+static dispatch_source_t
+tcp_create_client_source(xpc_port_t port, void *context, dispatch_queue_t tq)
+{
+	int fd = (int)port;
+	dispatch_source_t ret;
+
+	ret = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
+	    (uintptr_t)fd, 0, tq);
+
+	dispatch_set_context(ret, context);
+	dispatch_source_set_event_handler_f(ret, xpc_connection_recv_message);
+	dispatch_source_set_cancel_handler(ret, ^{
+	    shutdown(fd, SHUT_RDWR);
+	    close(fd);
+	    xpc_connection_destroy_peer(dispatch_get_context(ret));
+	});
+
+	return (ret);
+}
+
+static dispatch_source_t
+tcp_create_server_source(xpc_port_t port, void *context, dispatch_queue_t tq)
+{
+	int fd = (int)port;
+	dispatch_source_t ret;
+
+	ret = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
+	    (uintptr_t)fd, 0, tq);
+	dispatch_source_set_event_handler(ret, ^{
+		int sock;
+		xpc_port_t client_port;
+		dispatch_source_t client_source;
+
+		if ((sock = accept(fd, NULL, NULL)) == -1) {
+			debugf("accept failed: %s", strerror(errno));
+			return;
+		}
+
+		tcp_setup(sock);
+		client_port = (xpc_port_t)(long)sock;
+		client_source = tcp_create_client_source(client_port, NULL, tq);
+		xpc_connection_new_peer(context, client_port, -1, client_source);
+	});
+
+	return (ret);
+}
+
+#ifdef SO_ZEROCOPY
+/*
+ * Zero-copy sends pin the caller's pages until the kernel is done with
+ * them, while our callers free or reuse their buffers as soon as a send
+ * returns; so we wait here for the completions of the count sends just
+ * made, which arrive on the socket's error queue.
+ */
+static int
+tcp_zerocopy_wait(int fd, uint32_t count)
+{
+	struct pollfd pfd = { .fd = fd, .events = 0 };
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	char control[128];
+
+	while (count > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				return (-1);
+
+			poll(&pfd, 1, -1);
+			continue;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* ee_info to ee_data is the range of sends done */
+			count -= serr->ee_data - serr->ee_info + 1;
+		}
+	}
+
+	return (0);
+}
+#endif
+
+static int
+tcp_send(xpc_port_t local, xpc_port_t remote __unused,
+    const struct iovec *iov, int iovcnt, struct xpc_resource *res __unused,
+    size_t nres __unused)
+{
+	int fd = (int)local;
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	struct iovec *rest, *v;
+	struct msghdr msg;
+	size_t total;
+	ssize_t n;
+	uint32_t zc = 0;
+	int i, flags = 0, ret = 0;
+
+	debugf("local=%s, iovcnt=%d", tcp_port_to_string(local), iovcnt);
+
+	for (i = 0, total = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+#ifdef SO_ZEROCOPY
+	if (tcp_zerocopy > 0 && total >= tcp_zerocopy)
+		flags |= MSG_ZEROCOPY;
+#endif
+
+	/* The socket is non-blocking, so the frame may take several sends */
+	if ((rest = malloc(iovcnt * sizeof(*rest))) == NULL)
+		return (-1);
+
+	memcpy(rest, iov, iovcnt * sizeof(*rest));
+	v = rest;
+	while (iovcnt > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = v;
+		msg.msg_iovlen = iovcnt;
+		n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				poll(&pfd, 1, -1);
+				continue;
+			}
+
+#ifdef SO_ZEROCOPY
+			/* Out of locked memory; copy instead */
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+#endif
+			ret = -1;
+			break;
+		}
+
+		/* Each zero-copy send gets a completion of its own */
+		if (flags != 0)
+			zc++;
+
+		for (; iovcnt > 0 && (size_t)n >= v->iov_len; v++, iovcnt--)
+			n -= v->iov_len;
+
+		if (iovcnt > 0) {
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+
+	free(rest);
+#ifdef SO_ZEROCOPY
+	if (zc > 0 && tcp_zerocopy_wait(fd, zc) != 0)
+		ret = -1;
+#endif
+	return (ret);
+}
+
+static int
+tcp_recv(xpc_port_t local, xpc_port_t *remote, void *buf, size_t len,
+    struct xpc_resource **res __unused, size_t *nres __unused,
+    struct xpc_credentials *creds __unused)
+{
+	int fd = (int)local;
+	ssize_t recvd;
+
+	recvd = recv(fd, buf, len, 0);
+	if (recvd < 0)
+		return (-1);
+
+	*remote = NULL;
+	debugf("local=%s, msg=%p, len=%ld", tcp_port_to_string(local), buf,
+	    recvd);
+
+	return (recvd);
+}
+
+struct xpc_transport tcp_transport = {
+    	.xt_name = "tcp",
+	.xt_listen = tcp_listen,
+	.xt_lookup = tcp_lookup,
+	.xt_release = tcp_release,
+    	.xt_port_to_string = tcp_port_to_string,
+    	.xt_port_compare = tcp_port_compare,
+    	.xt_create_server_source = tcp_create_server_source,
+    	.xt_create_client_source = tcp_create_client_source,
+	.xt_send = tcp_send,
+	.xt_recv = tcp_recv,
+	.xt_stream = true
+};
@@ -45,6 +45,9 @@
 
 static int unix_lookup(const char *name, xpc_port_t *local, xpc_port_t *remote);
 static int unix_listen(const char *name, xpc_port_t *port);
+static int unix_stream_lookup(const char *name, xpc_port_t *local,
+    xpc_port_t *remote);
+static int unix_stream_listen(const char *name, xpc_port_t *port);
 static int unix_release(xpc_port_t port);
 static char *unix_port_to_string(xpc_port_t port);
 static int unix_port_compare(xpc_port_t p1, xpc_port_t p2);
@@ -52,14 +55,15 @@ static dispatch_source_t unix_create_client_source(xpc_port_t port, void *,
     dispatch_queue_t tq);
 static dispatch_source_t unix_create_server_source(xpc_port_t port, void *,
     dispatch_queue_t tq);
-static int unix_send(xpc_port_t local, xpc_port_t remote, void *buf,
-    size_t len, struct xpc_resource *res, size_t nres);
+static int unix_send(xpc_port_t local, xpc_port_t remote,
+    const struct iovec *iov, int iovcnt, struct xpc_resource *res,
+    size_t nres);
 static int unix_recv(xpc_port_t local, xpc_port_t *remote, void *buf,
     size_t len, struct xpc_resource **res, size_t *nres,
     struct xpc_credentials *creds);
 
 static int
-unix_lookup(const char *name, xpc_port_t *port, xpc_port_t *unused __unused)
+unix_connect(const char *name, int type, xpc_port_t *port)
 {
 	struct sockaddr_un addr;
 	int ret;
@@ -67,7 +71,7 @@ unix_lookup(const char *name, xpc_port_t *port, xpc_port_t *unused __unused)
 
 	asprintf(&path, "%s/%s", SOCKET_DIR, name);
 
-	ret = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	ret = socket(AF_UNIX, type, 0);
 	addr.sun_family = AF_UNIX;
 	addr.sun_len = sizeof(struct sockaddr_un);
 	strncpy(addr.sun_path, path, sizeof(addr.sun_path));
@@ -83,7 +87,7 @@ unix_lookup(const char *name, xpc_port_t *port, xpc_port_t *unused __unused)
 }
 
 static int
-unix_listen(const char *name, xpc_port_t *port)
+unix_bind(const char *name, int type, xpc_port_t *port)
 {
 	struct sockaddr_un addr;
 	char *path;
@@ -96,7 +100,7 @@ unix_listen(const char *name, xpc_port_t *port)
 	addr.sun_len = sizeof(struct sockaddr_un);
 	strncpy(addr.sun_path, path, sizeof(addr.sun_path));
 
-	ret = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	ret = socket(AF_UNIX, type, 0);
 	if (ret == -1)
 		return (-1);
 
@@ -114,6 +118,40 @@ unix_listen(const char *name, xpc_port_t *port)
 	return (0);
 }
 
+static int
+unix_lookup(const char *name, xpc_port_t *port, xpc_port_t *unused __unused)
+{
+
+	return (unix_connect(name, SOCK_SEQPACKET, port));
+}
+
+static int
+unix_listen(const char *name, xpc_port_t *port)
+{
+
+	return (unix_bind(name, SOCK_SEQPACKET, port));
+}
+
+/*
+ * The stream flavour carries the same frames over SOCK_STREAM, so
+ * neither a frame's size nor the number of frames per read is bounded
+ * by the socket; xpc_pipe_receive() splits the byte stream up.
+ */
+static int
+unix_stream_lookup(const char *name, xpc_port_t *port,
+    xpc_port_t *unused __unused)
+{
+
+	return (unix_connect(name, SOCK_STREAM, port));
+}
+
+static int
+unix_stream_listen(const char *name, xpc_port_t *port)
+{
+
+	return (unix_bind(name, SOCK_STREAM, port));
+}
+
 static int
 unix_release(xpc_port_t port)
 {
@@ -190,23 +228,70 @@ unix_create_server_source(xpc_port_t port, void *context, dispatch_queue_t tq)
 	return (ret);
 }
 
+/*
+ * A seqpacket send is all or nothing, but a stream one may stop short,
+ * for instance when interrupted; the rest of the frame goes out without
+ * ancillary data, which came with its first bytes.
+ */
+static int
+unix_send_rest(int fd, const struct iovec *iov, int iovcnt, size_t sent)
+{
+	struct iovec *rest, *v;
+	ssize_t n;
+	int i, cnt;
+
+	for (i = 0; i < iovcnt && sent >= iov[i].iov_len; i++)
+		sent -= iov[i].iov_len;
+
+	if (i == iovcnt)
+		return (0);
+
+	cnt = iovcnt - i;
+	if ((rest = malloc(cnt * sizeof(*rest))) == NULL)
+		return (-1);
+
+	memcpy(rest, &iov[i], cnt * sizeof(*rest));
+	v = rest;
+	for (;;) {
+		v->iov_base = (char *)v->iov_base + sent;
+		v->iov_len -= sent;
+		n = writev(fd, v, cnt);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+
+		if (n < 0) {
+			free(rest);
+			return (-1);
+		}
+
+		for (sent = n; cnt > 0 && sent >= v->iov_len; v++, cnt--)
+			sent -= v->iov_len;
+
+		if (cnt == 0)
+			break;
+	}
+
+	free(rest);
+	return (0);
+}
+
 static int
-unix_send(xpc_port_t local, xpc_port_t remote __unused, void *buf, size_t len,
-    struct xpc_resource *res, size_t nres)
+unix_send(xpc_port_t local, xpc_port_t remote __unused,
+    const struct iovec *iov, int iovcnt, struct xpc_resource *res, size_t nres)
 {
 	int fd = (int)local;
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
-	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	ssize_t sent;
 	int i, nfds = 0;
 
-	debugf("local=%s, remote=%s, msg=%p, size=%ld",
+	debugf("local=%s, remote=%s, iovcnt=%d",
 	    unix_port_to_string(local), unix_port_to_string(remote),
-	    buf, len);
+	    iovcnt);
 
 	memset(&msg, 0, sizeof(struct msghdr));
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
 	msg.msg_controllen = CMSG_SPACE(sizeof(struct cmsgcred));
 	msg.msg_control = malloc(msg.msg_controllen);
 
@@ -238,10 +323,12 @@ unix_send(xpc_port_t local, xpc_port_t remote __unused, void *buf, size_t len,
 		}
 	}
 
-	if (sendmsg(fd, &msg, 0) < 0)
+	sent = sendmsg(fd, &msg, 0);
+	free(msg.msg_control);
+	if (sent < 0)
 		return (-1);
 
-	return (0);
+	return (unix_send_rest(fd, iov, iovcnt, (size_t)sent));
 }
 
 static int
@@ -323,3 +410,17 @@ struct xpc_transport unix_transport = {
 	.xt_send = unix_send,
 	.xt_recv = unix_recv
 };
+
+struct xpc_transport unix_stream_transport = {
+    	.xt_name = "unix-stream",
+	.xt_listen = unix_stream_listen,
+	.xt_lookup = unix_stream_lookup,
+	.xt_release = unix_release,
+    	.xt_port_to_string = unix_port_to_string,
+    	.xt_port_compare = unix_port_compare,
+    	.xt_create_server_source = unix_create_server_source,
+    	.xt_create_client_source = unix_create_client_source,
+	.xt_send = unix_send,
+	.xt_recv = unix_recv,
+	.xt_stream = true
+};
@@ -400,6 +400,355 @@ XPC_EXPORT XPC_NONNULL_ALL
 void
 xpc_connection_send_message(xpc_connection_t connection, xpc_object_t message);
 
+/*!
+ * @function xpc_connection_send_serialized
+ * Sends a message that is already serialized in the wire format.
+ *
+ * @param connection
+ * The connection over which the message shall be sent.
+ *
+ * @param buf
+ * A MessagePack encoded dictionary without framing, such as the output of
+ * xpc_serialize() or of an encoder generated by xpcgen. The receiving end
+ * decodes it like any other message.
+ *
+ * @param length
+ * The length of the message.
+ *
+ * @discussion
+ * The connection adds the frame header and sends it together with the
+ * buffer, which is not copied. This call waits for messages already queued
+ * on the connection to go out first, and returns once the buffer has been
+ * handed to the transport, so the buffer can be reused right away. Delivery
+ * guarantees are those of xpc_connection_send_message().
+ */
+XPC_EXPORT XPC_NONNULL1 XPC_NONNULL2
+void
+xpc_connection_send_serialized(xpc_connection_t connection, const void *buf,
+	size_t length);
+
+/*!
+ * @function xpc_serialized_size
+ * Returns the exact size of a message in the wire format.
+ *
+ * @param message
+ * The message to measure. This must be a dictionary object.
+ *
+ * @result
+ * The number of bytes xpc_serialize() writes for the message, or 0 with
+ * errno set to EINVAL if it is not a dictionary.
+ *
+ * @discussion
+ * The size is computed by walking the message, without encoding it. It
+ * holds until the message or anything in it changes. It covers the message
+ * body only; the frame header a connection adds when sending is not
+ * included.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL1
+size_t
+xpc_serialized_size(xpc_object_t message);
+
+/*!
+ * @function xpc_serialize
+ * Serializes a message into a buffer provided by the caller.
+ *
+ * @param message
+ * The message to serialize. This must be a dictionary object.
+ *
+ * @param buf
+ * The buffer to serialize into.
+ *
+ * @param size
+ * The size of the buffer. xpc_serialized_size() tells how much is needed.
+ *
+ * @result
+ * The number of bytes written, or 0 with errno set to EINVAL if the message
+ * is not a dictionary, or ENOBUFS if it does not fit. The contents of the
+ * buffer are undefined on failure.
+ *
+ * @discussion
+ * Nothing is allocated. The output is the bare message body, with no frame
+ * header; it can be sent with xpc_connection_send_serialized(), which adds
+ * the framing.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL1 XPC_NONNULL2
+size_t
+xpc_serialize(xpc_object_t message, void *buf, size_t size);
+
+/*!
+ * @typedef xpc_encoded_t
+ * A message encoded once, to be sent over any number of connections.
+ */
+typedef struct xpc_encoded *xpc_encoded_t;
+
+/*!
+ * @function xpc_encoded_create
+ * Encodes a message for sending over many connections.
+ *
+ * @param message
+ * The message to encode. This must be a dictionary object. Later changes to
+ * it do not affect the encoded message.
+ *
+ * @result
+ * A new encoded message, or NULL on failure. Release it with
+ * xpc_encoded_release().
+ *
+ * @discussion
+ * The message is encoded with plain string keys and without compression,
+ * since both depend on the connection it goes out on.
+ */
+XPC_EXPORT XPC_MALLOC XPC_WARN_RESULT XPC_NONNULL1
+xpc_encoded_t
+xpc_encoded_create(xpc_object_t message);
+
+/*!
+ * @function xpc_encoded_retain
+ * Increments the reference count of an encoded message.
+ *
+ * @param encoded
+ * The encoded message.
+ *
+ * @result
+ * The encoded message.
+ */
+XPC_EXPORT XPC_NONNULL1
+xpc_encoded_t
+xpc_encoded_retain(xpc_encoded_t encoded);
+
+/*!
+ * @function xpc_encoded_release
+ * Decrements the reference count of an encoded message, freeing it once the
+ * count reaches zero.
+ *
+ * @param encoded
+ * The encoded message.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_encoded_release(xpc_encoded_t encoded);
+
+/*!
+ * @function xpc_connection_send_encoded
+ * Sends an encoded message over the connection.
+ *
+ * @param connection
+ * The connection over which the message shall be sent.
+ *
+ * @param encoded
+ * The message to send. The connection holds a reference until it is sent.
+ *
+ * @discussion
+ * Delivery guarantees are those of xpc_connection_send_message().
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_connection_send_encoded(xpc_connection_t connection,
+	xpc_encoded_t encoded);
+
+/*!
+ * @function xpc_connection_broadcast
+ * Sends an encoded message to every peer of a listener.
+ *
+ * @param connection
+ * The listener connection.
+ *
+ * @param encoded
+ * The message to send. The connection holds a reference until it is sent
+ * to all peers.
+ *
+ * @discussion
+ * The message goes to the peers connected once the listener gets to it, in
+ * the order of xpc_connection_send_encoded() on each of them. It is not
+ * encoded again for any peer.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_connection_broadcast(xpc_connection_t connection, xpc_encoded_t encoded);
+
+/*!
+ * @typedef xpc_frame_handler_t
+ * A handler for messages received undecoded. It owns the message and
+ * releases it with xpc_encoded_release().
+ */
+typedef void (^xpc_frame_handler_t)(xpc_encoded_t frame);
+
+/*!
+ * @function xpc_connection_set_frame_handler
+ * Makes the connection deliver its messages without decoding them.
+ *
+ * @param connection
+ * The connection to configure. This should be done before it is resumed.
+ *
+ * @param handler
+ * The handler to invoke with each message received, on the connection's
+ * target queue. The event handler is not called for messages any more.
+ *
+ * @discussion
+ * This is meant for brokers that pass messages on: a message received this
+ * way can be given to xpc_connection_send_encoded() on another connection,
+ * which sends it out as received, method ID included, under an ID of its
+ * own. xpc_encoded_get_string() and xpc_encoded_get_int64() read a
+ * top-level value of the message for routing. The connection does not let
+ * its peer replace keys with key table IDs, as those would mean nothing on
+ * the next hop; compressed messages are delivered inflated.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_connection_set_frame_handler(xpc_connection_t connection,
+	xpc_frame_handler_t handler);
+
+/*!
+ * @function xpc_encoded_get_string
+ * Looks up a string in the top level of an encoded message.
+ *
+ * @param encoded
+ * The encoded message.
+ *
+ * @param key
+ * The key to look up.
+ *
+ * @param string
+ * Where to store a pointer to the string, which lives in the encoded
+ * message and is not NUL-terminated.
+ *
+ * @param length
+ * Where to store the length of the string.
+ *
+ * @result
+ * true if the message has a string under the key.
+ *
+ * @discussion
+ * The message is scanned up to the key, skipping over the values of other
+ * keys, without creating any object.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL_ALL
+bool
+xpc_encoded_get_string(xpc_encoded_t encoded, const char *key,
+	const char **string, size_t *length);
+
+/*!
+ * @function xpc_encoded_get_int64
+ * Looks up an integer in the top level of an encoded message.
+ *
+ * @param encoded
+ * The encoded message.
+ *
+ * @param key
+ * The key to look up.
+ *
+ * @param value
+ * Where to store the integer.
+ *
+ * @result
+ * true if the message has an integer under the key that fits in an int64_t.
+ *
+ * @discussion
+ * See xpc_encoded_get_string().
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL_ALL
+bool
+xpc_encoded_get_int64(xpc_encoded_t encoded, const char *key,
+	int64_t *value);
+
+/*!
+ * @function xpc_connection_set_inline_delivery
+ * Makes the connection run its handlers as messages are received, rather
+ * than on its target queue.
+ *
+ * @param connection
+ * The connection to configure. This should be done before it is resumed.
+ *
+ * @param enable
+ * Whether handlers run inline.
+ *
+ * @discussion
+ * The event handler, reply handlers, routed handlers and the frame handler
+ * are called on the connection's receive queue, as soon as each message is
+ * decoded, saving a thread handoff per message. Messages from a peer are
+ * still handled one at a time, in the order they were sent, replies
+ * included; the next message is not read until the handler returns. A
+ * listener passes the setting on to its peers, and the event handler of an
+ * inline listener sees each new peer before any of its messages. Errors
+ * reported when a peer goes away still go through the target queue.
+ *
+ * A handler that blocks holds up all delivery on the connection. The peers
+ * of a listener are all read on the listener's receive queue, whatever the
+ * transport, so a handler that blocks on one peer holds up every other
+ * peer of that listener too. In particular, a handler must not call
+ * xpc_connection_send_message_with_reply_sync() on its own connection, as
+ * the reply could never be received.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_connection_set_inline_delivery(xpc_connection_t connection, bool enable);
+
+/*!
+ * @function xpc_connection_set_concurrency
+ * Lets the connection handle several of its messages at once, in no
+ * particular order.
+ *
+ * @param connection
+ * The connection to configure. The change is made between two messages;
+ * handlers already running are not waited for.
+ *
+ * @param limit
+ * How many handler invocations may run at once. 0 or 1 restores ordered
+ * delivery, which is the default.
+ *
+ * @discussion
+ * This is meant for stateless services, which can then spread the messages
+ * of a single busy client over several cores. The event handler, reply
+ * handlers, routed handlers and the frame handler run on a global
+ * concurrent queue rather than on the target queue, and may run
+ * concurrently with each other and finish in any order. Once limit
+ * invocations are running, the connection stops reading until one of them
+ * returns; no thread waits meanwhile. The other peers of a listener are
+ * still read, except with the mach transport, where the listener receives
+ * for all of them. A listener passes the setting on to its peers, each of which
+ * gets a limit of its own; new peers are still announced one at a time,
+ * as usual. This takes precedence over xpc_connection_set_inline_delivery()
+ * for messages.
+ *
+ * Replies may be sent in any order too: a reply created with
+ * xpc_dictionary_create_reply() carries the ID of the message it answers,
+ * which is what the caller matches it by. A handler must not make a
+ * synchronous call on its own connection, as all slots may be taken by
+ * handlers waiting for replies that can no longer be read.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_connection_set_concurrency(xpc_connection_t connection, uint32_t limit);
+
+/*!
+ * @function xpc_connection_set_batching
+ * Lets the connection send several small messages in one frame.
+ *
+ * @param connection
+ * The connection to configure.
+ *
+ * @param latency
+ * How long, in nanoseconds, a message may wait for others to share its
+ * frame. 0 turns batching off, which is the default.
+ *
+ * @param max_size
+ * The largest batch, in bytes of encoded messages. A batch that would grow
+ * past it is sent first; a message larger than that on its own is never
+ * batched.
+ *
+ * @discussion
+ * The batch goes out when the first message in it has waited for the
+ * latency, or once it is full. Messages keep their order with everything
+ * else sent on the connection, which sends the batch out first, and the
+ * receiving side delivers them one by one as usual.
+ * xpc_connection_send_message_with_reply_sync() does not wait for the
+ * window. Peers that do not understand batches are sent messages one by
+ * one.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_connection_set_batching(xpc_connection_t connection, uint64_t latency,
+	size_t max_size);
+
 /*!
  * @function xpc_connection_send_barrier
  * Issues a barrier against the connection's message-send activity.
@@ -511,10 +860,13 @@ xpc_connection_send_message_with_reply(xpc_connection_t connection,
  * You are responsible for releasing the returned object.
  *
  * @discussion
- * This API is primarily for transitional purposes. Its implementation is
- * conceptually equivalent to calling xpc_connection_send_message_with_reply()
- * and then immediately blocking the calling thread on a semaphore and
- * signaling the semaphore from the reply block. 
+ * This API is primarily for transitional purposes. The message is sent from
+ * the calling thread when no other send is in progress, in order with
+ * messages sent before it, and the reply is handed to the calling thread as
+ * soon as it is received, without going through the connection's target
+ * queue. Each thread waits on a semaphore of its own, kept from call to call.
+ * The reply is matched by the ID of the message; the remote service should
+ * create it with xpc_dictionary_create_reply().
  *
  * Be judicious about your use of this API. It can block indefinitely, so if you
  * are using it to implement an API that can be called from the main thread, you
@@ -386,6 +386,27 @@ xpc_release(xpc_object_t object);
 		_xpc_object_validate(_o); [_o release]; })
 #endif // OS_OBJECT_USE_OBJC_RETAIN_RELEASE
 
+/*!
+ * @function xpc_set_deferred_reclaim_threshold
+ *
+ * @abstract
+ * Moves the teardown of large object graphs off the releasing thread.
+ *
+ * @param nodes
+ * The maximum number of objects freed by a single xpc_release() call before
+ * the rest of the graph is handed to a background queue. 0, the default,
+ * frees everything on the releasing thread.
+ *
+ * @discussion
+ * Objects are always freed iteratively, so releasing a deeply nested graph
+ * cannot overflow the stack. With a threshold set, releasing a large
+ * message costs at most that many calls to free() on the caller's thread;
+ * the remainder is reclaimed by a serial queue at background priority.
+ */
+XPC_EXPORT
+void
+xpc_set_deferred_reclaim_threshold(size_t nodes);
+
 /*!
  * @function xpc_get_type
  *
@@ -1118,6 +1139,25 @@ xpc_shmem_map(xpc_object_t xshmem, void **region);
 typedef bool (^xpc_array_applier_t)(size_t index, xpc_object_t value);
 #endif // __BLOCKS__ 
 
+/*!
+ * @typedef xpc_array_applier_func_t
+ * A function to be invoked for every value in the array.
+ *
+ * @param index
+ * The current index in the iteration.
+ *
+ * @param value
+ * The current value in the iteration.
+ *
+ * @param context
+ * The context pointer given to xpc_array_apply_f().
+ *
+ * @result
+ * A Boolean indicating whether iteration should continue.
+ */
+typedef bool (*xpc_array_applier_func_t)(size_t index, xpc_object_t value,
+	void *context);
+
 /*!
  * @function xpc_array_create
  *
@@ -1260,6 +1300,33 @@ bool
 xpc_array_apply(xpc_object_t xarray, xpc_array_applier_t applier);
 #endif // __BLOCKS__ 
 
+/*!
+ * @function xpc_array_apply_f
+ *
+ * @abstract
+ * Invokes the given function for every value in the array.
+ *
+ * @param xarray
+ * The array object which is to be examined.
+ *
+ * @param applier
+ * The function which this function applies to every element in the array.
+ *
+ * @param context
+ * An arbitrary pointer passed through to the applier.
+ *
+ * @result
+ * A Boolean indicating whether iteration of the array completed successfully.
+ * Iteration will only fail if the applier function returns false.
+ *
+ * @discussion
+ * Behaves like xpc_array_apply() without the cost of invoking a block.
+ */
+XPC_EXPORT XPC_NONNULL1 XPC_NONNULL2
+bool
+xpc_array_apply_f(xpc_object_t xarray, xpc_array_applier_func_t applier,
+	void *context);
+
 #pragma mark Array Primitive Setters
 /*!
  * @define XPC_ARRAY_APPEND
@@ -1766,6 +1833,131 @@ XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL1
 xpc_connection_t
 xpc_array_create_connection(xpc_object_t xarray, size_t index);
 
+#pragma mark Typed Array
+/*!
+ * @define XPC_ARRAY_TYPE_INT64
+ * Element type of a typed array holding int64_t values.
+ */
+#define XPC_ARRAY_TYPE_INT64	1
+
+/*!
+ * @define XPC_ARRAY_TYPE_UINT64
+ * Element type of a typed array holding uint64_t values.
+ */
+#define XPC_ARRAY_TYPE_UINT64	2
+
+/*!
+ * @define XPC_ARRAY_TYPE_DOUBLE
+ * Element type of a typed array holding double values.
+ */
+#define XPC_ARRAY_TYPE_DOUBLE	3
+
+/*!
+ * @define XPC_ARRAY_TYPE_FLOAT
+ * Element type of a typed array holding float values. Elements are presented
+ * as doubles by the array getters and applier.
+ */
+#define XPC_ARRAY_TYPE_FLOAT	4
+
+/*!
+ * @define XPC_ARRAY_TYPE_UINT8
+ * Element type of a typed array holding uint8_t values. Elements are presented
+ * as unsigned integers by the array getters and applier.
+ */
+#define XPC_ARRAY_TYPE_UINT8	5
+
+/*!
+ * @function xpc_typed_array_create
+ *
+ * @abstract
+ * Creates an array storing numeric values of a single type contiguously.
+ *
+ * @param type
+ * The element type, one of the XPC_ARRAY_TYPE_* constants.
+ *
+ * @param values
+ * A C-array of count elements of the given type, which is copied into the
+ * new array. If NULL, the array is filled with count zeroes.
+ *
+ * @param count
+ * The number of elements to initialize the array with.
+ *
+ * @result
+ * The new array object, or NULL if the element type is not recognized.
+ *
+ * @discussion
+ * A typed array holds its elements in one buffer rather than as one object
+ * per element, and is sent as a single msgpack extension whose payload is the
+ * elements in little-endian order. This makes it much cheaper than a regular
+ * array for bulk numeric data.
+ *
+ * xpc_get_type() reports a typed array as XPC_TYPE_ARRAY. The primitive array
+ * getters, setters and xpc_array_apply() work on it, with setters ignoring
+ * values whose type does not match the element type. Because its elements are
+ * not objects, xpc_array_get_value() always returns NULL for a typed array.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT
+xpc_object_t
+xpc_typed_array_create(int type, const void *values, size_t count);
+
+/*!
+ * @function xpc_typed_array_get_element_type
+ *
+ * @abstract
+ * Returns the element type of a typed array.
+ *
+ * @param xarray
+ * The array object which is to be examined.
+ *
+ * @result
+ * One of the XPC_ARRAY_TYPE_* constants, or 0 if the given object is not a
+ * typed array.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL1
+int
+xpc_typed_array_get_element_type(xpc_object_t xarray);
+
+/*!
+ * @function xpc_typed_array_get_pointer
+ *
+ * @abstract
+ * Returns a pointer to the elements of a typed array.
+ *
+ * @param xarray
+ * The array object which is to be examined.
+ *
+ * @param count
+ * If not NULL, receives the number of elements in the array.
+ *
+ * @result
+ * A pointer to the elements in host byte order, or NULL if the given object
+ * is not a typed array. The elements may be modified in place. The pointer is
+ * invalidated by any call that grows the array.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL1
+void *
+xpc_typed_array_get_pointer(xpc_object_t xarray, size_t *count);
+
+/*!
+ * @function xpc_typed_array_append
+ *
+ * @abstract
+ * Appends elements to a typed array.
+ *
+ * @param xarray
+ * The array object which is to be manipulated.
+ *
+ * @param values
+ * A C-array of count elements of the array's element type. If NULL, count
+ * zeroes are appended.
+ *
+ * @param count
+ * The number of elements to append.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_typed_array_append(xpc_object_t xarray, const void *values, size_t count);
+
 #pragma mark Dictionary
 /*!
  * @typedef xpc_dictionary_applier_t
@@ -1784,6 +1976,25 @@ xpc_array_create_connection(xpc_object_t xarray, size_t index);
 typedef bool (^xpc_dictionary_applier_t)(const char *key, xpc_object_t value);
 #endif // __BLOCKS__ 
 
+/*!
+ * @typedef xpc_dictionary_applier_func_t
+ * A function to be invoked for every key/value pair in the dictionary.
+ *
+ * @param key
+ * The current key in the iteration.
+ *
+ * @param value
+ * The current value in the iteration.
+ *
+ * @param context
+ * The context pointer given to xpc_dictionary_apply_f().
+ *
+ * @result
+ * A Boolean indicating whether iteration should continue.
+ */
+typedef bool (*xpc_dictionary_applier_func_t)(const char *key,
+	xpc_object_t value, void *context);
+
 /*!
  * @function xpc_dictionary_create
  *
@@ -1820,6 +2031,71 @@ xpc_object_t
 xpc_dictionary_create(const char * const *keys, const xpc_object_t *values,
 	size_t count);
 
+/*!
+ * @typedef xpc_dictionary_builder_t
+ * A dictionary under construction by xpc_dictionary_builder_append().
+ */
+typedef struct xpc_dictionary_builder *xpc_dictionary_builder_t;
+
+/*!
+ * @function xpc_dictionary_builder_create
+ *
+ * @abstract
+ * Starts building a dictionary whose number of entries is known up front.
+ *
+ * @param capacity
+ * The number of entries to reserve room for. Storage for that many entries is
+ * allocated together with the dictionary itself.
+ *
+ * @result
+ * A new builder, which must be passed to xpc_dictionary_builder_finish().
+ */
+XPC_EXPORT XPC_MALLOC XPC_WARN_RESULT
+xpc_dictionary_builder_t
+xpc_dictionary_builder_create(size_t capacity);
+
+/*!
+ * @function xpc_dictionary_builder_append
+ *
+ * @abstract
+ * Adds an entry to a dictionary under construction.
+ *
+ * @param builder
+ * The builder to append to.
+ *
+ * @param key
+ * The key of the new entry, which is copied. The caller guarantees that no
+ * entry with the same key was appended before; this is not checked.
+ *
+ * @param value
+ * The value of the new entry, which is retained.
+ *
+ * @discussion
+ * Appending takes constant time. Entries beyond the reserved capacity are
+ * allocated individually.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_dictionary_builder_append(xpc_dictionary_builder_t builder,
+	const char *key, xpc_object_t value);
+
+/*!
+ * @function xpc_dictionary_builder_finish
+ *
+ * @abstract
+ * Completes construction of a dictionary.
+ *
+ * @param builder
+ * The builder to finish. It must not be used afterwards.
+ *
+ * @result
+ * A regular dictionary holding the appended entries in order. You are
+ * responsible for calling xpc_release() on it.
+ */
+XPC_EXPORT XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL1
+xpc_object_t
+xpc_dictionary_builder_finish(xpc_dictionary_builder_t builder);
+
 /*!
  * @function xpc_dictionary_create_reply
  * 
@@ -1941,7 +2217,36 @@ __OSX_AVAILABLE_STARTING(__MAC_10_7, __IPHONE_5_0)
 XPC_EXPORT XPC_NONNULL_ALL
 bool
 xpc_dictionary_apply(xpc_object_t xdict, xpc_dictionary_applier_t applier);
-#endif // __BLOCKS__ 
+#endif // __BLOCKS__
+
+/*!
+ * @function xpc_dictionary_apply_f
+ *
+ * @abstract
+ * Invokes the given function for every key/value pair in the dictionary.
+ *
+ * @param xdict
+ * The dictionary object which is to be examined.
+ *
+ * @param applier
+ * The function which this function applies to every key/value pair in the
+ * dictionary.
+ *
+ * @param context
+ * An arbitrary pointer passed through to the applier.
+ *
+ * @result
+ * A Boolean indicating whether iteration of the dictionary completed
+ * successfully. Iteration will only fail if the applier function returns
+ * false.
+ *
+ * @discussion
+ * Behaves like xpc_dictionary_apply() without the cost of invoking a block.
+ */
+XPC_EXPORT XPC_NONNULL1 XPC_NONNULL2
+bool
+xpc_dictionary_apply_f(xpc_object_t xdict,
+	xpc_dictionary_applier_func_t applier, void *context);
 
 /*!
  * @function xpc_dictionary_get_remote_connection
@@ -2421,6 +2726,829 @@ XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL_ALL
 xpc_connection_t
 xpc_dictionary_create_connection(xpc_object_t xdict, const char *key);
 
+#pragma mark Key Paths
+/*!
+ * @typedef xpc_keypath_t
+ * One or more compiled paths into nested dictionaries and arrays.
+ */
+typedef struct xpc_keypath *xpc_keypath_t;
+
+/*!
+ * @function xpc_keypath_create
+ *
+ * @abstract
+ * Compiles a path to a value nested in dictionaries and arrays.
+ *
+ * @param path
+ * A path such as "hdr.route" or "items[3].id". Dictionary keys are separated
+ * by dots and may not themselves contain '.' or '['; array indexes are given
+ * in brackets.
+ *
+ * @result
+ * A new key path, or NULL if the path is malformed. Release it with
+ * xpc_keypath_free().
+ *
+ * @discussion
+ * The keys are parsed, copied and hashed once, at compile time. A key path
+ * may be evaluated against any number of objects, from any thread.
+ */
+XPC_EXPORT XPC_MALLOC XPC_WARN_RESULT XPC_NONNULL1
+xpc_keypath_t
+xpc_keypath_create(const char *path);
+
+/*!
+ * @function xpc_keypath_create_multiple
+ *
+ * @abstract
+ * Compiles several paths to be extracted together.
+ *
+ * @param paths
+ * An array of paths in the syntax accepted by xpc_keypath_create().
+ *
+ * @param count
+ * The number of paths in the array.
+ *
+ * @result
+ * A new key path, or NULL if any of the paths is malformed.
+ *
+ * @discussion
+ * Steps shared by several paths, such as "hdr" in "hdr.route" and "hdr.id",
+ * are looked up only once per evaluation.
+ */
+XPC_EXPORT XPC_MALLOC XPC_WARN_RESULT XPC_NONNULL1
+xpc_keypath_t
+xpc_keypath_create_multiple(const char * const *paths, size_t count);
+
+/*!
+ * @function xpc_keypath_free
+ *
+ * @abstract
+ * Releases a compiled key path.
+ *
+ * @param keypath
+ * The key path to release.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_keypath_free(xpc_keypath_t keypath);
+
+/*!
+ * @function xpc_keypath_get_value
+ *
+ * @abstract
+ * Returns the value a single compiled path refers to.
+ *
+ * @param xobject
+ * The dictionary or array the path starts from.
+ *
+ * @param keypath
+ * A key path created by xpc_keypath_create().
+ *
+ * @result
+ * The value at the end of the path, or NULL if some step of the path is
+ * missing or is applied to an object of the wrong type. The value is not
+ * retained.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL_ALL
+xpc_object_t
+xpc_keypath_get_value(xpc_object_t xobject, xpc_keypath_t keypath);
+
+/*!
+ * @function xpc_keypath_get_values
+ *
+ * @abstract
+ * Extracts the values of all compiled paths in one traversal.
+ *
+ * @param xobject
+ * The dictionary or array the paths start from.
+ *
+ * @param keypath
+ * A key path created by xpc_keypath_create_multiple().
+ *
+ * @param values
+ * An array with room for one value per path. Each element receives the value
+ * at the end of the corresponding path, or NULL. The values are not retained.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_keypath_get_values(xpc_object_t xobject, xpc_keypath_t keypath,
+	xpc_object_t *values);
+
+#pragma mark Schemas
+/*!
+ * @typedef xpc_schema_t
+ * A compiled description of the keys and types a message is expected to have.
+ */
+typedef struct xpc_schema *xpc_schema_t;
+
+/*!
+ * @typedef xpc_schema_bytes
+ * A malloc(3)'d copy of a "data" value, as stored by xpc_schema_decode().
+ * The copy is always followed by a NUL byte not counted in the length.
+ */
+struct xpc_schema_bytes {
+	void *ptr;
+	size_t length;
+};
+
+/*!
+ * @typedef xpc_schema_value_t
+ * One decoded field. Which member of the union is valid depends on the type
+ * of the field: b for "bool", i for "int64" and "date", u for "uint64", d
+ * for "double", bytes for "string" and "data", and object for everything
+ * else.
+ */
+typedef struct xpc_schema_value {
+	bool present;
+	union {
+		bool b;
+		int64_t i;
+		uint64_t u;
+		double d;
+		struct xpc_schema_bytes bytes;
+		xpc_object_t object;
+	} v;
+} xpc_schema_value_t;
+
+/*!
+ * @function xpc_schema_create
+ *
+ * @abstract
+ * Compiles a schema from its description.
+ *
+ * @param description
+ * A dictionary mapping each expected key to the name of its type: "bool",
+ * "int64", "uint64", "double", "date", "string", "data", "dictionary",
+ * "array" or "any". A type name ending in '?' marks the key optional. A
+ * dictionary in place of a type name describes a nested dictionary.
+ *
+ * @result
+ * A new schema, or NULL if the description is malformed. Release it with
+ * xpc_schema_free().
+ *
+ * @discussion
+ * Every key, nested ones included, is given a slot number in the order the
+ * description lists them, the keys of a nested dictionary following the key
+ * that holds it. A dictionary may describe at most 256 keys.
+ */
+XPC_EXPORT XPC_MALLOC XPC_WARN_RESULT XPC_NONNULL1
+xpc_schema_t
+xpc_schema_create(xpc_object_t description);
+
+/*!
+ * @function xpc_schema_free
+ *
+ * @abstract
+ * Releases a schema created by xpc_schema_create().
+ *
+ * @param schema
+ * The schema to release. It must no longer be set on any connection.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_schema_free(xpc_schema_t schema);
+
+/*!
+ * @function xpc_schema_get_slot_count
+ *
+ * @abstract
+ * Returns the number of slots xpc_schema_decode() fills in.
+ *
+ * @param schema
+ * The schema to examine.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL1
+size_t
+xpc_schema_get_slot_count(xpc_schema_t schema);
+
+/*!
+ * @function xpc_schema_get_slot
+ *
+ * @abstract
+ * Returns the slot number of a key.
+ *
+ * @param schema
+ * The schema to examine.
+ *
+ * @param key
+ * The key, with the keys of nested dictionaries separated by dots, as in
+ * "hdr.route".
+ *
+ * @result
+ * The slot number, or -1 if the schema has no such key.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL_ALL
+int
+xpc_schema_get_slot(xpc_schema_t schema, const char *key);
+
+/*!
+ * @function xpc_schema_bind
+ *
+ * @abstract
+ * Makes xpc_schema_decode() store a key into a member of a C structure.
+ *
+ * @param schema
+ * The schema to modify.
+ *
+ * @param key
+ * The key, in the syntax accepted by xpc_schema_get_slot().
+ *
+ * @param offset
+ * The offsetof() the member. The member must be a bool for "bool", an
+ * int64_t for "int64" and "date", a uint64_t for "uint64", a double for
+ * "double", a char * for "string", a struct xpc_schema_bytes for "data" and
+ * an xpc_object_t otherwise.
+ *
+ * @result
+ * 0 on success, or -1 with errno set to ENOENT if the schema has no such
+ * key.
+ *
+ * @discussion
+ * Binding is not thread safe; bind every key before the schema is used.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+int
+xpc_schema_bind(xpc_schema_t schema, const char *key, size_t offset);
+
+/*!
+ * @function xpc_schema_validate
+ *
+ * @abstract
+ * Checks an already decoded dictionary against a schema.
+ *
+ * @param schema
+ * The schema to check against.
+ *
+ * @param xdict
+ * The object to check.
+ *
+ * @result
+ * true if the object is a dictionary with every required key and every
+ * described key has a value of the described type. Keys the schema does not
+ * describe are ignored.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL_ALL
+bool
+xpc_schema_validate(xpc_schema_t schema, xpc_object_t xdict);
+
+/*!
+ * @function xpc_schema_decode
+ *
+ * @abstract
+ * Validates and decodes a serialized message in a single pass.
+ *
+ * @param schema
+ * The schema to decode with.
+ *
+ * @param buf
+ * The MessagePack body of a message without any framing, such as the output
+ * of xpc_serialize() or of an encoder generated by xpcgen. Messages using a
+ * connection's key table are not accepted.
+ *
+ * @param size
+ * The length of the message.
+ *
+ * @param slots
+ * An array of xpc_schema_get_slot_count() values, or NULL.
+ *
+ * @param base
+ * The structure bound keys are stored into, or NULL.
+ *
+ * @result
+ * 0 on success, or -1 with errno set to EBADMSG if the message does not
+ * match the schema. On failure the slots and bound members are cleared.
+ *
+ * @discussion
+ * Only the described keys are decoded; no XPC objects are created except for
+ * "dictionary" keys without a nested description, "array" and "any" keys.
+ * When both slots and base are given, a bound key is owned by the structure
+ * and its slot refers to the same value. Free what was decoded with
+ * xpc_schema_values_clear().
+ */
+XPC_EXPORT XPC_NONNULL1 XPC_NONNULL2
+int
+xpc_schema_decode(xpc_schema_t schema, const void *buf, size_t size,
+	xpc_schema_value_t *slots, void *base);
+
+/*!
+ * @function xpc_schema_values_clear
+ *
+ * @abstract
+ * Frees the values stored by xpc_schema_decode().
+ *
+ * @param schema
+ * The schema the values were decoded with.
+ *
+ * @param slots
+ * The slots passed to xpc_schema_decode(), or NULL.
+ *
+ * @param base
+ * The structure passed to xpc_schema_decode(), or NULL.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_schema_values_clear(xpc_schema_t schema, xpc_schema_value_t *slots,
+	void *base);
+
+/*!
+ * @function xpc_connection_set_schema
+ *
+ * @abstract
+ * Makes a connection drop messages that do not match a schema.
+ *
+ * @param connection
+ * The connection to set the schema on. Peers accepted by a listener inherit
+ * the schema of the listener.
+ *
+ * @param schema
+ * The schema, or NULL to accept every message. The schema is not copied and
+ * must outlive the connection.
+ *
+ * @discussion
+ * Messages are checked while still serialized, before any object is created
+ * for them. A message that does not match is logged and dropped.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_connection_set_schema(xpc_connection_t connection, xpc_schema_t schema);
+
+#pragma mark Routers
+/*!
+ * @typedef xpc_router_t
+ * A table mapping method names to the handlers serving them.
+ */
+typedef struct xpc_router *xpc_router_t;
+
+/*!
+ * @typedef xpc_router_handler_t
+ * The type of blocks serving a method.
+ *
+ * @param peer
+ * The connection the message arrived on.
+ *
+ * @param message
+ * The message.
+ */
+typedef void (^xpc_router_handler_t)(xpc_connection_t peer,
+	xpc_object_t message);
+
+/*!
+ * @function xpc_router_create
+ *
+ * @abstract
+ * Creates an empty router.
+ *
+ * @param key
+ * The dictionary key holding the method name of each message, or NULL for
+ * "method".
+ *
+ * @result
+ * A new router, or NULL on allocation failure. Release it with
+ * xpc_router_free().
+ */
+XPC_EXPORT XPC_MALLOC XPC_WARN_RESULT
+xpc_router_t
+xpc_router_create(const char *key);
+
+/*!
+ * @function xpc_router_free
+ *
+ * @abstract
+ * Releases a router created by xpc_router_create().
+ *
+ * @param router
+ * The router to release. It must no longer be set on any connection.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_router_free(xpc_router_t router);
+
+/*!
+ * @function xpc_router_register
+ *
+ * @abstract
+ * Routes a method to a handler.
+ *
+ * @param router
+ * The router to modify.
+ *
+ * @param method
+ * The method name.
+ *
+ * @param handler
+ * The handler, invoked on the target queue of the connection the message
+ * arrived on.
+ *
+ * @result
+ * 0 on success, or -1 with errno set to EEXIST if the method, or another
+ * method with the same ID, is already registered.
+ *
+ * @discussion
+ * The lookup table is rebuilt as a perfect hash on every registration, so
+ * a lookup is a single probe and one string comparison. Register every
+ * method before the router is set on a connection that has been resumed.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+int
+xpc_router_register(xpc_router_t router, const char *method,
+	xpc_router_handler_t handler);
+
+/*!
+ * @function xpc_router_set_default_handler
+ *
+ * @abstract
+ * Sets the handler for messages that name no registered method.
+ *
+ * @param router
+ * The router to modify.
+ *
+ * @param handler
+ * The handler, or NULL to pass such messages to the event handler of the
+ * connection.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_router_set_default_handler(xpc_router_t router,
+	xpc_router_handler_t handler);
+
+/*!
+ * @function xpc_router_get_method_id
+ *
+ * @abstract
+ * Returns the compact ID of a method name.
+ *
+ * @param method
+ * The method name.
+ *
+ * @result
+ * A nonzero 32-bit ID. IDs are derived from the name alone, so both ends of
+ * a connection agree on them without a handshake.
+ */
+XPC_EXPORT XPC_WARN_RESULT XPC_NONNULL1
+uint32_t
+xpc_router_get_method_id(const char *method);
+
+/*!
+ * @function xpc_router_copy_statistics
+ *
+ * @abstract
+ * Returns per-method call counts and handler latencies.
+ *
+ * @param router
+ * The router to examine.
+ *
+ * @result
+ * A dictionary mapping each method name to a dictionary with the uint64
+ * keys "id", "calls", "total_nsec" and "max_nsec". Latencies cover the
+ * handler only, not the time the message spent queued.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL1
+xpc_object_t
+xpc_router_copy_statistics(xpc_router_t router);
+
+/*!
+ * @function xpc_connection_set_router
+ *
+ * @abstract
+ * Dispatches the messages of a connection through a router.
+ *
+ * @param connection
+ * The connection to set the router on. Peers accepted by a listener inherit
+ * the router of the listener.
+ *
+ * @param router
+ * The router, or NULL to deliver every message to the event handler. The
+ * router is not copied and must outlive the connection.
+ *
+ * @discussion
+ * Replies to xpc_connection_send_message_with_reply() bypass the router.
+ */
+XPC_EXPORT XPC_NONNULL1
+void
+xpc_connection_set_router(xpc_connection_t connection, xpc_router_t router);
+
+/*!
+ * @function xpc_connection_send_message_with_method
+ *
+ * @abstract
+ * Sends a message with the ID of its method in the frame header.
+ *
+ * @param connection
+ * The connection over which the message shall be sent.
+ *
+ * @param message
+ * The message to send.
+ *
+ * @param method
+ * The method name.
+ *
+ * @discussion
+ * A router on the receiving end uses the ID without looking into the
+ * message. Receivers without a router ignore it, so messages should still
+ * carry the method name under the router key. Delivery guarantees are those
+ * of xpc_connection_send_message().
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_connection_send_message_with_method(xpc_connection_t connection,
+	xpc_object_t message, const char *method);
+
+#pragma mark Compression
+#define	XPC_COMPRESSION_NONE	0
+#define	XPC_COMPRESSION_LZ4	1
+#define	XPC_COMPRESSION_ZSTD	2
+
+/*!
+ * @function xpc_connection_set_compression
+ *
+ * @abstract
+ * Compresses large messages sent over a connection.
+ *
+ * @param connection
+ * The connection to configure. Peers accepted by a listener inherit the
+ * setting of the listener.
+ *
+ * @param codec
+ * XPC_COMPRESSION_LZ4 for speed, XPC_COMPRESSION_ZSTD for ratio, or
+ * XPC_COMPRESSION_NONE.
+ *
+ * @param threshold
+ * The encoded size, in bytes, below which messages are sent as they are.
+ *
+ * @result
+ * 0 on success, or -1 with errno set to ENOTSUP if the library was built
+ * without the codec.
+ *
+ * @discussion
+ * Both ends agree on the codecs they support when the connection is set up,
+ * and messages are only compressed once the peer has said it can inflate
+ * them. A message that does not get smaller is sent uncompressed. Receiving
+ * compressed messages needs no configuration.
+ */
+XPC_EXPORT XPC_NONNULL1
+int
+xpc_connection_set_compression(xpc_connection_t connection, int codec,
+	size_t threshold);
+
+/*!
+ * @function xpc_connection_set_compression_dictionary
+ *
+ * @abstract
+ * Loads a zstd dictionary, which makes small, repetitive messages
+ * compress far better.
+ *
+ * @param connection
+ * The connection to configure, before it is resumed. Peers accepted by a
+ * listener share the dictionary of the listener.
+ *
+ * @param dictionary
+ * A data object holding a dictionary from
+ * xpc_compression_train_dictionary(), or NULL to unload it. The bytes are
+ * copied.
+ *
+ * @result
+ * 0 on success, or -1 with errno set to ENOTSUP if the library was built
+ * without zstd, or EINVAL if the data is not a trained dictionary.
+ *
+ * @discussion
+ * Both ends must load the same dictionary. It is only used while the peer
+ * has announced the same dictionary ID; otherwise messages are compressed
+ * without it.
+ */
+XPC_EXPORT XPC_NONNULL1
+int
+xpc_connection_set_compression_dictionary(xpc_connection_t connection,
+	xpc_object_t dictionary);
+
+/*!
+ * @function xpc_compression_train_dictionary
+ *
+ * @abstract
+ * Trains a zstd dictionary on sample messages.
+ *
+ * @param samples
+ * An array of messages typical of the traffic to compress. zstd wants a few
+ * hundred samples or more.
+ *
+ * @param max_size
+ * The largest dictionary to build, in bytes; 16 KB to 112 KB is typical.
+ *
+ * @result
+ * A data object holding the dictionary, or NULL with errno set to ENOTSUP
+ * if the library was built without zstd, or EINVAL if training failed.
+ * Save it, and load the same one on both ends.
+ *
+ * @discussion
+ * A connection sends keys as strings until its peer supports key tables,
+ * then as small integers defined the first time each key is used. Every
+ * sample is therefore trained on in both encodings. Integers are assigned
+ * in the order keys first appear in the samples, so the dictionary matches
+ * key-table traffic best when samples come in the order a client sends
+ * such messages; values are matched either way.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL1
+xpc_object_t
+xpc_compression_train_dictionary(xpc_object_t samples, size_t max_size);
+
+#pragma mark Iteration
+#define	_XPC_ITERATOR_DEPTH	8
+
+/*!
+ * @typedef xpc_iterator_t
+ * A cursor over the elements of a dictionary or array.
+ *
+ * @field key
+ * The key of the current element, or NULL when iterating an array.
+ *
+ * @field value
+ * The current value. It is only valid until the next call to
+ * xpc_iterator_next() or xpc_iterator_end().
+ *
+ * @field index
+ * The position of the current element, counting from zero.
+ *
+ * @discussion
+ * The remaining fields are private to the implementation.
+ */
+typedef struct xpc_iterator {
+	const char *key;
+	xpc_object_t value;
+	size_t index;
+	xpc_object_t _xi_container;
+	void *_xi_cursor;
+	void *_xi_nodes[_XPC_ITERATOR_DEPTH];
+	uint32_t _xi_slots[_XPC_ITERATOR_DEPTH];
+	int _xi_depth;
+} xpc_iterator_t;
+
+/*!
+ * @function xpc_iterator_begin
+ *
+ * @abstract
+ * Prepares a cursor for iterating over a dictionary or array.
+ *
+ * @param iter
+ * The cursor to initialize, usually allocated on the stack.
+ *
+ * @param container
+ * The dictionary or array to iterate over. It is not retained, and must not
+ * be modified until xpc_iterator_end() is called.
+ *
+ * @discussion
+ * The cursor is positioned before the first element; call xpc_iterator_next()
+ * to move to it:
+ *
+ *	xpc_iterator_begin(&iter, xdict);
+ *	while (xpc_iterator_next(&iter))
+ *		use(iter.key, iter.value);
+ *	xpc_iterator_end(&iter);
+ *
+ * Elements are visited in the same order as xpc_dictionary_apply() and
+ * xpc_array_apply() would visit them. Any other object yields no elements.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_iterator_begin(xpc_iterator_t *iter, xpc_object_t container);
+
+/*!
+ * @function xpc_iterator_next
+ *
+ * @abstract
+ * Advances a cursor to the next element.
+ *
+ * @param iter
+ * The cursor to advance.
+ *
+ * @result
+ * true if the cursor now refers to an element, false if the iteration is
+ * complete.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+bool
+xpc_iterator_next(xpc_iterator_t *iter);
+
+/*!
+ * @function xpc_iterator_end
+ *
+ * @abstract
+ * Releases any resources held by a cursor.
+ *
+ * @param iter
+ * The cursor to finish. It may be passed to xpc_iterator_begin() again.
+ */
+XPC_EXPORT XPC_NONNULL_ALL
+void
+xpc_iterator_end(xpc_iterator_t *iter);
+
+#pragma mark Persistent Dictionary
+/*!
+ * @function xpc_pdictionary_create
+ *
+ * @abstract
+ * Creates an immutable, persistent dictionary of XPC objects keyed to
+ * C-strings.
+ *
+ * @param keys
+ * An array of C-strings that are to be the keys for the values to be inserted.
+ * Each element of this array is copied into the dictionary's internal storage.
+ *
+ * @param values
+ * A C-array that is parallel to the array of keys. Each element in this array
+ * is retained. NULL elements are skipped.
+ *
+ * @param count
+ * The number of key/value pairs in the given arrays.
+ *
+ * @result
+ * The new dictionary object.
+ *
+ * @discussion
+ * A persistent dictionary is never modified in place. Instead, the
+ * xpc_pdictionary_set_value() and xpc_pdictionary_remove_value() functions
+ * return a new version which shares all unchanged structure with the version
+ * it was derived from, in O(log n) time and space. Every version stays valid
+ * until released, which makes it cheap to hand consistent snapshots to
+ * readers.
+ *
+ * xpc_get_type() reports a persistent dictionary as XPC_TYPE_DICTIONARY, and
+ * it may be passed to the dictionary getters, to xpc_dictionary_apply() and
+ * sent as a message. The dictionary setters have no effect on it.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT
+xpc_object_t
+xpc_pdictionary_create(const char * const *keys, const xpc_object_t *values,
+	size_t count);
+
+/*!
+ * @function xpc_pdictionary_create_from_dictionary
+ *
+ * @abstract
+ * Creates a persistent dictionary holding the same key/value pairs as the
+ * given dictionary.
+ *
+ * @param xdict
+ * The dictionary object which is to be copied. The values are retained, not
+ * copied. If this is already a persistent dictionary, it is returned with an
+ * additional reference.
+ *
+ * @result
+ * The new dictionary object.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL1
+xpc_object_t
+xpc_pdictionary_create_from_dictionary(xpc_object_t xdict);
+
+/*!
+ * @function xpc_pdictionary_set_value
+ *
+ * @abstract
+ * Returns a new version of a persistent dictionary with the value for the
+ * specified key set to the specified object.
+ *
+ * @param xpdict
+ * The persistent dictionary from which the new version is derived. This object
+ * is not modified.
+ *
+ * @param key
+ * The key for which the value shall be set.
+ *
+ * @param value
+ * The object to insert. The object is retained by the new version. This
+ * parameter may be NULL, in which case the key is removed, as with
+ * xpc_pdictionary_remove_value().
+ *
+ * @result
+ * The new version of the dictionary, or NULL if the given object was not a
+ * persistent dictionary.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL1
+XPC_NONNULL2
+xpc_object_t
+xpc_pdictionary_set_value(xpc_object_t xpdict, const char *key,
+	xpc_object_t value);
+
+/*!
+ * @function xpc_pdictionary_remove_value
+ *
+ * @abstract
+ * Returns a new version of a persistent dictionary without the specified key.
+ *
+ * @param xpdict
+ * The persistent dictionary from which the new version is derived. This object
+ * is not modified.
+ *
+ * @param key
+ * The key which is to be removed.
+ *
+ * @result
+ * The new version of the dictionary, or NULL if the given object was not a
+ * persistent dictionary. If the key was not present, the given dictionary is
+ * returned with an additional reference.
+ */
+XPC_EXPORT XPC_MALLOC XPC_RETURNS_RETAINED XPC_WARN_RESULT XPC_NONNULL_ALL
+xpc_object_t
+xpc_pdictionary_remove_value(xpc_object_t xpdict, const char *key);
+
 #pragma mark Runtime
 /*!
  * @function xpc_main
@@ -26,9 +26,285 @@
  */
 
 #include <sys/types.h>
+#include <sys/endian.h>
 #include <xpc/xpc.h>
 #include "xpc_internal.h"
 
+static const size_t xpc_typed_array_sizes[] = {
+	[XPC_ARRAY_TYPE_INT64] = sizeof(int64_t),
+	[XPC_ARRAY_TYPE_UINT64] = sizeof(uint64_t),
+	[XPC_ARRAY_TYPE_DOUBLE] = sizeof(double),
+	[XPC_ARRAY_TYPE_FLOAT] = sizeof(float),
+	[XPC_ARRAY_TYPE_UINT8] = sizeof(uint8_t)
+};
+
+__private_extern__ size_t
+xpc_typed_array_element_size(int type)
+{
+
+	if (type <= 0 || type > XPC_ARRAY_TYPE_UINT8)
+		return (0);
+
+	return (xpc_typed_array_sizes[type]);
+}
+
+/*
+ * Converts elements between host order and the little-endian order used
+ * on the wire. The loops are simple enough for the compiler to vectorize.
+ */
+__private_extern__ void
+xpc_typed_array_swab(void *dst, const void *src, size_t count, int type)
+{
+	size_t i;
+
+#if BYTE_ORDER == BIG_ENDIAN
+	switch (xpc_typed_array_element_size(type)) {
+	case sizeof(uint64_t):
+		for (i = 0; i < count; i++)
+			((uint64_t *)dst)[i] = bswap64(((const uint64_t *)src)[i]);
+		return;
+
+	case sizeof(uint32_t):
+		for (i = 0; i < count; i++)
+			((uint32_t *)dst)[i] = bswap32(((const uint32_t *)src)[i]);
+		return;
+	}
+#endif
+
+	if (dst != src && count > 0)
+		memcpy(dst, src, count * xpc_typed_array_element_size(type));
+}
+
+/*
+ * Loads an element, returning the XPC type it is presented as: floats
+ * widen to doubles and bytes to unsigned integers.
+ */
+__private_extern__ int
+xpc_typed_array_load(struct xpc_object *xo, size_t index, xpc_u *val)
+{
+	void *data = xo->xo_typed.ta_data;
+
+	switch (xo->xo_typed.ta_type) {
+	case XPC_ARRAY_TYPE_INT64:
+		val->i = ((int64_t *)data)[index];
+		return (_XPC_TYPE_INT64);
+
+	case XPC_ARRAY_TYPE_UINT64:
+		val->ui = ((uint64_t *)data)[index];
+		return (_XPC_TYPE_UINT64);
+
+	case XPC_ARRAY_TYPE_DOUBLE:
+		val->d = ((double *)data)[index];
+		return (_XPC_TYPE_DOUBLE);
+
+	case XPC_ARRAY_TYPE_FLOAT:
+		val->d = ((float *)data)[index];
+		return (_XPC_TYPE_DOUBLE);
+
+	case XPC_ARRAY_TYPE_UINT8:
+		val->ui = ((uint8_t *)data)[index];
+		return (_XPC_TYPE_UINT64);
+	}
+
+	return (_XPC_TYPE_INVALID);
+}
+
+static bool
+xpc_typed_array_store(struct xpc_object *xo, size_t index, int type, xpc_u val)
+{
+	void *data = xo->xo_typed.ta_data;
+
+	switch (xo->xo_typed.ta_type) {
+	case XPC_ARRAY_TYPE_INT64:
+		if (type != _XPC_TYPE_INT64)
+			return (false);
+
+		((int64_t *)data)[index] = val.i;
+		return (true);
+
+	case XPC_ARRAY_TYPE_UINT64:
+		if (type != _XPC_TYPE_UINT64)
+			return (false);
+
+		((uint64_t *)data)[index] = val.ui;
+		return (true);
+
+	case XPC_ARRAY_TYPE_DOUBLE:
+		if (type != _XPC_TYPE_DOUBLE)
+			return (false);
+
+		((double *)data)[index] = val.d;
+		return (true);
+
+	case XPC_ARRAY_TYPE_FLOAT:
+		if (type != _XPC_TYPE_DOUBLE)
+			return (false);
+
+		((float *)data)[index] = (float)val.d;
+		return (true);
+
+	case XPC_ARRAY_TYPE_UINT8:
+		if (type != _XPC_TYPE_UINT64 || val.ui > UINT8_MAX)
+			return (false);
+
+		((uint8_t *)data)[index] = (uint8_t)val.ui;
+		return (true);
+	}
+
+	return (false);
+}
+
+static int
+xpc_typed_array_reserve(struct xpc_object *xo, size_t count)
+{
+	size_t capacity;
+	void *data;
+
+	if (count <= xo->xo_typed.ta_capacity)
+		return (0);
+
+	if (count > UINT32_MAX)
+		return (-1);
+
+	capacity = xo->xo_typed.ta_capacity * 2;
+	if (capacity < count)
+		capacity = count;
+
+	if (capacity < 16)
+		capacity = 16;
+
+	if (capacity > UINT32_MAX)
+		capacity = UINT32_MAX;
+
+	data = realloc(xo->xo_typed.ta_data,
+	    capacity * xpc_typed_array_element_size(xo->xo_typed.ta_type));
+	if (data == NULL)
+		return (-1);
+
+	xo->xo_typed.ta_data = data;
+	xo->xo_typed.ta_capacity = capacity;
+	return (0);
+}
+
+static void
+xpc_typed_array_set(struct xpc_object *xo, size_t index, int type, xpc_u val)
+{
+
+	if (index == XPC_ARRAY_APPEND)
+		index = xo->xo_size;
+
+	if (index > xo->xo_size)
+		return;
+
+	if (index == xo->xo_size && xpc_typed_array_reserve(xo, index + 1) != 0)
+		return;
+
+	if (!xpc_typed_array_store(xo, index, type, val)) {
+		debugf("cannot store type %d in typed array %p", type, xo);
+		return;
+	}
+
+	if (index == xo->xo_size)
+		xo->xo_size++;
+}
+
+static bool
+xpc_typed_array_get_as(struct xpc_object *xo, size_t index, int type,
+    xpc_u *val)
+{
+
+	if (index >= xo->xo_size)
+		return (false);
+
+	return (xpc_typed_array_load(xo, index, val) == type);
+}
+
+__private_extern__ xpc_object_t
+xpc_typed_array_box(struct xpc_object *xo, size_t index)
+{
+	xpc_u val;
+	int type;
+
+	type = xpc_typed_array_load(xo, index, &val);
+	return (_xpc_prim_create(type, val, 1));
+}
+
+xpc_object_t
+xpc_typed_array_create(int type, const void *values, size_t count)
+{
+	struct xpc_object *xo;
+	xpc_u val;
+
+	if (xpc_typed_array_element_size(type) == 0)
+		return (NULL);
+
+	val.typed.ta_data = NULL;
+	val.typed.ta_capacity = 0;
+	val.typed.ta_type = type;
+	xo = _xpc_prim_create(_XPC_TYPE_TYPED_ARRAY, val, 0);
+
+	if (count > 0)
+		xpc_typed_array_append(xo, values, count);
+
+	return (xo);
+}
+
+int
+xpc_typed_array_get_element_type(xpc_object_t xarray)
+{
+	struct xpc_object *xo;
+
+	xo = xarray;
+	if (xo->xo_xpc_type != _XPC_TYPE_TYPED_ARRAY)
+		return (0);
+
+	return (xo->xo_typed.ta_type);
+}
+
+void *
+xpc_typed_array_get_pointer(xpc_object_t xarray, size_t *count)
+{
+	struct xpc_object *xo;
+
+	xo = xarray;
+	if (xo->xo_xpc_type != _XPC_TYPE_TYPED_ARRAY) {
+		if (count != NULL)
+			*count = 0;
+
+		return (NULL);
+	}
+
+	if (count != NULL)
+		*count = xo->xo_size;
+
+	return (xo->xo_typed.ta_data);
+}
+
+void
+xpc_typed_array_append(xpc_object_t xarray, const void *values, size_t count)
+{
+	struct xpc_object *xo;
+	size_t elsize;
+	char *dst;
+
+	xo = xarray;
+	if (xo->xo_xpc_type != _XPC_TYPE_TYPED_ARRAY)
+		return;
+
+	if (xpc_typed_array_reserve(xo, xo->xo_size + count) != 0)
+		return;
+
+	elsize = xpc_typed_array_element_size(xo->xo_typed.ta_type);
+	dst = (char *)xo->xo_typed.ta_data + xo->xo_size * elsize;
+
+	if (values != NULL)
+		memcpy(dst, values, count * elsize);
+	else
+		memset(dst, 0, count * elsize);
+
+	xo->xo_size += count;
+}
+
 xpc_object_t
 xpc_array_create(const xpc_object_t *objects, size_t count)
 {
@@ -55,6 +331,12 @@ xpc_array_set_value(xpc_object_t xarray, size_t index, xpc_object_t value)
 	arr = &xo->xo_array;
 	i = 0;
 
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		xotmp = value;
+		xpc_typed_array_set(xo, index, xotmp->xo_xpc_type, xotmp->xo_u);
+		return;
+	}
+
 	if (index == XPC_ARRAY_APPEND)
 		return xpc_array_append_value(xarray, value);
 
@@ -63,11 +345,11 @@ xpc_array_set_value(xpc_object_t xarray, size_t index, xpc_object_t value)
 
 	TAILQ_FOREACH_SAFE(xotmp, arr, xo_link, xotmp2) {
 		if (i++ == index) {
-			TAILQ_INSERT_AFTER(arr, (struct xpc_object *)value,
-			    xotmp, xo_link);
-			TAILQ_REMOVE(arr, xotmp, xo_link);
 			xpc_retain(value);
-			free(xotmp);
+			TAILQ_INSERT_AFTER(arr, xotmp,
+			    (struct xpc_object *)value, xo_link);
+			TAILQ_REMOVE(arr, xotmp, xo_link);
+			xpc_release(xotmp);
 			break;
 		}
 	}
@@ -76,13 +358,21 @@ xpc_array_set_value(xpc_object_t xarray, size_t index, xpc_object_t value)
 void
 xpc_array_append_value(xpc_object_t xarray, xpc_object_t value)
 {
-	struct xpc_object *xo;
+	struct xpc_object *xo, *xotmp;
 	struct xpc_array_head *arr;
 	
 	xo = xarray;
 	arr = &xo->xo_array;
 
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		xotmp = value;
+		xpc_typed_array_set(xo, XPC_ARRAY_APPEND, xotmp->xo_xpc_type,
+		    xotmp->xo_u);
+		return;
+	}
+
 	TAILQ_INSERT_TAIL(arr, (struct xpc_object *)value, xo_link);
+	xo->xo_size++;
 	xpc_retain(value);
 }
 
@@ -98,7 +388,11 @@ xpc_array_get_value(xpc_object_t xarray, size_t index)
 	arr = &xo->xo_array;
 	i = 0;
 
-	if (index > xo->xo_size)
+	/* Typed array elements are not objects; use the typed getters */
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY)
+		return (NULL);
+
+	if (index >= xo->xo_size)
 		return (NULL);
 	
 	TAILQ_FOREACH(xotmp, arr, xo_link) {
@@ -125,7 +419,8 @@ xpc_array_set_bool(xpc_object_t xarray, size_t index, bool value)
 
 	xo = xarray;
 	xotmp = xpc_bool_create(value);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 
@@ -133,30 +428,54 @@ void
 xpc_array_set_int64(xpc_object_t xarray, size_t index, int64_t value)
 {
 	struct xpc_object *xo, *xotmp;
+	xpc_u val;
 
 	xo = xarray;
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		val.i = value;
+		xpc_typed_array_set(xo, index, _XPC_TYPE_INT64, val);
+		return;
+	}
+
 	xotmp = xpc_int64_create(value);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
 xpc_array_set_uint64(xpc_object_t xarray, size_t index, uint64_t value)
 {
 	struct xpc_object *xo, *xotmp;
+	xpc_u val;
 
 	xo = xarray;
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		val.ui = value;
+		xpc_typed_array_set(xo, index, _XPC_TYPE_UINT64, val);
+		return;
+	}
+
 	xotmp = xpc_uint64_create(value);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
 xpc_array_set_double(xpc_object_t xarray, size_t index, double value)
 {
 	struct xpc_object *xo, *xotmp;
+	xpc_u val;
 
 	xo = xarray;
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		val.d = value;
+		xpc_typed_array_set(xo, index, _XPC_TYPE_DOUBLE, val);
+		return;
+	}
+
 	xotmp = xpc_double_create(value);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -166,7 +485,8 @@ xpc_array_set_date(xpc_object_t xarray, size_t index, int64_t value)
 
 	xo = xarray;
 	xotmp = xpc_date_create(value);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -177,7 +497,8 @@ xpc_array_set_data(xpc_object_t xarray, size_t index, const void *data,
 
 	xo = xarray;
 	xotmp = xpc_data_create(data, length);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -187,7 +508,8 @@ xpc_array_set_string(xpc_object_t xarray, size_t index, const char *string)
 
 	xo = xarray;
 	xotmp = xpc_string_create(string);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -197,7 +519,8 @@ xpc_array_set_uuid(xpc_object_t xarray, size_t index, const uuid_t value)
 
 	xo = xarray;
 	xotmp = xpc_uuid_create(value);
-	return (xpc_array_set_value(xarray, index, xotmp));
+	xpc_array_set_value(xarray, index, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -230,6 +553,15 @@ int64_t
 xpc_array_get_int64(xpc_object_t xarray, size_t index)
 {
 	struct xpc_object *xotmp;
+	xpc_u val;
+
+	xotmp = xarray;
+	if (xotmp->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		if (!xpc_typed_array_get_as(xotmp, index, _XPC_TYPE_INT64, &val))
+			return (0);
+
+		return (val.i);
+	}
 
 	xotmp = xpc_array_get_value(xarray, index);
 	return (xpc_int64_get_value(xotmp));
@@ -239,6 +571,15 @@ uint64_t
 xpc_array_get_uint64(xpc_object_t xarray, size_t index)
 {
 	struct xpc_object *xotmp;
+	xpc_u val;
+
+	xotmp = xarray;
+	if (xotmp->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		if (!xpc_typed_array_get_as(xotmp, index, _XPC_TYPE_UINT64, &val))
+			return (0);
+
+		return (val.ui);
+	}
 
 	xotmp = xpc_array_get_value(xarray, index);
 	return (xpc_uint64_get_value(xotmp));
@@ -248,6 +589,15 @@ double
 xpc_array_get_double(xpc_object_t xarray, size_t index)
 {
 	struct xpc_object *xotmp;
+	xpc_u val;
+
+	xotmp = xarray;
+	if (xotmp->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		if (!xpc_typed_array_get_as(xotmp, index, _XPC_TYPE_DOUBLE, &val))
+			return (0);
+
+		return (val.d);
+	}
 
 	xotmp = xpc_array_get_value(xarray, index);
 	return (xpc_double_get_value(xotmp));
@@ -310,11 +660,24 @@ xpc_array_apply(xpc_object_t xarray, xpc_array_applier_t applier)
 	struct xpc_object *xo, *xotmp;
 	struct xpc_array_head *arr;
 	size_t i;
+	bool ret;
 
 	i = 0;
 	xo = xarray;
 	arr = &xo->xo_array;
 
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY) {
+		for (i = 0; i < xo->xo_size; i++) {
+			xotmp = xpc_typed_array_box(xo, i);
+			ret = applier(i, xotmp);
+			xpc_release(xotmp);
+			if (!ret)
+				return (false);
+		}
+
+		return (true);
+	}
+
 	TAILQ_FOREACH(xotmp, arr, xo_link) {
 		if (!applier(i++, xotmp))
 			return (false);
@@ -322,3 +685,23 @@ xpc_array_apply(xpc_object_t xarray, xpc_array_applier_t applier)
 
 	return (true);
 }
+
+bool
+xpc_array_apply_f(xpc_object_t xarray, xpc_array_applier_func_t applier,
+    void *context)
+{
+	xpc_iterator_t iter;
+	bool ret;
+
+	ret = true;
+	xpc_iterator_begin(&iter, xarray);
+	while (xpc_iterator_next(&iter)) {
+		if (!applier(iter.index, iter.value, context)) {
+			ret = false;
+			break;
+		}
+	}
+
+	xpc_iterator_end(&iter);
+	return (ret);
+}
@@ -0,0 +1,441 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <machine/atomic.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+
+/* Favour speed: frames are compressed on the send queue */
+#define	XPC_ZSTD_LEVEL		1
+
+/*
+ * A loaded zstd dictionary. Peers accepted by a listener share the one
+ * set on the listener.
+ */
+struct xpc_zdict {
+	volatile u_int		zd_refcnt;
+	uint32_t		zd_id;
+#ifdef HAVE_ZSTD
+	ZSTD_CDict *		zd_cdict;
+	ZSTD_DDict *		zd_ddict;
+#endif
+};
+
+static uint64_t
+xpc_codec_feature(int codec)
+{
+
+	switch (codec) {
+	case XPC_COMPRESSION_LZ4:
+		return (XPC_FEATURE_LZ4);
+
+	case XPC_COMPRESSION_ZSTD:
+		return (XPC_FEATURE_ZSTD);
+	}
+
+	return (0);
+}
+
+static void
+xpc_zdict_release(struct xpc_zdict *zd)
+{
+
+	if (zd == NULL || atomic_fetchadd_int(&zd->zd_refcnt, -1) > 1)
+		return;
+
+#ifdef HAVE_ZSTD
+	ZSTD_freeCDict(zd->zd_cdict);
+	ZSTD_freeDDict(zd->zd_ddict);
+#endif
+	free(zd);
+}
+
+__private_extern__ void
+xpc_compression_inherit(struct xpc_compression *xz,
+    const struct xpc_compression *parent)
+{
+
+	memset(xz, 0, sizeof(*xz));
+	xz->xz_codec = parent->xz_codec;
+	xz->xz_threshold = parent->xz_threshold;
+	if ((xz->xz_dict = parent->xz_dict) != NULL)
+		atomic_add_int(&xz->xz_dict->zd_refcnt, 1);
+}
+
+__private_extern__ uint32_t
+xpc_compression_dict_id(const struct xpc_compression *xz)
+{
+
+	return (xz->xz_dict != NULL ? xz->xz_dict->zd_id : 0);
+}
+
+/*
+ * Tells whether bodies sent with these features may get compressed.
+ */
+__private_extern__ bool
+xpc_compression_enabled(const struct xpc_compression *xz, uint64_t features)
+{
+
+	return (xz != NULL && xz->xz_codec != XPC_COMPRESSION_NONE &&
+	    (features & xpc_codec_feature(xz->xz_codec)) != 0);
+}
+
+/*
+ * Compresses a frame body if the connection asks for it, the peer can
+ * inflate it and it is large enough. Returns -1 if the body should go
+ * out as it is, including when compression would not make it smaller.
+ */
+__private_extern__ int
+xpc_compress(struct xpc_compression *xz, uint64_t features, const void *src,
+    size_t length, void **buf, size_t *size)
+{
+	uint8_t *out;
+	size_t hdrlen, bound, n;
+
+	if (!xpc_compression_enabled(xz, features) ||
+	    length < xz->xz_threshold || length > XPC_INFLATED_MAX)
+		return (-1);
+
+	switch (xz->xz_codec) {
+#ifdef HAVE_LZ4
+	case XPC_COMPRESSION_LZ4:
+		bound = LZ4_compressBound((int)length);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case XPC_COMPRESSION_ZSTD:
+		bound = ZSTD_compressBound(length);
+		if (xz->xz_cctx == NULL &&
+		    (xz->xz_cctx = ZSTD_createCCtx()) == NULL)
+			return (-1);
+		break;
+#endif
+	default:
+		return (-1);
+	}
+
+	if ((out = malloc(11 + bound)) == NULL)
+		return (-1);
+
+	out[0] = (uint8_t)xz->xz_codec;
+	hdrlen = 1 + xpc_varint_encode(out + 1, length);
+	n = 0;
+	switch (xz->xz_codec) {
+#ifdef HAVE_LZ4
+	case XPC_COMPRESSION_LZ4:
+		n = LZ4_compress_default(src, (char *)out + hdrlen,
+		    (int)length, (int)bound);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case XPC_COMPRESSION_ZSTD:
+		/* Only use the dictionary if the peer has it too */
+		if (xz->xz_dict != NULL &&
+		    xz->xz_peer_dict == xz->xz_dict->zd_id)
+			n = ZSTD_compress_usingCDict(xz->xz_cctx,
+			    out + hdrlen, bound, src, length,
+			    xz->xz_dict->zd_cdict);
+		else
+			n = ZSTD_compressCCtx(xz->xz_cctx, out + hdrlen,
+			    bound, src, length, XPC_ZSTD_LEVEL);
+
+		if (ZSTD_isError(n))
+			n = 0;
+		break;
+#endif
+	}
+
+	if (n == 0 || hdrlen + n >= length) {
+		free(out);
+		return (-1);
+	}
+
+	*buf = out;
+	*size = hdrlen + n;
+	return (0);
+}
+
+/*
+ * Inflates a frame body into a buffer owned by the caller, which is only
+ * replaced when the body does not fit, so a connection reuses one buffer
+ * for all the compressed frames it receives.
+ */
+__private_extern__ int
+xpc_decompress(struct xpc_compression *xz, const uint8_t *src, size_t length,
+    void **buf, size_t *capacity, size_t *size)
+{
+	const uint8_t *p, *end;
+	uint64_t inflated;
+	uint8_t *out;
+	size_t n;
+
+	p = src;
+	end = src + length;
+	if (length < 1 || (p++, xpc_varint_decode(&p, end, &inflated)) != 0 ||
+	    inflated > XPC_INFLATED_MAX) {
+		errno = EBADMSG;
+		return (-1);
+	}
+
+	if (*buf == NULL || inflated > *capacity) {
+		/* The old contents are not needed, so skip realloc()'s copy */
+		free(*buf);
+		*capacity = 0;
+		if ((*buf = malloc(inflated != 0 ? inflated : 1)) == NULL)
+			return (-1);
+
+		*capacity = inflated;
+	}
+
+	out = *buf;
+
+	n = (size_t)-1;
+	switch (src[0]) {
+#ifdef HAVE_LZ4
+	case XPC_COMPRESSION_LZ4:
+		if (LZ4_decompress_safe((const char *)p, (char *)out,
+		    (int)(end - p), (int)inflated) == (int)inflated)
+			n = inflated;
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case XPC_COMPRESSION_ZSTD:
+		if (xz->xz_dctx == NULL &&
+		    (xz->xz_dctx = ZSTD_createDCtx()) == NULL)
+			break;
+
+		if (ZSTD_getDictID_fromFrame(p, end - p) == 0)
+			n = ZSTD_decompressDCtx(xz->xz_dctx, out, inflated, p,
+			    end - p);
+		else if (xz->xz_dict != NULL)
+			n = ZSTD_decompress_usingDDict(xz->xz_dctx, out,
+			    inflated, p, end - p, xz->xz_dict->zd_ddict);
+		break;
+#endif
+	default:
+		debugf("unknown codec %d", src[0]);
+		break;
+	}
+
+	if (n != inflated) {
+		errno = EBADMSG;
+		return (-1);
+	}
+
+	*size = n;
+	return (0);
+}
+
+int
+xpc_connection_set_compression(xpc_connection_t xconn, int codec,
+    size_t threshold)
+{
+	struct xpc_connection *conn;
+
+	if (codec != XPC_COMPRESSION_NONE &&
+	    (xpc_codec_feature(codec) & XPC_FEATURES_SUPPORTED) == 0) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
+	conn = (struct xpc_connection *)xconn;
+	conn->xc_compression.xz_codec = codec;
+	conn->xc_compression.xz_threshold = threshold;
+	return (0);
+}
+
+int
+xpc_connection_set_compression_dictionary(xpc_connection_t xconn,
+    xpc_object_t dictionary)
+{
+#ifdef HAVE_ZSTD
+	struct xpc_connection *conn;
+	struct xpc_zdict *zd;
+	const void *bytes;
+	size_t length;
+
+	conn = (struct xpc_connection *)xconn;
+	zd = NULL;
+	if (dictionary != NULL) {
+		bytes = xpc_data_get_bytes_ptr(dictionary);
+		length = xpc_data_get_length(dictionary);
+		if (bytes == NULL ||
+		    ZSTD_getDictID_fromDict(bytes, length) == 0) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		if ((zd = calloc(1, sizeof(*zd))) == NULL)
+			return (-1);
+
+		zd->zd_refcnt = 1;
+		zd->zd_id = ZSTD_getDictID_fromDict(bytes, length);
+		zd->zd_cdict = ZSTD_createCDict(bytes, length, XPC_ZSTD_LEVEL);
+		zd->zd_ddict = ZSTD_createDDict(bytes, length);
+		if (zd->zd_cdict == NULL || zd->zd_ddict == NULL) {
+			xpc_zdict_release(zd);
+			errno = ENOMEM;
+			return (-1);
+		}
+	}
+
+	xpc_zdict_release(conn->xc_compression.xz_dict);
+	conn->xc_compression.xz_dict = zd;
+	return (0);
+#else
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
+
+#ifdef HAVE_ZSTD
+struct xpc_samples {
+	char *			xs_buf;
+	size_t			xs_used;
+	size_t			xs_capacity;
+};
+
+/*
+ * Appends a message to the training samples the way xpc_pack() lays out
+ * a frame body: with a key table, the key definitions it introduces come
+ * first and are then taken as sent.
+ */
+static int
+xpc_compression_add_sample(struct xpc_samples *xs, xpc_object_t xo,
+    struct xpc_key_table *keys, size_t *sizep)
+{
+	mpack_writer_t writer;
+	char *body, *p;
+	size_t size, defs, need;
+
+	mpack_writer_init_growable(&writer, &body, &size);
+	xpc2mpack(&writer, xo, keys, NULL);
+	if (mpack_writer_destroy(&writer) != mpack_ok)
+		return (-1);
+
+	defs = keys != NULL ? xpc_keys_pending(keys, NULL) : 0;
+	need = xs->xs_used + defs + size;
+	if (need > xs->xs_capacity) {
+		if ((p = realloc(xs->xs_buf, need * 2)) == NULL) {
+			free(body);
+			return (-1);
+		}
+
+		xs->xs_buf = p;
+		xs->xs_capacity = need * 2;
+	}
+
+	if (defs != 0) {
+		xpc_keys_pending(keys, (uint8_t *)xs->xs_buf + xs->xs_used);
+		xpc_keys_commit(keys, true);
+	}
+
+	memcpy(xs->xs_buf + xs->xs_used + defs, body, size);
+	xs->xs_used = need;
+	*sizep = defs + size;
+	free(body);
+	return (0);
+}
+#endif
+
+xpc_object_t
+xpc_compression_train_dictionary(xpc_object_t samples, size_t max_size)
+{
+#ifdef HAVE_ZSTD
+	struct xpc_key_table keys;
+	struct xpc_samples xs;
+	xpc_iterator_t iter;
+	xpc_object_t result;
+	size_t *sizes, count, i, n;
+	void *dict;
+	bool failed;
+
+	if (xpc_get_type(samples) != XPC_TYPE_ARRAY ||
+	    (count = xpc_array_get_count(samples)) == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	if ((sizes = malloc(2 * count * sizeof(*sizes))) == NULL)
+		return (NULL);
+
+	/*
+	 * Train on what goes over the wire. A connection sends string keys
+	 * until it has a key table, then key IDs, so every message is added
+	 * both ways.
+	 */
+	memset(&keys, 0, sizeof(keys));
+	memset(&xs, 0, sizeof(xs));
+	failed = false;
+	xpc_iterator_begin(&iter, samples);
+	while (!failed && xpc_iterator_next(&iter)) {
+		i = 2 * iter.index;
+		failed = xpc_compression_add_sample(&xs, iter.value, NULL,
+		    &sizes[i]) != 0 || xpc_compression_add_sample(&xs,
+		    iter.value, &keys, &sizes[i + 1]) != 0;
+	}
+	xpc_iterator_end(&iter);
+	xpc_keys_destroy(&keys);
+
+	if (failed) {
+		free(xs.xs_buf);
+		free(sizes);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	result = NULL;
+	if ((dict = malloc(max_size)) != NULL) {
+		n = ZDICT_trainFromBuffer(dict, max_size, xs.xs_buf, sizes,
+		    (unsigned)(2 * count));
+		if (ZDICT_isError(n)) {
+			debugf("training failed: %s", ZDICT_getErrorName(n));
+			free(dict);
+			errno = EINVAL;
+		} else
+			result = xpc_data_create(dict, n);
+	}
+
+	free(xs.xs_buf);
+	free(sizes);
+	return (result);
+#else
+	errno = ENOTSUP;
+	return (NULL);
+#endif
+}
@@ -25,6 +25,7 @@
  *
  */
 
+#include <assert.h>
 #include <errno.h>
 #include <xpc/xpc.h>
 #include <machine/atomic.h>
@@ -33,7 +34,15 @@
 
 #define XPC_CONNECTION_NEXT_ID(conn) (atomic_fetchadd_long(&conn->xc_last_id, 1))
 
-static void xpc_send(xpc_connection_t xconn, xpc_object_t message, uint64_t id);
+static int xpc_send(xpc_connection_t xconn, xpc_object_t message, uint64_t id,
+    uint32_t method);
+static void xpc_connection_send_hello(struct xpc_connection *conn);
+static void xpc_connection_flush(struct xpc_connection *conn);
+static int xpc_connection_recv_frame(struct xpc_connection *conn);
+static int xpc_connection_recv_mach_frame(struct xpc_connection *conn);
+
+static pthread_key_t xpc_waiter_key;
+static pthread_once_t xpc_waiter_once = PTHREAD_ONCE_INIT;
 
 xpc_connection_t
 xpc_connection_create(const char *name, dispatch_queue_t targetq)
@@ -51,6 +60,8 @@ xpc_connection_create(const char *name, dispatch_queue_t targetq)
 	conn->xc_last_id = 1;
 	TAILQ_INIT(&conn->xc_peers);
 	TAILQ_INIT(&conn->xc_pending);
+	TAILQ_INIT(&conn->xc_waiters);
+	pthread_mutex_init(&conn->xc_calls_lock, NULL);
 
 	/* Create send queue */
 	asprintf(&qname, "com.ixsystems.xpc.connection.sendq.%p", conn);
@@ -122,6 +133,159 @@ xpc_connection_set_target_queue(xpc_connection_t xconn,
 	conn->xc_target_queue = targetq;	
 }
 
+void
+xpc_connection_set_inline_delivery(xpc_connection_t xconn, bool enable)
+{
+	struct xpc_connection *conn;
+
+	conn = (struct xpc_connection *)xconn;
+	conn->xc_inline = enable;
+}
+
+/*
+ * The queue the connection's messages are read and delivered on: peers
+ * are read on their listener's.
+ */
+static dispatch_queue_t
+xpc_connection_reader(struct xpc_connection *conn)
+{
+
+	if (conn->xc_parent != NULL)
+		return (conn->xc_parent->xc_recv_queue);
+
+	return (conn->xc_recv_queue);
+}
+
+/*
+ * The connection whose source reads this one's messages: its own, or
+ * for peers of a listener that serves them all from one port, the
+ * listener's.
+ */
+static struct xpc_connection *
+xpc_connection_source_owner(struct xpc_connection *conn)
+{
+
+	if (conn->xc_recv_source == NULL && conn->xc_parent != NULL)
+		return (conn->xc_parent);
+
+	return (conn);
+}
+
+/*
+ * Stops or resumes reading the connection's messages, on its reader.
+ * Peers sharing their listener's source each hold it separately.
+ */
+static void
+xpc_connection_throttle(struct xpc_connection *conn, bool throttle)
+{
+	struct xpc_connection *owner;
+
+	owner = xpc_connection_source_owner(conn);
+	if (owner->xc_recv_source == NULL || conn->xc_throttled == throttle)
+		return;
+
+	conn->xc_throttled = throttle;
+	if (throttle) {
+		owner->xc_throttles++;
+		dispatch_suspend(owner->xc_recv_source);
+	} else {
+		owner->xc_throttles--;
+		dispatch_resume(owner->xc_recv_source);
+	}
+}
+
+/*
+ * Handles the frames a read left in the decoder. The source only fires
+ * for new data, so this is needed once reading resumes.
+ */
+static void
+xpc_connection_drain(struct xpc_connection *conn)
+{
+	struct xpc_connection *owner;
+
+	owner = xpc_connection_source_owner(conn);
+	while (owner->xc_throttles == 0 &&
+	    xpc_pipe_pending(&owner->xc_decoder) &&
+	    (owner != conn ? xpc_connection_recv_mach_frame(owner) :
+	    xpc_connection_recv_frame(owner)) > 0)
+		;
+}
+
+/* Resumes reading once the connection is under its limit again */
+static void
+xpc_connection_check_concurrency(struct xpc_connection *conn)
+{
+
+	if (conn->xc_throttled && (conn->xc_concurrency == 0 ||
+	    conn->xc_running < conn->xc_concurrency)) {
+		xpc_connection_throttle(conn, false);
+		xpc_connection_drain(conn);
+	}
+}
+
+/* Called on the connection's reader */
+static void
+xpc_connection_apply_concurrency(struct xpc_connection *conn, uint32_t limit)
+{
+
+	conn->xc_concurrency = limit > 1 ? limit : 0;
+	xpc_connection_check_concurrency(conn);
+}
+
+void
+xpc_connection_set_concurrency(xpc_connection_t xconn, uint32_t limit)
+{
+	struct xpc_connection *conn;
+
+	conn = (struct xpc_connection *)xconn;
+	dispatch_async(xpc_connection_reader(conn), ^{
+		xpc_connection_apply_concurrency(conn, limit);
+	});
+}
+
+/*
+ * Runs a handler invocation on the target queue, or right away, on the
+ * receive queue, if the connection asked for inline delivery.
+ */
+static void
+xpc_connection_deliver(struct xpc_connection *conn, dispatch_block_t block)
+{
+
+	if (conn->xc_inline)
+		block();
+	else
+		dispatch_async(conn->xc_target_queue, block);
+}
+
+/*
+ * Like xpc_connection_deliver(), for the handling of a message. Unordered
+ * connections run it on a global concurrent queue instead, and stop
+ * reading while all of their slots are taken, rather than wait on the
+ * reader, which may serve other peers too.
+ */
+void
+xpc_connection_deliver_message(struct xpc_connection *conn,
+    dispatch_block_t block)
+{
+
+	if (conn->xc_concurrency == 0) {
+		xpc_connection_deliver(conn, block);
+		return;
+	}
+
+	if (++conn->xc_running >= conn->xc_concurrency)
+		xpc_connection_throttle(conn, true);
+
+	dispatch_async(dispatch_get_global_queue(
+	    DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+		block();
+		dispatch_async(xpc_connection_reader(conn), ^{
+			conn->xc_running--;
+			xpc_connection_check_concurrency(conn);
+		});
+	});
+}
+
 void
 xpc_connection_set_event_handler(xpc_connection_t xconn,
     xpc_handler_t handler)
@@ -133,6 +297,17 @@ xpc_connection_set_event_handler(xpc_connection_t xconn,
 	conn->xc_handler = (xpc_handler_t)Block_copy(handler);
 }
 
+void
+xpc_connection_set_frame_handler(xpc_connection_t xconn,
+    xpc_frame_handler_t handler)
+{
+	struct xpc_connection *conn;
+
+	debugf("connection=%p", xconn);
+	conn = (struct xpc_connection *)xconn;
+	conn->xc_frame_handler = (xpc_frame_handler_t)Block_copy(handler);
+}
+
 void
 xpc_connection_suspend(xpc_connection_t xconn)
 {
@@ -161,6 +336,8 @@ xpc_connection_resume(xpc_connection_t xconn)
 			conn->xc_recv_source = transport->xt_create_client_source(
 			    conn->xc_local_port, conn, conn->xc_recv_queue);
 			dispatch_resume(conn->xc_recv_source);
+			if (!conn->xc_hello_sent)
+				xpc_connection_send_hello(conn);
 		}
 	}
 
@@ -172,16 +349,278 @@ xpc_connection_send_message(xpc_connection_t xconn,
     xpc_object_t message)
 {
 	struct xpc_connection *conn;
+	struct xpc_object *xo;
 	uint64_t id;
 
 	conn = (struct xpc_connection *)xconn;
-	id = xpc_dictionary_get_uint64(message, XPC_SEQID);
+	xo = message;
 
-	if (id == 0)
+	/* A reply goes out under the ID of the call it answers */
+	if (xo->xo_flags & _XPC_REPLY)
+		id = xo->xo_id;
+	else if ((id = xpc_dictionary_get_uint64(message, XPC_SEQID)) == 0)
 		id = XPC_CONNECTION_NEXT_ID(conn);
 
 	dispatch_async(conn->xc_send_queue, ^{
-		xpc_send(xconn, message, id);
+		xpc_send(xconn, message, id, 0);
+	});
+}
+
+void
+xpc_connection_send_message_with_method(xpc_connection_t xconn,
+    xpc_object_t message, const char *method)
+{
+	struct xpc_connection *conn;
+	uint32_t method_id;
+	uint64_t id;
+
+	conn = (struct xpc_connection *)xconn;
+	id = XPC_CONNECTION_NEXT_ID(conn);
+	method_id = xpc_router_get_method_id(method);
+
+	dispatch_async(conn->xc_send_queue, ^{
+		xpc_send(xconn, message, id, method_id);
+	});
+}
+
+void
+xpc_connection_send_serialized(xpc_connection_t xconn, const void *buf,
+    size_t length)
+{
+	struct xpc_connection *conn;
+	uint64_t id;
+
+	conn = (struct xpc_connection *)xconn;
+	id = XPC_CONNECTION_NEXT_ID(conn);
+
+	/*
+	 * The body goes out straight from the caller's buffer, so wait for
+	 * the send queue instead of copying it.
+	 */
+	dispatch_sync(conn->xc_send_queue, ^{
+		struct xpc_frame header;
+		uint8_t hdr[sizeof(struct xpc_frame_header)];
+		struct iovec iov[2];
+
+		memset(&header, 0, sizeof(header));
+		header.xf_id = id;
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = xpc_frame_header(&header, conn->xc_features,
+		    length, hdr);
+		iov[1].iov_base = __DECONST(void *, buf);
+		iov[1].iov_len = length;
+		xpc_connection_flush(conn);
+		xpc_pipe_sendv(iov, 2, conn->xc_local_port,
+		    conn->xc_remote_port);
+	});
+}
+
+xpc_encoded_t
+xpc_encoded_create(xpc_object_t message)
+{
+	struct xpc_encoded *encoded;
+	mpack_writer_t writer;
+
+	assert(xpc_get_type(message) == &_xpc_type_dictionary);
+
+	if ((encoded = malloc(sizeof(*encoded))) == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	encoded->xe_refcnt = 1;
+	encoded->xe_method = 0;
+	encoded->xe_length = xpc2mpack_size(message, NULL);
+	if ((encoded->xe_body = malloc(encoded->xe_length)) == NULL) {
+		free(encoded);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	mpack_writer_init(&writer, encoded->xe_body, encoded->xe_length);
+	xpc2mpack(&writer, message, NULL, NULL);
+	if (mpack_writer_destroy(&writer) != mpack_ok) {
+		xpc_encoded_release(encoded);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (encoded);
+}
+
+xpc_encoded_t
+xpc_encoded_retain(xpc_encoded_t encoded)
+{
+
+	atomic_add_int(&encoded->xe_refcnt, 1);
+	return (encoded);
+}
+
+void
+xpc_encoded_release(xpc_encoded_t encoded)
+{
+
+	if (atomic_fetchadd_int(&encoded->xe_refcnt, -1) > 1)
+		return;
+
+	free(encoded->xe_body);
+	free(encoded);
+}
+
+/*
+ * Positions a reader on the value of a top-level key. Other values are
+ * skipped with mpack_discard(), which closes everything it opens. The
+ * body was encoded here by xpc2mpack(), so its nesting is no deeper than
+ * that recursion already allowed.
+ */
+static bool
+xpc_encoded_find(xpc_encoded_t encoded, const char *key,
+    mpack_reader_t *reader)
+{
+	mpack_tag_t tag;
+	const char *name;
+	size_t length;
+	uint32_t count;
+
+	length = strlen(key);
+	mpack_reader_init_data(reader, encoded->xe_body, encoded->xe_length);
+	count = mpack_expect_map(reader);
+	for (; count > 0 && mpack_reader_error(reader) == mpack_ok; count--) {
+		tag = mpack_read_tag(reader);
+		if (tag.type != mpack_type_str)
+			break;
+
+		name = mpack_read_bytes_inplace(reader, tag.v.l);
+		mpack_done_str(reader);
+		if (name != NULL && tag.v.l == length &&
+		    memcmp(name, key, length) == 0)
+			return (true);
+
+		mpack_discard(reader);
+	}
+
+	mpack_reader_destroy_cancel(reader);
+	return (false);
+}
+
+/*
+ * Ends a lookup once the getter has closed the value it read, if it
+ * was a string. The rest of the map, or a value of the wrong type, is
+ * left unread, which read tracking accepts only when the reader is
+ * destroyed with mpack_reader_destroy_cancel().
+ */
+static bool
+xpc_encoded_done(mpack_reader_t *reader)
+{
+	mpack_error_t error;
+
+	error = mpack_reader_error(reader);
+	mpack_reader_destroy_cancel(reader);
+	return (error == mpack_ok);
+}
+
+bool
+xpc_encoded_get_string(xpc_encoded_t encoded, const char *key,
+    const char **string, size_t *length)
+{
+	mpack_reader_t reader;
+	mpack_tag_t tag;
+	const char *bytes;
+
+	if (!xpc_encoded_find(encoded, key, &reader))
+		return (false);
+
+	tag = mpack_read_tag(&reader);
+	if (tag.type != mpack_type_str) {
+		xpc_encoded_done(&reader);
+		return (false);
+	}
+
+	bytes = mpack_read_bytes_inplace(&reader, tag.v.l);
+	mpack_done_str(&reader);
+	if (!xpc_encoded_done(&reader))
+		return (false);
+
+	*string = bytes;
+	*length = tag.v.l;
+	return (true);
+}
+
+bool
+xpc_encoded_get_int64(xpc_encoded_t encoded, const char *key,
+    int64_t *value)
+{
+	mpack_reader_t reader;
+	mpack_tag_t tag;
+
+	if (!xpc_encoded_find(encoded, key, &reader))
+		return (false);
+
+	tag = mpack_read_tag(&reader);
+	if (!xpc_encoded_done(&reader))
+		return (false);
+
+	if (tag.type == mpack_type_int) {
+		*value = tag.v.i;
+		return (true);
+	}
+
+	if (tag.type == mpack_type_uint && tag.v.u <= INT64_MAX) {
+		*value = (int64_t)tag.v.u;
+		return (true);
+	}
+
+	return (false);
+}
+
+void
+xpc_connection_send_encoded(xpc_connection_t xconn, xpc_encoded_t encoded)
+{
+	struct xpc_connection *conn;
+	uint64_t id;
+
+	conn = (struct xpc_connection *)xconn;
+	id = XPC_CONNECTION_NEXT_ID(conn);
+	xpc_encoded_retain(encoded);
+
+	/* Framed on the send queue, once the peer's features are known */
+	dispatch_async(conn->xc_send_queue, ^{
+		struct xpc_frame header;
+		uint8_t hdr[sizeof(struct xpc_frame_header)];
+		struct iovec iov[2];
+
+		memset(&header, 0, sizeof(header));
+		header.xf_id = id;
+		header.xf_method = encoded->xe_method;
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = xpc_frame_header(&header, conn->xc_features,
+		    encoded->xe_length, hdr);
+		iov[1].iov_base = encoded->xe_body;
+		iov[1].iov_len = encoded->xe_length;
+		xpc_connection_flush(conn);
+		xpc_pipe_sendv(iov, 2, conn->xc_local_port,
+		    conn->xc_remote_port);
+		xpc_encoded_release(encoded);
+	});
+}
+
+void
+xpc_connection_broadcast(xpc_connection_t xconn, xpc_encoded_t encoded)
+{
+	struct xpc_connection *conn;
+
+	conn = (struct xpc_connection *)xconn;
+	xpc_encoded_retain(encoded);
+
+	/* Peers come and go on the receive queue */
+	dispatch_async(conn->xc_recv_queue, ^{
+		struct xpc_connection *peer;
+
+		TAILQ_FOREACH(peer, &conn->xc_peers, xc_link)
+			xpc_connection_send_encoded((xpc_connection_t)peer,
+			    encoded);
+
+		xpc_encoded_release(encoded);
 	});
 }
 
@@ -197,29 +636,135 @@ xpc_connection_send_message_with_reply(xpc_connection_t xconn,
 	call->xp_id = XPC_CONNECTION_NEXT_ID(conn);
 	call->xp_handler = handler;
 	call->xp_queue = targetq;
+	pthread_mutex_lock(&conn->xc_calls_lock);
 	TAILQ_INSERT_TAIL(&conn->xc_pending, call, xp_link);
+	pthread_mutex_unlock(&conn->xc_calls_lock);
 
 	dispatch_async(conn->xc_send_queue, ^{
-		xpc_send(xconn, message, call->xp_id);
+		xpc_send(xconn, message, call->xp_id, 0);
 	});
 
 }
 
+static void
+xpc_waiter_destroy(void *context)
+{
+	struct xpc_waiter *waiter;
+
+	waiter = context;
+	dispatch_release(waiter->xw_sem);
+	free(waiter);
+}
+
+static void
+xpc_waiter_init(void)
+{
+
+	pthread_key_create(&xpc_waiter_key, xpc_waiter_destroy);
+}
+
+/*
+ * Returns the calling thread's waiter, creating it on first use.
+ */
+static struct xpc_waiter *
+xpc_waiter_get(void)
+{
+	struct xpc_waiter *waiter;
+
+	pthread_once(&xpc_waiter_once, xpc_waiter_init);
+	if ((waiter = pthread_getspecific(xpc_waiter_key)) != NULL)
+		return (waiter);
+
+	if ((waiter = malloc(sizeof(*waiter))) == NULL)
+		return (NULL);
+
+	waiter->xw_sem = dispatch_semaphore_create(0);
+	pthread_setspecific(xpc_waiter_key, waiter);
+	return (waiter);
+}
+
+/*
+ * Hands a reply to the thread waiting for it, if there is one.
+ */
+static bool
+xpc_connection_wake(struct xpc_connection *conn, xpc_object_t result,
+    uint64_t id)
+{
+	struct xpc_waiter *waiter;
+
+	pthread_mutex_lock(&conn->xc_calls_lock);
+	TAILQ_FOREACH(waiter, &conn->xc_waiters, xw_link) {
+		if (waiter->xw_id == id) {
+			TAILQ_REMOVE(&conn->xc_waiters, waiter, xw_link);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn->xc_calls_lock);
+
+	if (waiter == NULL)
+		return (false);
+
+	waiter->xw_result = result;
+	dispatch_semaphore_signal(waiter->xw_sem);
+	return (true);
+}
+
+static void
+xpc_connection_abort_waiters(struct xpc_connection *conn)
+{
+	struct xpc_waiter *waiter;
+
+	pthread_mutex_lock(&conn->xc_calls_lock);
+	while ((waiter = TAILQ_FIRST(&conn->xc_waiters)) != NULL) {
+		TAILQ_REMOVE(&conn->xc_waiters, waiter, xw_link);
+		waiter->xw_result =
+		    (xpc_object_t)XPC_ERROR_CONNECTION_INTERRUPTED;
+		dispatch_semaphore_signal(waiter->xw_sem);
+	}
+	pthread_mutex_unlock(&conn->xc_calls_lock);
+}
+
+/*
+ * Waits for the reply on the calling thread's own semaphore, which the
+ * receive queue signals as soon as the reply is decoded; neither the
+ * send queue nor the target queue take part unless busy.
+ */
 xpc_object_t
-xpc_connection_send_message_with_reply_sync(xpc_connection_t conn,
+xpc_connection_send_message_with_reply_sync(xpc_connection_t xconn,
     xpc_object_t message)
 {
-	__block xpc_object_t result;
-	dispatch_semaphore_t sem = dispatch_semaphore_create(0);
+	struct xpc_connection *conn;
+	struct xpc_waiter *waiter;
+	__block int err;
+	uint64_t id;
 
-	xpc_connection_send_message_with_reply(conn, message, NULL,
-	    ^(xpc_object_t o) {
-		result = o;
-		dispatch_semaphore_signal(sem);
+	conn = (struct xpc_connection *)xconn;
+	if ((waiter = xpc_waiter_get()) == NULL)
+		return ((xpc_object_t)XPC_ERROR_CONNECTION_INVALID);
+
+	id = XPC_CONNECTION_NEXT_ID(conn);
+	waiter->xw_id = id;
+	waiter->xw_result = NULL;
+	pthread_mutex_lock(&conn->xc_calls_lock);
+	TAILQ_INSERT_TAIL(&conn->xc_waiters, waiter, xw_link);
+	pthread_mutex_unlock(&conn->xc_calls_lock);
+
+	/*
+	 * An idle serial queue runs a dispatch_sync() block on the calling
+	 * thread, after anything queued before it.
+	 */
+	dispatch_sync(conn->xc_send_queue, ^{
+		err = xpc_send(xconn, message, id, 0);
+		xpc_connection_flush(conn);
 	});
 
-	dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
-	return (result);
+	/* Unless the connection went away and woke us already */
+	if (err != 0)
+		xpc_connection_wake(conn,
+		    (xpc_object_t)XPC_ERROR_CONNECTION_INVALID, id);
+
+	dispatch_semaphore_wait(waiter->xw_sem, DISPATCH_TIME_FOREVER);
+	return (waiter->xw_result);
 }
 
 void
@@ -228,7 +773,26 @@ xpc_connection_send_barrier(xpc_connection_t xconn, dispatch_block_t barrier)
 	struct xpc_connection *conn;
 
 	conn = (struct xpc_connection *)xconn;
-	dispatch_sync(conn->xc_send_queue, barrier);
+	dispatch_sync(conn->xc_send_queue, ^{
+		xpc_connection_flush(conn);
+		barrier();
+	});
+}
+
+void
+xpc_connection_set_batching(xpc_connection_t xconn, uint64_t latency,
+    size_t max_size)
+{
+	struct xpc_connection *conn;
+
+	conn = (struct xpc_connection *)xconn;
+	dispatch_async(conn->xc_send_queue, ^{
+		xpc_connection_flush(conn);
+		free(conn->xc_batch.xb_buffer);
+		conn->xc_batch.xb_buffer = NULL;
+		conn->xc_batch.xb_latency = latency;
+		conn->xc_batch.xb_max = max_size;
+	});
 }
 
 void
@@ -300,6 +864,24 @@ xpc_connection_get_context(xpc_connection_t xconn)
 	return (conn->xc_context);
 }
 
+void
+xpc_connection_set_schema(xpc_connection_t xconn, xpc_schema_t schema)
+{
+	struct xpc_connection *conn;
+
+	conn = (struct xpc_connection *)xconn;
+	conn->xc_schema = schema;
+}
+
+void
+xpc_connection_set_router(xpc_connection_t xconn, xpc_router_t router)
+{
+	struct xpc_connection *conn;
+
+	conn = (struct xpc_connection *)xconn;
+	conn->xc_router = router;
+}
+
 void
 xpc_connection_set_finalizer_f(xpc_connection_t connection,
     xpc_finalizer_t finalizer)
@@ -332,18 +914,103 @@ xpc_transaction_end(void)
 
 }
 
-static void
-xpc_send(xpc_connection_t xconn, xpc_object_t message, uint64_t id)
+static int
+xpc_send(xpc_connection_t xconn, xpc_object_t message, uint64_t id,
+    uint32_t method)
 {
 	struct xpc_connection *conn;
+	struct xpc_frame frame;
+	uint64_t generation;
 	int err;
 
 	debugf("connection=%p, message=%p, id=%lu", xconn, message, id);
 
 	conn = (struct xpc_connection *)xconn;
-	if (xpc_pipe_send(message, id, conn->xc_local_port,
-	    conn->xc_remote_port) != 0)
+	memset(&frame, 0, sizeof(frame));
+	frame.xf_id = id;
+	frame.xf_method = method;
+	err = xpc_pipe_send(message, &frame, conn->xc_features, &conn->xc_keys,
+	    &conn->xc_compression, &conn->xc_batch, conn->xc_local_port,
+	    conn->xc_remote_port);
+	if (err < 0) {
 		debugf("send failed: %s", strerror(errno));
+		return (-1);
+	}
+
+	/* The message started a batch; it goes out within the window */
+	if (err == 1) {
+		generation = conn->xc_batch.xb_generation;
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW,
+		    (int64_t)conn->xc_batch.xb_latency), conn->xc_send_queue, ^{
+			if (conn->xc_batch.xb_generation == generation)
+				xpc_connection_flush(conn);
+		});
+	}
+
+	return (0);
+}
+
+/*
+ * Sends out the messages batched so far. Called on the send queue
+ * before anything that does not go through the batch, to keep the
+ * connection's order.
+ */
+static void
+xpc_connection_flush(struct xpc_connection *conn)
+{
+
+	if (xpc_pipe_flush(&conn->xc_batch, conn->xc_features,
+	    conn->xc_local_port, conn->xc_remote_port) != 0)
+		debugf("flush failed: %s", strerror(errno));
+}
+
+static uint64_t
+xpc_connection_features(struct xpc_connection *conn)
+{
+
+	/* Frames passed on undecoded must not use this hop's key table */
+	if (conn->xc_frame_handler != NULL)
+		return (XPC_FEATURES_SUPPORTED & ~XPC_FEATURE_KEY_TABLE);
+
+	return (XPC_FEATURES_SUPPORTED);
+}
+
+/*
+ * Offers our features to the peer. A peer that understands the offer
+ * answers with its own, and both ends then use what they have in common;
+ * older peers drop it as a frame of an unknown version.
+ */
+static void
+xpc_connection_send_hello(struct xpc_connection *conn)
+{
+	uint64_t features;
+
+	conn->xc_hello_sent = true;
+	features = xpc_connection_features(conn);
+	dispatch_async(conn->xc_send_queue, ^{
+		xpc_connection_flush(conn);
+		if (xpc_pipe_send_hello(features,
+		    xpc_compression_dict_id(&conn->xc_compression),
+		    conn->xc_local_port, conn->xc_remote_port) != 0)
+			debugf("hello failed: %s", strerror(errno));
+	});
+}
+
+static bool
+xpc_connection_recv_hello(struct xpc_connection *conn,
+    const struct xpc_frame *frame)
+{
+
+	if ((frame->xf_flags & XPC_FRAME_HELLO) == 0)
+		return (false);
+
+	debugf("connection=%p, features=%#lx", conn, frame->xf_features);
+	conn->xc_features = frame->xf_features & xpc_connection_features(conn);
+	conn->xc_compression.xz_peer_dict = frame->xf_dict;
+	if (!conn->xc_hello_sent)
+		xpc_connection_send_hello(conn);
+
+	return (true);
 }
 
 #ifdef MACH
@@ -394,18 +1061,24 @@ xpc_connection_new_peer(void *context, xpc_port_t local, xpc_port_t remote, disp
 	conn = context;
 	peer = (struct xpc_connection *)xpc_connection_create(NULL, NULL);
 	peer->xc_parent = conn;
+	peer->xc_schema = conn->xc_schema;
+	peer->xc_router = conn->xc_router;
+	peer->xc_inline = conn->xc_inline;
+	xpc_connection_apply_concurrency(peer, conn->xc_concurrency);
+	xpc_compression_inherit(&peer->xc_compression, &conn->xc_compression);
 	peer->xc_local_port = local;
 	peer->xc_remote_port = remote;
 	peer->xc_recv_source = src;
 
 	TAILQ_INSERT_TAIL(&conn->xc_peers, peer, xc_link);
 
+	/* Inline, the peer has its handler before its first message */
 	if (src) {
 		dispatch_set_context(src, peer);
-		dispatch_resume(src);
-		dispatch_async(conn->xc_target_queue, ^{
+		xpc_connection_deliver(conn, ^{
 		    conn->xc_handler(peer);
 		});
+		dispatch_resume(src);
 	}
 
 	return (peer);
@@ -427,100 +1100,233 @@ xpc_connection_destroy_peer(void *context)
 		TAILQ_REMOVE(&parent->xc_peers, conn, xc_link);
 	}
 
+	/*
+	 * The batch belongs to the send queue, where replies and flush
+	 * timers for this peer may still be waiting. What it holds could
+	 * not be delivered anyway.
+	 */
+	dispatch_async(conn->xc_send_queue, ^{
+		free(conn->xc_batch.xb_buffer);
+		conn->xc_batch.xb_buffer = NULL;
+		conn->xc_batch.xb_length = 0;
+		conn->xc_batch.xb_count = 0;
+		conn->xc_batch.xb_latency = 0;
+		conn->xc_batch.xb_generation++;
+	});
+
+	/* A dead peer must not keep its listener from reading */
+	xpc_connection_throttle(conn, false);
+	xpc_decoder_destroy(&conn->xc_decoder);
 	dispatch_release(conn->xc_recv_source);
 }
 
 static void
 xpc_connection_dispatch_callback(struct xpc_connection *conn,
-    xpc_object_t result, uint64_t id)
+    xpc_object_t result, uint64_t id, uint32_t method)
 {
 	struct xpc_pending_call *call;
 
+	if (xpc_connection_wake(conn, result, id))
+		return;
+
+	/* Taken off the list here, as handlers may run concurrently */
+	pthread_mutex_lock(&conn->xc_calls_lock);
 	TAILQ_FOREACH(call, &conn->xc_pending, xp_link) {
 		if (call->xp_id == id) {
-			dispatch_async(conn->xc_target_queue, ^{
-			    call->xp_handler(result);
-			    TAILQ_REMOVE(&conn->xc_pending, call,
-				xp_link);
-			    free(call);
-			});
-			return;
+			TAILQ_REMOVE(&conn->xc_pending, call, xp_link);
+			break;
 		}
 	}
+	pthread_mutex_unlock(&conn->xc_calls_lock);
+
+	if (call != NULL) {
+		xpc_connection_deliver_message(conn, ^{
+		    call->xp_handler(result);
+		    free(call);
+		});
+		return;
+	}
+
+	if (conn->xc_router != NULL &&
+	    xpc_router_dispatch(conn->xc_router, conn, result, method))
+		return;
 
 	if (conn->xc_handler) {
 		debugf("yes");
-		dispatch_async(conn->xc_target_queue, ^{
+		xpc_connection_deliver_message(conn, ^{
 		    debugf("calling handler=%p", conn->xc_handler);
 		    conn->xc_handler(result);
 		});
 	}
 }
 
-void
-xpc_connection_recv_message(void *context)
+/*
+ * Hands a frame to the frame handler. The body is copied out of the
+ * decoder, which keeps its buffer for the next frame.
+ */
+static void
+xpc_connection_dispatch_frame(struct xpc_connection *conn,
+    const struct xpc_frame *frame)
+{
+	struct xpc_encoded *encoded;
+
+	if (frame->xf_flags & XPC_FRAME_KEYS) {
+		debugf("key definitions on a raw connection");
+		return;
+	}
+
+	if ((encoded = malloc(sizeof(*encoded))) == NULL)
+		return;
+
+	encoded->xe_refcnt = 1;
+	encoded->xe_method = frame->xf_method;
+	encoded->xe_length = frame->xf_length;
+	if ((encoded->xe_body = malloc(frame->xf_length)) == NULL) {
+		free(encoded);
+		return;
+	}
+
+	memcpy(encoded->xe_body, frame->xf_body, frame->xf_length);
+	xpc_connection_deliver_message(conn, ^{
+		conn->xc_frame_handler(encoded);
+	});
+}
+
+/*
+ * Receives and dispatches one frame; returns what xpc_pipe_receive()
+ * did.
+ */
+static int
+xpc_connection_recv_frame(struct xpc_connection *conn)
 {
-	struct xpc_pending_call *call;
-	struct xpc_connection *conn;
 	struct xpc_credentials creds;
 	xpc_object_t result;
+	struct xpc_frame frame;
 	xpc_port_t remote;
-	uint64_t id;
 	int err;
 
-	debugf("connection=%p", context);
-
-	conn = context;
-	err = xpc_pipe_receive(conn->xc_local_port, &remote, &result, &id,
-	    &creds);
+	err = xpc_pipe_receive(conn->xc_local_port, &remote, &frame, &creds,
+	    &conn->xc_compression, &conn->xc_decoder);
 
 	if (err < 0)
-		return;
+		return (err);
 
 	if (err == 0) {
 		dispatch_source_cancel(conn->xc_recv_source);
-		return;
+		xpc_connection_abort_waiters(conn);
+		return (err);
+	}
+
+	if (xpc_connection_recv_hello(conn, &frame))
+		return (err);
+
+	if (conn->xc_frame_handler != NULL) {
+		xpc_connection_dispatch_frame(conn, &frame);
+		return (err);
 	}
 
-	debugf("msg=%p, id=%lu", result, id);
+	result = xpc_pipe_decode(&frame, conn->xc_schema, &conn->xc_keys,
+	    &conn->xc_decoder);
+	if (result == NULL)
+		return (err);
+
+	debugf("msg=%p, id=%lu", result, frame.xf_id);
 
 	conn->xc_creds = creds;
 
-	xpc_connection_dispatch_callback(conn, result, id);
+	xpc_connection_dispatch_callback(conn, result, frame.xf_id,
+	    frame.xf_method);
+	return (err);
 }
 
 void
-xpc_connection_recv_mach_message(void *context)
+xpc_connection_recv_message(void *context)
 {
-	struct xpc_transport *transport = xpc_get_transport();
+	struct xpc_connection *conn;
 
-	struct xpc_connection *conn, *peer;
+	debugf("connection=%p", context);
+
+	conn = context;
+
+	/*
+	 * A read on a stream transport may bring in several frames; the
+	 * source will not fire again for those already buffered.
+	 */
+	while (xpc_connection_recv_frame(conn) > 0 &&
+	    conn->xc_throttles == 0 && xpc_pipe_pending(&conn->xc_decoder))
+		;
+}
+
+/*
+ * Receives and dispatches one frame on a listener that serves every peer
+ * from one port; returns what xpc_pipe_receive() did.
+ */
+static int
+xpc_connection_recv_mach_frame(struct xpc_connection *conn)
+{
+	struct xpc_transport *transport = xpc_get_transport();
+	struct xpc_connection *peer;
 	struct xpc_credentials creds;
 	xpc_object_t result;
+	struct xpc_frame frame;
 	xpc_port_t remote;
 	uint64_t id;
+	uint32_t method;
+	bool new_peer;
 	int err;
 
-	debugf("connection=%p", context);
+	/* Every peer's messages arrive here, in the listener's decoder */
+	err = xpc_pipe_receive(conn->xc_local_port, &remote, &frame, &creds,
+	    &conn->xc_compression, &conn->xc_decoder);
+	if (err <= 0)
+		return (err);
 
-	conn = context;
-	if (xpc_pipe_receive(conn->xc_local_port, &remote, &result, &id,
-	    &creds) < 0)
-		return;
-
-	debugf("message=%p, id=%lu, remote=%s", result, id,
-	    transport->xt_port_to_string(remote));
+	id = frame.xf_id;
+	method = frame.xf_method;
+	debugf("id=%lu, remote=%s", id, transport->xt_port_to_string(remote));
 
-	peer = xpc_connection_get_peer(context, remote);
+	/* The peer's key table is needed to decode the message */
+	new_peer = false;
+	peer = xpc_connection_get_peer(conn, remote);
 	if (!peer) {
 		debugf("new peer on port %s",
 		    transport->xt_port_to_string(remote));
-		peer = xpc_connection_new_peer(context, conn->xc_local_port, remote, NULL);
+		peer = xpc_connection_new_peer(conn, conn->xc_local_port, remote, NULL);
+		new_peer = true;
+	}
+
+	result = NULL;
+	if (!xpc_connection_recv_hello(peer, &frame)) {
+		if (peer->xc_frame_handler != NULL)
+			xpc_connection_dispatch_frame(peer, &frame);
+		else
+			result = xpc_pipe_decode(&frame, peer->xc_schema,
+			    &peer->xc_keys, &conn->xc_decoder);
+	}
 
-		dispatch_async(conn->xc_target_queue, ^{
+	if (new_peer) {
+		xpc_connection_deliver(conn, ^{
 		    conn->xc_handler(peer);
-		    xpc_connection_dispatch_callback(peer, result, id);
+		    if (result != NULL)
+			xpc_connection_dispatch_callback(peer, result, id,
+			    method);
 		});
-	} else
-		xpc_connection_dispatch_callback(peer, result, id);
+	} else if (result != NULL)
+		xpc_connection_dispatch_callback(peer, result, id, method);
+
+	return (err);
+}
+
+void
+xpc_connection_recv_mach_message(void *context)
+{
+	struct xpc_connection *conn;
+
+	debugf("connection=%p", context);
+
+	/* A batch frame holds several messages, maybe for as many peers */
+	conn = context;
+	while (xpc_connection_recv_mach_frame(conn) > 0 &&
+	    conn->xc_throttles == 0 && xpc_pipe_pending(&conn->xc_decoder))
+		;
 }
\ No newline at end of file
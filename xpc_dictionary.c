@@ -26,22 +26,185 @@
  */
 
 #include <sys/types.h>
+#include <sys/endian.h>
 #include "xpc/xpc.h"
 #include "xpc_internal.h"
 #include "mpack.h"
 
+#define	XPC_DUP_SCAN_MAX	16
+
 static struct xpc_object *
-mpack2xpc_extension(int8_t type, const char *data)
+mpack2xpc_extension(int8_t type, const char *data, size_t length)
+{
+	struct xpc_object *xo;
+	size_t elsize, count;
+
+	elsize = xpc_typed_array_element_size(type - XPC_EXT_TYPED_ARRAY);
+	if (elsize == 0 || length % elsize != 0) {
+		debugf("unknown extension type %d, length %zu", type, length);
+		return (xpc_null_create());
+	}
+
+	count = length / elsize;
+	xo = xpc_typed_array_create(type - XPC_EXT_TYPED_ARRAY, NULL, count);
+	if (xo == NULL || xo->xo_size != count) {
+		if (xo != NULL)
+			xpc_release(xo);
+
+		return (xpc_null_create());
+	}
+
+	xpc_typed_array_swab(xo->xo_typed.ta_data, data, count,
+	    xo->xo_typed.ta_type);
+	return (xo);
+}
+
+static void
+xpc2mpack_typed_array(mpack_writer_t *writer, struct xpc_object *xo)
+{
+	size_t elsize, length;
+#if BYTE_ORDER == BIG_ENDIAN
+	char buf[4096];
+	const char *data;
+	size_t count, n;
+#endif
+
+	elsize = xpc_typed_array_element_size(xo->xo_typed.ta_type);
+	length = xo->xo_size * elsize;
+	if (length > UINT32_MAX) {
+		mpack_writer_flag_error(writer, mpack_error_too_big);
+		return;
+	}
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+	/* Host order is wire order: the buffer goes out as-is */
+	mpack_write_ext(writer, XPC_EXT_TYPED_ARRAY + xo->xo_typed.ta_type,
+	    xo->xo_typed.ta_data, (uint32_t)length);
+#else
+	mpack_start_ext(writer, XPC_EXT_TYPED_ARRAY + xo->xo_typed.ta_type,
+	    (uint32_t)length);
+	data = xo->xo_typed.ta_data;
+	for (count = xo->xo_size; count > 0; count -= n) {
+		n = count < sizeof(buf) / elsize ? count : sizeof(buf) / elsize;
+		xpc_typed_array_swab(buf, data, n, xo->xo_typed.ta_type);
+		mpack_write_bytes(writer, buf, n * elsize);
+		data += n * elsize;
+	}
+	mpack_finish_ext(writer);
+#endif
+}
+
+static bool
+xpc_gather_takes(size_t length, size_t count)
+{
+
+	return (length >= XPC_GATHER_MIN && length <= UINT32_MAX &&
+	    count < XPC_GATHER_MAX);
+}
+
+/*
+ * Writes the header of a large string or data leaf and records where
+ * its bytes belong, without writing them.
+ */
+static bool
+xpc2mpack_gather(mpack_writer_t *writer, struct xpc_gather *gather,
+    mpack_type_t type, const void *base, size_t length)
 {
+	size_t n;
+
+	if (gather == NULL || !xpc_gather_takes(length, gather->xg_count))
+		return (false);
+
+	if (type == mpack_type_str)
+		mpack_start_str(writer, (uint32_t)length);
+	else
+		mpack_start_bin(writer, (uint32_t)length);
 
+	n = gather->xg_count++;
+	gather->xg_refs[n].gr_offset = mpack_writer_buffer_used(writer);
+	gather->xg_refs[n].gr_base = base;
+	gather->xg_refs[n].gr_length = length;
+	mpack_finish_type(writer, type);
+	return (true);
+}
+
+/* Interns a string key from the wire; NULL leaves it to be copied */
+static const char *
+xpc_dictionary_intern_node(mpack_node_t keynode)
+{
+	const char *key;
+	size_t length;
+
+	key = mpack_node_data(keynode);
+	length = mpack_node_data_len(keynode);
+	if (key == NULL || memchr(key, '\0', length) != NULL)
+		return (NULL);
+
+	return (xpc_key_intern_string(key, length));
+}
+
+static int
+xpc_dictionary_key_compare(const void *a, const void *b)
+{
+
+	return (strcmp(*(const char * const *)a, *(const char * const *)b));
+}
+
+/*
+ * Looks for a key that appears twice in a dictionary decoded into a
+ * block. Small ones are scanned pairwise; larger ones have their keys
+ * sorted so a hostile peer cannot make the check quadratic. Returns 1
+ * for a duplicate, 0 for none and -1 if memory runs out.
+ */
+static int
+xpc_dictionary_find_duplicate(struct xpc_object *xo)
+{
+	struct xpc_dict_pair *pairs;
+	const char **sorted;
+	size_t i, j, n;
+	int ret;
+
+	pairs = ((struct xpc_dict_block *)xo)->db_pairs;
+	n = xo->xo_size;
+	if (n <= XPC_DUP_SCAN_MAX) {
+		for (i = 1; i < n; i++) {
+			for (j = 0; j < i; j++) {
+				if (pairs[i].key == pairs[j].key ||
+				    strcmp(pairs[i].key, pairs[j].key) == 0)
+					return (1);
+			}
+		}
+
+		return (0);
+	}
+
+	if ((sorted = malloc(n * sizeof(*sorted))) == NULL)
+		return (-1);
+
+	for (i = 0; i < n; i++)
+		sorted[i] = pairs[i].key;
+
+	qsort(sorted, n, sizeof(*sorted), xpc_dictionary_key_compare);
+	ret = 0;
+	for (i = 1; i < n && ret == 0; i++) {
+		if (strcmp(sorted[i - 1], sorted[i]) == 0)
+			ret = 1;
+	}
+
+	free(sorted);
+	return (ret);
 }
 
 struct xpc_object *
-mpack2xpc(const mpack_node_t node)
+mpack2xpc(const mpack_node_t node, const struct xpc_key_table *keys)
 {
+	const struct xpc_key *xk;
+	const char *key;
 	xpc_object_t xotmp;
+	mpack_node_t keynode;
 	size_t i;
 	xpc_u val;
+	int dup;
 
 	switch (mpack_node_type(node)) {
 	case mpack_type_nil:
@@ -74,31 +237,65 @@ mpack2xpc(const mpack_node_t node)
 		break;
 
 	case mpack_type_bin:
+		/* Like strings, the bytes must outlive the receive buffer */
+		val.ptr = (uintptr_t)malloc(mpack_node_data_len(node));
+		memcpy((void *)val.ptr, mpack_node_data(node),
+		    mpack_node_data_len(node));
+		xotmp = xpc_data_create((void *)val.ptr,
+		    mpack_node_data_len(node));
 		break;
 
 	case mpack_type_array:
 		xotmp = xpc_array_create(NULL, 0);
 		for (i = 0; i < mpack_node_array_length(node); i++) {
 			xpc_object_t item = mpack2xpc(
-			    mpack_node_array_at(node, i));
-			xpc_array_append_value(item, xotmp);
+			    mpack_node_array_at(node, i), keys);
+			xpc_array_append_value(xotmp, item);
+			xpc_release(item);
 		}
 		break;
 
 	case mpack_type_map:
-		xotmp = xpc_dictionary_create(NULL, NULL, 0);
+		/*
+		 * Appending skips the per-key duplicate checks; the whole map
+		 * is checked once it is built, since the peer may not be ours.
+		 */
+		xotmp = xpc_dictionary_create_block(mpack_node_map_count(node));
 		for (i = 0; i < mpack_node_map_count(node); i++) {
-			char *key = mpack_node_cstr_alloc(
-			    mpack_node_map_key_at(node, i), 1024);
 			xpc_object_t value = mpack2xpc(
-			    mpack_node_map_value_at(node, i));
-			xpc_dictionary_set_value(xotmp, key, value);
+			    mpack_node_map_value_at(node, i), keys);
+			keynode = mpack_node_map_key_at(node, i);
+			if (mpack_node_type(keynode) == mpack_type_str &&
+			    (key = xpc_dictionary_intern_node(keynode)) != NULL)
+				xpc_dictionary_append_interned(xotmp, key,
+				    value);
+			else if (mpack_node_type(keynode) != mpack_type_uint)
+				xpc_dictionary_append_pair(xotmp,
+				    mpack_node_cstr_alloc(keynode, 1024), value);
+			else if ((xk = xpc_keys_get(keys, keynode)) == NULL)
+				mpack_node_flag_error(keynode, mpack_error_data);
+			else if (xk->xk_interned)
+				xpc_dictionary_append_interned(xotmp,
+				    xk->xk_key, value);
+			else
+				xpc_dictionary_append_pair(xotmp,
+				    strdup(xk->xk_key), value);
+			xpc_release(value);
 		}
+
+		if (mpack_node_error(node) != mpack_ok)
+			break;
+
+		if ((dup = xpc_dictionary_find_duplicate(xotmp)) > 0) {
+			debugf("duplicate key in decoded dictionary");
+			mpack_node_flag_error(node, mpack_error_data);
+		} else if (dup < 0)
+			mpack_node_flag_error(node, mpack_error_memory);
 		break;
 
 	case mpack_type_ext:
 		xotmp = mpack2xpc_extension(mpack_node_exttype(node),
-		    mpack_node_data(node));
+		    mpack_node_data(node), mpack_node_data_len(node));
 		break;
 
 	default:
@@ -110,28 +307,41 @@ mpack2xpc(const mpack_node_t node)
 }
 
 void
-xpc2mpack(mpack_writer_t *writer, xpc_object_t obj)
+xpc2mpack(mpack_writer_t *writer, xpc_object_t obj,
+    struct xpc_key_table *keys, struct xpc_gather *gather)
 {
 	struct xpc_object *xotmp = obj;
+	xpc_iterator_t iter;
+	const char *str;
 
 	switch (xotmp->xo_xpc_type) {
 	case _XPC_TYPE_DICTIONARY:
+	case _XPC_TYPE_PDICTIONARY:
 		mpack_start_map(writer, xpc_dictionary_get_count(obj));
-		xpc_dictionary_apply(obj, ^(const char *k, xpc_object_t v) {
-		    mpack_write_cstr(writer, k);
-		    xpc2mpack(writer, v);
-		    return ((bool)true);
-		});
+		xpc_iterator_begin(&iter, obj);
+		while (xpc_iterator_next(&iter)) {
+			if (keys != NULL)
+				xpc_keys_write(keys, writer, iter.key);
+			else
+				mpack_write_cstr(writer, iter.key);
+
+			xpc2mpack(writer, iter.value, keys, gather);
+		}
+		xpc_iterator_end(&iter);
 		mpack_finish_map(writer);
 		break;
 
 	case _XPC_TYPE_ARRAY:
 		mpack_start_array(writer, xpc_array_get_count(obj));
-		xpc_array_apply(obj, ^(size_t index __unused, xpc_object_t v) {
-		    xpc2mpack(writer, v);
-		    return ((bool)true);
-		});
-		mpack_finish_map(writer);
+		xpc_iterator_begin(&iter, obj);
+		while (xpc_iterator_next(&iter))
+			xpc2mpack(writer, iter.value, keys, gather);
+		xpc_iterator_end(&iter);
+		mpack_finish_array(writer);
+		break;
+
+	case _XPC_TYPE_TYPED_ARRAY:
+		xpc2mpack_typed_array(writer, xotmp);
 		break;
 
 	case _XPC_TYPE_NULL:
@@ -148,13 +358,28 @@ xpc2mpack(mpack_writer_t *writer, xpc_object_t obj)
 
 	case _XPC_TYPE_DOUBLE:
 		mpack_write_double(writer, xpc_double_get_value(obj));
+		break;
 
 	case _XPC_TYPE_UINT64:
 		mpack_write_u64(writer, xpc_uint64_get_value(obj));
 		break;
 
 	case _XPC_TYPE_STRING:
-		mpack_write_cstr(writer, xpc_string_get_string_ptr(obj));
+		str = xpc_string_get_string_ptr(obj);
+		if (!xpc2mpack_gather(writer, gather, mpack_type_str, str,
+		    strlen(str)))
+			mpack_write_cstr(writer, str);
+		break;
+
+	case _XPC_TYPE_DATA:
+		if (!xpc2mpack_gather(writer, gather, mpack_type_bin,
+		    xpc_data_get_bytes_ptr(obj), xpc_data_get_length(obj)))
+			mpack_write_bin(writer, xpc_data_get_bytes_ptr(obj),
+			    (uint32_t)xpc_data_get_length(obj));
+		break;
+
+	case _XPC_TYPE_DATE:
+		mpack_write_i64(writer, xpc_date_get_value(obj));
 		break;
 
 	case _XPC_TYPE_UUID:
@@ -162,32 +387,295 @@ xpc2mpack(mpack_writer_t *writer, xpc_object_t obj)
 	}
 }
 
+/*
+ * Sizes of the MessagePack headers mpack writes, which always picks
+ * the shortest encoding.
+ */
+static size_t
+mpack_uint_size(uint64_t value)
+{
+
+	if (value <= 0x7f)
+		return (1);
+	if (value <= UINT8_MAX)
+		return (2);
+	if (value <= UINT16_MAX)
+		return (3);
+	if (value <= UINT32_MAX)
+		return (5);
+	return (9);
+}
+
+static size_t
+mpack_int_size(int64_t value)
+{
+
+	if (value >= 0)
+		return (mpack_uint_size((uint64_t)value));
+	if (value >= -32)
+		return (1);
+	if (value >= INT8_MIN)
+		return (2);
+	if (value >= INT16_MIN)
+		return (3);
+	if (value >= INT32_MIN)
+		return (5);
+	return (9);
+}
+
+static size_t
+mpack_count_size(size_t count)
+{
+
+	if (count <= 15)
+		return (1);
+	return (count <= UINT16_MAX ? 3 : 5);
+}
+
+static size_t
+mpack_str_header(size_t length)
+{
+
+	if (length <= 31)
+		return (1);
+	if (length <= UINT8_MAX)
+		return (2);
+	return (length <= UINT16_MAX ? 3 : 5);
+}
+
+static size_t
+mpack_bin_header(size_t length)
+{
+
+	if (length <= UINT8_MAX)
+		return (2);
+	return (length <= UINT16_MAX ? 3 : 5);
+}
+
+static size_t
+mpack_ext_size(size_t length)
+{
+
+	switch (length) {
+	case 1: case 2: case 4: case 8: case 16:
+		return (2 + length);
+	}
+
+	if (length <= UINT8_MAX)
+		return (3 + length);
+	return ((length <= UINT16_MAX ? 4 : 6) + length);
+}
+
+static size_t
+mpack_leaf_size(size_t header, size_t length, size_t *gathered)
+{
+
+	if (gathered == NULL || !xpc_gather_takes(length, *gathered))
+		return (header + length);
+
+	(*gathered)++;
+	return (header);
+}
+
+/*
+ * Returns exactly how many bytes xpc2mpack() writes for obj without
+ * a key table. With gathered, large leaves are left out as they would
+ * be with a gather list; *gathered counts them and must start at 0.
+ */
+size_t
+xpc2mpack_size(xpc_object_t obj, size_t *gathered)
+{
+	struct xpc_object *xotmp = obj;
+	xpc_iterator_t iter;
+	size_t size;
+
+	switch (xotmp->xo_xpc_type) {
+	case _XPC_TYPE_DICTIONARY:
+	case _XPC_TYPE_PDICTIONARY:
+		size = mpack_count_size(xpc_dictionary_get_count(obj));
+		xpc_iterator_begin(&iter, obj);
+		while (xpc_iterator_next(&iter)) {
+			size += mpack_str_header(strlen(iter.key)) +
+			    strlen(iter.key);
+			size += xpc2mpack_size(iter.value, gathered);
+		}
+		xpc_iterator_end(&iter);
+		return (size);
+
+	case _XPC_TYPE_ARRAY:
+		size = mpack_count_size(xpc_array_get_count(obj));
+		xpc_iterator_begin(&iter, obj);
+		while (xpc_iterator_next(&iter))
+			size += xpc2mpack_size(iter.value, gathered);
+		xpc_iterator_end(&iter);
+		return (size);
+
+	case _XPC_TYPE_TYPED_ARRAY:
+		return (mpack_ext_size(xotmp->xo_size *
+		    xpc_typed_array_element_size(xotmp->xo_typed.ta_type)));
+
+	case _XPC_TYPE_NULL:
+	case _XPC_TYPE_BOOL:
+		return (1);
+
+	case _XPC_TYPE_INT64:
+		return (mpack_int_size(xpc_int64_get_value(obj)));
+
+	case _XPC_TYPE_DOUBLE:
+		return (9);
+
+	case _XPC_TYPE_UINT64:
+		return (mpack_uint_size(xpc_uint64_get_value(obj)));
+
+	case _XPC_TYPE_STRING:
+		size = strlen(xpc_string_get_string_ptr(obj));
+		return (mpack_leaf_size(mpack_str_header(size), size,
+		    gathered));
+
+	case _XPC_TYPE_DATA:
+		size = xpc_data_get_length(obj);
+		return (mpack_leaf_size(mpack_bin_header(size), size,
+		    gathered));
+
+	case _XPC_TYPE_DATE:
+		return (mpack_int_size(xpc_date_get_value(obj)));
+	}
+
+	return (0);
+}
+
+__private_extern__ struct xpc_object *
+xpc_dictionary_create_block(size_t capacity)
+{
+	struct xpc_dict_block *block;
+	xpc_u val;
+
+	if (capacity == 0)
+		return (_xpc_prim_create(_XPC_TYPE_DICTIONARY, val, 0));
+
+	block = malloc(sizeof(*block) + capacity * sizeof(block->db_pairs[0]));
+	if (block == NULL)
+		return (NULL);
+
+	block->db_capacity = capacity;
+	_xpc_prim_init(&block->db_object, _XPC_TYPE_DICTIONARY, val, 0,
+	    _XPC_DICT_BLOCK);
+	return (&block->db_object);
+}
+
+static void
+xpc_dictionary_add_pair(struct xpc_object *xo, const char *key,
+    xpc_object_t value, bool interned)
+{
+	struct xpc_dict_block *block;
+	struct xpc_dict_pair *pair;
+
+	block = (struct xpc_dict_block *)xo;
+	if ((xo->xo_flags & _XPC_DICT_BLOCK) &&
+	    xo->xo_size < block->db_capacity)
+		pair = &block->db_pairs[xo->xo_size];
+	else
+		pair = malloc(sizeof(struct xpc_dict_pair));
+
+	xo->xo_size++;
+	pair->key = key;
+	pair->value = value;
+	pair->interned = interned;
+	TAILQ_INSERT_TAIL(&xo->xo_dict, pair, xo_link);
+	xpc_retain(value);
+}
+
+/*
+ * Appends a pair without looking for an existing one with the same key.
+ * The dictionary takes ownership of key.
+ */
+__private_extern__ void
+xpc_dictionary_append_pair(struct xpc_object *xo, char *key,
+    xpc_object_t value)
+{
+
+	xpc_dictionary_add_pair(xo, key, value, false);
+}
+
+/* As above, for a key from xpc_key_intern() that is never freed */
+__private_extern__ void
+xpc_dictionary_append_interned(struct xpc_object *xo, const char *key,
+    xpc_object_t value)
+{
+
+	xpc_dictionary_add_pair(xo, key, value, true);
+}
+
+/* Appends a pair with an interned key, or a copy if it cannot be interned */
+static void
+xpc_dictionary_append_key(struct xpc_object *xo, const char *key,
+    xpc_object_t value)
+{
+	const char *interned;
+
+	if ((interned = xpc_key_intern_string(key, strlen(key))) != NULL)
+		xpc_dictionary_append_interned(xo, interned, value);
+	else
+		xpc_dictionary_append_pair(xo, strdup(key), value);
+}
+
 xpc_object_t
 xpc_dictionary_create(const char * const *keys, const xpc_object_t *values,
     size_t count)
 {
 	struct xpc_object *xo;
 	size_t i;
-	xpc_u val;
 
-	xo = _xpc_prim_create(_XPC_TYPE_DICTIONARY, val, count);
-	
-	for (i = 0; i < count; i++)
-		xpc_dictionary_set_value(xo, keys[i], values[i]);
+	xo = xpc_dictionary_create_block(count);
 	
+	for (i = 0; i < count; i++) {
+		if (values[i] != NULL)
+			xpc_dictionary_set_value(xo, keys[i], values[i]);
+	}
+
 	return (xo);
 }
 
+xpc_dictionary_builder_t
+xpc_dictionary_builder_create(size_t capacity)
+{
+
+	return ((xpc_dictionary_builder_t)xpc_dictionary_create_block(
+	    capacity));
+}
+
+void
+xpc_dictionary_builder_append(xpc_dictionary_builder_t builder,
+    const char *key, xpc_object_t value)
+{
+
+	xpc_dictionary_append_key((struct xpc_object *)builder, key, value);
+}
+
+xpc_object_t
+xpc_dictionary_builder_finish(xpc_dictionary_builder_t builder)
+{
+
+	return ((xpc_object_t)builder);
+}
+
 xpc_object_t
 xpc_dictionary_create_reply(xpc_object_t original)
 {
-	struct xpc_object *xo_orig;
+	struct xpc_object *xo_orig, *xo;
 
 	xo_orig = original;
 	if ((xo_orig->xo_flags & _XPC_FROM_WIRE) == 0)
 		return (NULL);
 
-	return xpc_dictionary_create(NULL, NULL, 0);
+	if ((xo = xpc_dictionary_create(NULL, NULL, 0)) == NULL)
+		return (NULL);
+
+	/* Sent under the ID of the original, for the caller to match */
+	xo_orig->xo_flags &= ~_XPC_FROM_WIRE;
+	xo->xo_flags |= _XPC_REPLY;
+	xo->xo_id = xo_orig->xo_id;
+	return (xo);
 }
 
 #ifdef MACH
@@ -213,6 +701,7 @@ xpc_dictionary_set_mach_recv(xpc_object_t xdict, const char *key,
 	xotmp = _xpc_prim_create(_XPC_TYPE_ENDPOINT, val, 0);
 
 	xpc_dictionary_set_value(xdict, key, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -226,6 +715,7 @@ xpc_dictionary_set_mach_send(xpc_object_t xdict, const char *key,
 	xotmp = _xpc_prim_create(_XPC_TYPE_ENDPOINT, val, 0);
 
 	xpc_dictionary_set_value(xdict, key, xotmp);
+	xpc_release(xotmp);
 }
 
 mach_port_t
@@ -248,19 +738,21 @@ xpc_dictionary_set_value(xpc_object_t xdict, const char *key,
 	xo = xdict;
 	head = &xo->xo_dict;
 
+	if (xo->xo_xpc_type == _XPC_TYPE_PDICTIONARY) {
+		debugf("persistent dictionary %p is immutable", xdict);
+		return;
+	}
+
 	TAILQ_FOREACH(pair, head, xo_link) {
 		if (!strcmp(pair->key, key)) {
+			xpc_retain(value);
+			xpc_release(pair->value);
 			pair->value = value;
 			return;
 		}
 	}
 
-	xo->xo_size++;
-	pair = malloc(sizeof(struct xpc_dict_pair));
-	pair->key = key;
-	pair->value = value;
-	TAILQ_INSERT_TAIL(&xo->xo_dict, pair, xo_link);
-	xpc_retain(value);
+	xpc_dictionary_append_key(xo, key, value);
 }
 
 xpc_object_t
@@ -273,6 +765,9 @@ xpc_dictionary_get_value(xpc_object_t xdict, const char *key)
 	xo = xdict;
 	head = &xo->xo_dict;
 
+	if (xo->xo_xpc_type == _XPC_TYPE_PDICTIONARY)
+		return (xpc_hamt_lookup(xo->xo_hamt, key));
+
 	TAILQ_FOREACH(pair, head, xo_link) {
 		if (!strcmp(pair->key, key))
 			return (pair->value);
@@ -298,6 +793,7 @@ xpc_dictionary_set_bool(xpc_object_t xdict, const char *key, bool value)
 	xo = xdict;
 	xotmp = xpc_bool_create(value);
 	xpc_dictionary_set_value(xdict, key, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -308,6 +804,7 @@ xpc_dictionary_set_int64(xpc_object_t xdict, const char *key, int64_t value)
 	xo = xdict;
 	xotmp = xpc_int64_create(value);
 	xpc_dictionary_set_value(xdict, key, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -317,7 +814,8 @@ xpc_dictionary_set_uint64(xpc_object_t xdict, const char *key, uint64_t value)
 
 	xo = xdict;
 	xotmp = xpc_uint64_create(value);
-	xpc_dictionary_set_value(xdict, key, xotmp); 
+	xpc_dictionary_set_value(xdict, key, xotmp);
+	xpc_release(xotmp);
 }
 
 void
@@ -329,6 +827,7 @@ xpc_dictionary_set_string(xpc_object_t xdict, const char *key,
 	xo = xdict;
 	xotmp = xpc_string_create(value);
 	xpc_dictionary_set_value(xdict, key, xotmp);
+	xpc_release(xotmp);
 }
 
 bool
@@ -377,6 +876,9 @@ xpc_dictionary_apply(xpc_object_t xdict, xpc_dictionary_applier_t applier)
 	xo = xdict;
 	head = &xo->xo_dict;
 
+	if (xo->xo_xpc_type == _XPC_TYPE_PDICTIONARY)
+		return (xpc_hamt_apply(xo->xo_hamt, applier));
+
 	TAILQ_FOREACH(pair, head, xo_link) {
 		if (!applier(pair->key, pair->value))
 			return (false);
@@ -384,3 +886,23 @@ xpc_dictionary_apply(xpc_object_t xdict, xpc_dictionary_applier_t applier)
 
 	return (true);
 }
+
+bool
+xpc_dictionary_apply_f(xpc_object_t xdict,
+    xpc_dictionary_applier_func_t applier, void *context)
+{
+	xpc_iterator_t iter;
+	bool ret;
+
+	ret = true;
+	xpc_iterator_begin(&iter, xdict);
+	while (xpc_iterator_next(&iter)) {
+		if (!applier(iter.key, iter.value, context)) {
+			ret = false;
+			break;
+		}
+	}
+
+	xpc_iterator_end(&iter);
+	return (ret);
+}
@@ -30,6 +30,7 @@
 
 #include <sys/queue.h>
 #include <sys/uio.h>
+#include <pthread.h>
 #include <dispatch/dispatch.h>
 #include "mpack.h"
 
@@ -61,13 +62,91 @@
 #define _XPC_TYPE_SHMEM			15
 #define _XPC_TYPE_ERROR			16
 #define _XPC_TYPE_DOUBLE		17
-#define _XPC_TYPE_MAX			_XPC_TYPE_DOUBLE
+#define _XPC_TYPE_PDICTIONARY		18
+#define _XPC_TYPE_TYPED_ARRAY		19
+#define _XPC_TYPE_MAX			_XPC_TYPE_TYPED_ARRAY
 
 #define	XPC_SEQID		"XPC sequence number"
+
+/* msgpack extension types; typed arrays use base + element type */
+#define	XPC_EXT_TYPED_ARRAY	0x10
 #define	XPC_PROTOCOL_VERSION	1
 
+/*
+ * Version 2 frames start with a magic byte and a flags byte, followed by
+ * the id, body length and, with XPC_FRAME_METHOD, the method ID as
+ * LEB128 varints. The magic byte tells them apart from version 1 headers,
+ * whose first byte is that of a uint64_t 1 in either byte order.
+ */
+#define	XPC_FRAME_V2_MAGIC	0xc2
+#define	XPC_FRAME_HELLO		0x01	/* body is a varint of feature bits */
+#define	XPC_FRAME_METHOD	0x02
+#define	XPC_FRAME_KEYS		0x04	/* body starts with key definitions */
+#define	XPC_FRAME_COMPRESSED	0x08
+#define	XPC_FRAME_BATCH		0x10	/* body is a run of whole frames */
+
+/*
+ * Hello frames carry our feature bits and, optionally, the ID of the zstd
+ * dictionary we have loaded, both as varints.
+ */
+#define	XPC_FEATURE_FRAME_V2	0x0001
+#define	XPC_FEATURE_KEY_TABLE	0x0002
+#define	XPC_FEATURE_LZ4		0x0004
+#define	XPC_FEATURE_ZSTD	0x0008
+#define	XPC_FEATURE_BATCH	0x0010
+
+#ifdef HAVE_LZ4
+#define	_XPC_FEATURES_LZ4	XPC_FEATURE_LZ4
+#else
+#define	_XPC_FEATURES_LZ4	0
+#endif
+#ifdef HAVE_ZSTD
+#define	_XPC_FEATURES_ZSTD	XPC_FEATURE_ZSTD
+#else
+#define	_XPC_FEATURES_ZSTD	0
+#endif
+#define	XPC_FEATURES_SUPPORTED	(XPC_FEATURE_FRAME_V2 |			\
+    XPC_FEATURE_KEY_TABLE | _XPC_FEATURES_LZ4 | _XPC_FEATURES_ZSTD |	\
+    XPC_FEATURE_BATCH)
+
+/*
+ * A batch frame carries several messages, each as the frame it would
+ * have been sent as on its own, back to back. Those frames are neither
+ * hello nor batch frames; the batch frame itself has no ID and is never
+ * compressed. Each message keeps its place in the connection's order,
+ * key definitions included.
+ */
+
+/*
+ * The body of a compressed frame is a codec byte (XPC_COMPRESSION_*), the
+ * inflated length as a varint, and the compressed bytes. The inflated body
+ * is what an uncompressed frame would carry, key definitions included.
+ */
+#define	XPC_INFLATED_MAX	(16 * 1024 * 1024)
+
+/*
+ * Key tables replace dictionary keys a sender has used before with small
+ * integers. A frame flagged XPC_FRAME_KEYS starts with the keys it
+ * defines, as a varint count followed by a varint length and the bytes
+ * of each key; they take the next IDs in order. Map keys in the body are
+ * then either strings or IDs. Each direction numbers its keys separately.
+ */
+#define	XPC_KEY_TABLE_MAX	4096
+#define	XPC_KEY_MAX_LENGTH	128
+
+/*
+ * Strings and data of XPC_GATHER_MIN bytes or more are not copied into
+ * an outgoing frame: the encoding leaves a hole after their header and
+ * the transport sends them from the object itself. Only the first
+ * XPC_GATHER_MAX leaves of a message are sent that way, which keeps
+ * the iovec list well within IOV_MAX.
+ */
+#define	XPC_GATHER_MIN		16384
+#define	XPC_GATHER_MAX		64
+
 struct xpc_object;
 struct xpc_dict_pair;
+struct xpc_hamt_node;
 struct xpc_resource;
 struct xpc_credentials;
 
@@ -81,16 +160,24 @@ typedef int (*xpc_transport_lookup)(const char *, xpc_port_t *, xpc_port_t *);
 typedef char *(*xpc_transport_port_to_string)(xpc_port_t);
 typedef int (*xpc_transport_port_compare)(xpc_port_t, xpc_port_t);
 typedef int (*xpc_transport_release)(xpc_port_t);
-typedef int (*xpc_transport_send)(xpc_port_t, xpc_port_t, void *buf,
-    size_t len, struct xpc_resource *, size_t);
+typedef int (*xpc_transport_send)(xpc_port_t, xpc_port_t,
+    const struct iovec *iov, int iovcnt, struct xpc_resource *, size_t);
 typedef int(*xpc_transport_recv)(xpc_port_t, xpc_port_t*, void *buf,
     size_t len, struct xpc_resource **, size_t *, struct xpc_credentials *);
 typedef dispatch_source_t (*xpc_transport_create_source)(xpc_port_t,
     void *, dispatch_queue_t);
 
+struct xpc_typed_array {
+	void *			ta_data;
+	uint32_t		ta_capacity;
+	uint8_t			ta_type;
+};
+
 typedef union {
 	struct xpc_dict_head dict;
 	struct xpc_array_head array;
+	struct xpc_hamt_node *hamt;
+	struct xpc_typed_array typed;
 	uint64_t ui;
 	int64_t i;
 	char *str;
@@ -104,20 +191,55 @@ typedef union {
 #endif
 } xpc_u;
 
+/* Version 1 frame header */
 struct xpc_frame_header {
     uint64_t version;
     uint64_t id;
     uint64_t length;
-    uint64_t spare[4];
+    uint64_t method;	/* xpc_router_get_method_id(), or 0 */
+    uint64_t spare[3];
+};
+
+/* Decoded header of a frame of either version */
+struct xpc_frame {
+	uint64_t	xf_id;
+	uint32_t	xf_method;
+	uint32_t	xf_flags;
+	uint64_t	xf_features;	/* hello frames only */
+	uint32_t	xf_dict;	/* hello frames only */
+	const uint8_t *	xf_body;
+	uint64_t	xf_length;
+};
+
+struct xpc_gather {
+	size_t			xg_count;
+	struct {
+		size_t		gr_offset;	/* of the hole in the encoding */
+		const void *	gr_base;
+		size_t		gr_length;
+	} xg_refs[XPC_GATHER_MAX];
+};
+
+/* A frame ready to send: a header and body segments, in xk_iov order */
+struct xpc_packet {
+	uint8_t			xk_header[sizeof(struct xpc_frame_header)];
+	char *			xk_defs;
+	char *			xk_body;
+	struct iovec		xk_iov[3 + 2 * XPC_GATHER_MAX];
+	int			xk_iovcnt;
 };
 
 #define _XPC_FROM_WIRE 0x1
+#define _XPC_DICT_BLOCK 0x2
+#define _XPC_REPLY 0x4
 struct xpc_object {
 	uint8_t			xo_xpc_type;
 	uint16_t		xo_flags;
 	volatile uint32_t	xo_refcnt;
 	size_t			xo_size;
+	size_t			xo_hash;
 	xpc_u			xo_u;
+	uint64_t		xo_id;		/* frame ID; of the call if a reply */
 #ifdef MACH
 	audit_token_t *		xo_audit_token;
 #endif
@@ -127,9 +249,116 @@ struct xpc_object {
 struct xpc_dict_pair {
 	const char *		key;
 	struct xpc_object *	value;
+	bool			interned;	/* key is not ours to free */
 	TAILQ_ENTRY(xpc_dict_pair) xo_link;
 };
 
+/*
+ * A dictionary created with room for a known number of entries
+ * (_XPC_DICT_BLOCK) carries its first db_capacity pairs in the same
+ * allocation as the object. Pairs added beyond that are malloc'ed.
+ */
+struct xpc_dict_block {
+	struct xpc_object	db_object;
+	size_t			db_capacity;
+	struct xpc_dict_pair	db_pairs[];
+};
+
+#define	XPC_DICT_PAIR_INLINE(xo, pair)					\
+	(((xo)->xo_flags & _XPC_DICT_BLOCK) != 0 &&			\
+	    (pair) >= ((struct xpc_dict_block *)(xo))->db_pairs &&		\
+	    (pair) < ((struct xpc_dict_block *)(xo))->db_pairs +		\
+	    ((struct xpc_dict_block *)(xo))->db_capacity)
+
+/*
+ * Persistent dictionaries are hash array mapped tries. Nodes and leaves
+ * are immutable once published and shared between versions, so both
+ * are reference counted. A node whose hash bits are exhausted becomes
+ * a collision node: no bitmap, just a flat list of leaves.
+ */
+#define	XPC_HAMT_BITS		5
+#define	XPC_HAMT_MASK		((1 << XPC_HAMT_BITS) - 1)
+#define	XPC_HAMT_HASH_BITS	32
+#define	XPC_HAMT_MAX_DEPTH	\
+    ((XPC_HAMT_HASH_BITS + XPC_HAMT_BITS - 1) / XPC_HAMT_BITS + 1)
+#define	XPC_HAMT_COLLISION	0x1
+
+struct xpc_hamt_leaf {
+	volatile uint32_t	hl_refcnt;
+	uint32_t		hl_hash;
+	struct xpc_object *	hl_value;
+	char			hl_key[];
+};
+
+struct xpc_hamt_slot {
+	bool			hs_is_node;
+	union {
+		struct xpc_hamt_leaf *	hs_leaf;
+		struct xpc_hamt_node *	hs_node;
+	};
+};
+
+struct xpc_hamt_node {
+	volatile uint32_t	hn_refcnt;
+	uint32_t		hn_bitmap;
+	uint16_t		hn_count;
+	uint16_t		hn_flags;
+	struct xpc_hamt_slot	hn_slots[];
+};
+
+struct xpc_key {
+	const char *		xk_key;
+	uint32_t		xk_length;
+	uint32_t		xk_hash;
+	bool			xk_interned;	/* from xpc_key_intern() */
+};
+
+struct xpc_key_table {
+	/* Sending side, only used on the send queue */
+	struct xpc_key *	kt_out;
+	uint32_t		kt_nout;
+	uint32_t		kt_sent;	/* IDs the peer already knows */
+	uint32_t *		kt_slots;	/* ID + 1 by hash, 0 if free */
+	uint32_t		kt_nslots;
+	/* Receiving side, only used on the receive queue */
+	struct xpc_key *	kt_in;
+	uint32_t		kt_nin;
+};
+
+struct xpc_compression {
+	int			xz_codec;
+	size_t			xz_threshold;
+	struct xpc_zdict *	xz_dict;
+	volatile uint32_t	xz_peer_dict;	/* dictionary the peer has */
+	void *			xz_cctx;	/* only used on the send queue */
+	void *			xz_dctx;	/* only used on the receive queue */
+};
+
+/*
+ * A message packed once for many connections. It is immutable; each
+ * send frames the body with the id and features of its connection.
+ */
+struct xpc_encoded {
+	volatile u_int		xe_refcnt;
+	size_t			xe_length;
+	char *			xe_body;
+	uint32_t		xe_method;	/* of a message received raw */
+};
+
+/*
+ * Messages waiting to go out in one batch frame, on the send queue.
+ * Batching is off while xb_latency is 0. Each flush bumps xb_generation,
+ * which tells a flush timer whether its batch has already gone.
+ */
+struct xpc_batch {
+	char *			xb_buffer;
+	size_t			xb_length;
+	size_t			xb_count;
+	size_t			xb_max;
+	uint64_t		xb_latency;	/* in nanoseconds */
+	uint64_t		xb_generation;
+};
+
 struct xpc_pending_call {
 	uint64_t		xp_id;
 	xpc_object_t		xp_response;
@@ -138,6 +367,18 @@ struct xpc_pending_call {
 	TAILQ_ENTRY(xpc_pending_call) xp_link;
 };
 
+/*
+ * A thread blocked in xpc_connection_send_message_with_reply_sync(). Each
+ * thread has one, kept from call to call; the receive queue hands it the
+ * reply and signals it directly.
+ */
+struct xpc_waiter {
+	uint64_t		xw_id;
+	xpc_object_t		xw_result;
+	dispatch_semaphore_t	xw_sem;
+	TAILQ_ENTRY(xpc_waiter)	xw_link;
+};
+
 struct xpc_credentials {
     uid_t			xc_remote_euid;
     gid_t			xc_remote_guid;
@@ -148,6 +389,39 @@ struct xpc_credentials {
 #endif
 };
 
+/*
+ * Receive-side buffers a connection keeps from one message to the
+ * next: the receive buffer, the inflated body of a compressed frame,
+ * and the node pool mpack parses into. Only used on the receive queue.
+ *
+ * On stream transports the receive buffer holds the bytes read but not
+ * yet consumed, xd_start to xd_end, which may be any number of frames
+ * and a partial one. It is grown to fit a frame larger than itself and
+ * shrunk back once such a frame has been consumed. Credentials are
+ * those of the last read.
+ *
+ * A batch frame stays in the receive buffer while its messages are
+ * handed out; nothing is read until it is done.
+ */
+#define	XPC_DECODER_NODES	256
+#define	XPC_DECODER_NODES_MAX	65536
+#define	XPC_STREAM_FRAME_MAX	(256 * 1024 * 1024)
+
+struct xpc_decoder {
+	void *			xd_buffer;
+	size_t			xd_size;
+	size_t			xd_start;
+	size_t			xd_end;
+	struct xpc_credentials	xd_creds;
+	const uint8_t *		xd_batch;	/* frames left in a batch */
+	const uint8_t *		xd_batch_end;
+	xpc_port_t		xd_remote;	/* of the batch */
+	void *			xd_inflated;	/* reused by compressed frames */
+	size_t			xd_inflated_size;
+	mpack_node_data_t *	xd_nodes;
+	size_t			xd_nnodes;
+};
+
 struct xpc_connection {
 	const char *		xc_name;
 	xpc_port_t		xc_local_port;
@@ -163,8 +437,24 @@ struct xpc_connection {
 	volatile uint64_t	xc_last_id;
 	void *			xc_context;
 	struct xpc_connection * xc_parent;
+	struct xpc_schema *	xc_schema;
+	struct xpc_router *	xc_router;
+	xpc_frame_handler_t	xc_frame_handler;
+	volatile uint64_t	xc_features;	/* agreed on with the peer */
+	bool			xc_hello_sent;
+	bool			xc_inline;	/* handlers run on xc_recv_queue */
+	uint32_t		xc_concurrency;
+	uint32_t		xc_running;	/* unordered handlers */
+	uint32_t		xc_throttles;	/* holds on xc_recv_source */
+	bool			xc_throttled;	/* holds its source's reads */
+	struct xpc_key_table	xc_keys;
+	struct xpc_compression	xc_compression;
+	struct xpc_decoder	xc_decoder;
+	struct xpc_batch	xc_batch;
     	struct xpc_credentials	xc_creds;
+	pthread_mutex_t		xc_calls_lock;	/* xc_pending, xc_waiters */
 	TAILQ_HEAD(, xpc_pending_call) xc_pending;
+	TAILQ_HEAD(, xpc_waiter) xc_waiters;
 	TAILQ_HEAD(, xpc_connection) xc_peers;
 	TAILQ_ENTRY(xpc_connection) xc_link;
 };
@@ -191,6 +481,7 @@ struct xpc_transport {
     	xpc_transport_recv	xt_recv;
     	xpc_transport_create_source xt_create_server_source;
     	xpc_transport_create_source xt_create_client_source;
+    	bool			xt_stream;	/* xt_recv reads bytes, not frames */
 };
 
 struct xpc_service {
@@ -209,6 +500,8 @@ struct xpc_service {
 #define xo_port xo_u.port
 #define xo_array xo_u.array
 #define xo_dict xo_u.dict
+#define xo_hamt xo_u.hamt
+#define xo_typed xo_u.typed
 
 __private_extern__ struct xpc_transport *xpc_get_transport();
 __private_extern__ void xpc_set_transport(struct xpc_transport *);
@@ -216,18 +509,103 @@ __private_extern__ struct xpc_object *_xpc_prim_create(int type, xpc_u value,
     size_t size);
 __private_extern__ struct xpc_object *_xpc_prim_create_flags(int type,
     xpc_u value, size_t size, uint16_t flags);
+__private_extern__ void _xpc_prim_init(struct xpc_object *xo, int type,
+    xpc_u value, size_t size, uint16_t flags);
+__private_extern__ struct xpc_object *xpc_dictionary_create_block(
+    size_t capacity);
+__private_extern__ void xpc_dictionary_append_pair(struct xpc_object *xo,
+    char *key, xpc_object_t value);
+__private_extern__ void xpc_dictionary_append_interned(struct xpc_object *xo,
+    const char *key, xpc_object_t value);
 __private_extern__ const char *_xpc_get_type_name(xpc_object_t obj);
-__private_extern__ struct xpc_object *mpack2xpc(mpack_node_t node);
-__private_extern__ void xpc2mpack(mpack_writer_t *writer, xpc_object_t xo);
+__private_extern__ uint64_t xpc_hash_bytes(const void *data, size_t length,
+    uint64_t seed);
+__private_extern__ size_t xpc_varint_encode(uint8_t *p, uint64_t value);
+__private_extern__ int xpc_varint_decode(const uint8_t **p,
+    const uint8_t *end, uint64_t *value);
+__private_extern__ struct xpc_object *mpack2xpc(mpack_node_t node,
+    const struct xpc_key_table *keys);
+__private_extern__ void xpc2mpack(mpack_writer_t *writer, xpc_object_t xo,
+    struct xpc_key_table *keys, struct xpc_gather *gather);
+__private_extern__ size_t xpc2mpack_size(xpc_object_t xo, size_t *gathered);
+__private_extern__ const char *xpc_key_intern(const char *key, size_t length,
+    uint32_t hash);
+__private_extern__ const char *xpc_key_intern_string(const char *key,
+    size_t length);
+__private_extern__ void xpc_keys_write(struct xpc_key_table *kt,
+    mpack_writer_t *writer, const char *key);
+__private_extern__ size_t xpc_keys_pending(const struct xpc_key_table *kt,
+    uint8_t *buf);
+__private_extern__ void xpc_keys_commit(struct xpc_key_table *kt, bool sent);
+__private_extern__ void xpc_keys_destroy(struct xpc_key_table *kt);
+__private_extern__ int xpc_keys_learn(struct xpc_key_table *kt,
+    const uint8_t **p, const uint8_t *end);
+__private_extern__ const struct xpc_key *xpc_keys_get(
+    const struct xpc_key_table *kt, mpack_node_t node);
 __private_extern__ void xpc_object_destroy(struct xpc_object *xo);
+__private_extern__ xpc_object_t xpc_hamt_lookup(struct xpc_hamt_node *root,
+    const char *key);
+__private_extern__ xpc_object_t xpc_hamt_lookup_hash(
+    struct xpc_hamt_node *root, const char *key, uint32_t hash);
+__private_extern__ uint32_t xpc_hamt_hash(const char *key);
+__private_extern__ bool xpc_hamt_apply(struct xpc_hamt_node *root,
+    xpc_dictionary_applier_t applier);
+__private_extern__ void xpc_hamt_release(struct xpc_hamt_node *node);
+__private_extern__ size_t xpc_typed_array_element_size(int type);
+__private_extern__ int xpc_typed_array_load(struct xpc_object *xo,
+    size_t index, xpc_u *val);
+__private_extern__ xpc_object_t xpc_typed_array_box(struct xpc_object *xo,
+    size_t index);
+__private_extern__ void xpc_typed_array_swab(void *dst, const void *src,
+    size_t count, int type);
+__private_extern__ uint64_t xpc_hash_scalar(int type, xpc_u value);
 __private_extern__ void xpc_connection_recv_message(void *);
 __private_extern__ void xpc_connection_recv_mach_message(void *);
 __private_extern__ void *xpc_connection_new_peer(void *context,
     xpc_port_t local, xpc_port_t remote, dispatch_source_t src);
 __private_extern__ void xpc_connection_destroy_peer(void *context);
-__private_extern__ int xpc_pipe_send(xpc_object_t obj, uint64_t id,
+__private_extern__ void xpc_connection_deliver_message(
+    struct xpc_connection *conn, dispatch_block_t block);
+__private_extern__ bool xpc_compression_enabled(
+    const struct xpc_compression *xz, uint64_t features);
+__private_extern__ int xpc_compress(struct xpc_compression *xz,
+    uint64_t features, const void *src, size_t length, void **buf,
+    size_t *size);
+__private_extern__ int xpc_decompress(struct xpc_compression *xz,
+    const uint8_t *src, size_t length, void **buf, size_t *capacity,
+    size_t *size);
+__private_extern__ void xpc_compression_inherit(struct xpc_compression *xz,
+    const struct xpc_compression *parent);
+__private_extern__ uint32_t xpc_compression_dict_id(
+    const struct xpc_compression *xz);
+__private_extern__ int xpc_pipe_send(xpc_object_t obj,
+    const struct xpc_frame *frame, uint64_t features,
+    struct xpc_key_table *keys, struct xpc_compression *xz,
+    struct xpc_batch *batch, xpc_port_t local, xpc_port_t remote);
+__private_extern__ int xpc_pipe_flush(struct xpc_batch *batch,
+    uint64_t features, xpc_port_t local, xpc_port_t remote);
+__private_extern__ int xpc_pipe_send_hello(uint64_t features, uint32_t dict,
+    xpc_port_t local, xpc_port_t remote);
+__private_extern__ size_t xpc_frame_header(const struct xpc_frame *frame,
+    uint64_t features, size_t length, uint8_t *hdr);
+__private_extern__ int xpc_pipe_frame(const struct xpc_frame *frame,
+    uint64_t features, const void *body, size_t length, void **buf,
+    size_t *size);
+__private_extern__ int xpc_pipe_send_frame(void *buf, size_t size,
+    xpc_port_t local, xpc_port_t remote);
+__private_extern__ int xpc_pipe_sendv(const struct iovec *iov, int iovcnt,
     xpc_port_t local, xpc_port_t remote);
 __private_extern__ int xpc_pipe_receive(xpc_port_t local, xpc_port_t *remote,
-    xpc_object_t *result, uint64_t *id, struct xpc_credentials *creds);
+    struct xpc_frame *frame, struct xpc_credentials *creds,
+    struct xpc_compression *xz, struct xpc_decoder *dec);
+__private_extern__ bool xpc_pipe_pending(const struct xpc_decoder *dec);
+__private_extern__ xpc_object_t xpc_pipe_decode(const struct xpc_frame *frame,
+    struct xpc_schema *schema, struct xpc_key_table *keys,
+    struct xpc_decoder *dec);
+__private_extern__ void xpc_decoder_destroy(struct xpc_decoder *dec);
+__private_extern__ bool xpc_router_dispatch(struct xpc_router *router,
+    struct xpc_connection *conn, xpc_object_t message, uint32_t id);
+__private_extern__ bool xpc_schema_check_tree(struct xpc_schema *schema,
+    mpack_node_t root, const struct xpc_key_table *keys);
 
 #endif	/* _LIBXPC_XPC_INTERNAL_H */
\ No newline at end of file
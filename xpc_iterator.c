@@ -0,0 +1,162 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+
+#if XPC_HAMT_MAX_DEPTH > _XPC_ITERATOR_DEPTH
+#error "xpc_iterator_t cannot hold a full HAMT path"
+#endif
+
+/*
+ * Steps a HAMT walk to the next leaf. The cursor keeps the same explicit
+ * stack xpc_hamt_apply() uses, so it visits leaves in the same order.
+ */
+static struct xpc_hamt_leaf *
+xpc_iterator_next_leaf(xpc_iterator_t *iter)
+{
+	struct xpc_hamt_node *node;
+	struct xpc_hamt_slot *slot;
+
+	while (iter->_xi_depth >= 0) {
+		node = iter->_xi_nodes[iter->_xi_depth];
+		if (iter->_xi_slots[iter->_xi_depth] == node->hn_count) {
+			iter->_xi_depth--;
+			continue;
+		}
+
+		slot = &node->hn_slots[iter->_xi_slots[iter->_xi_depth]++];
+		if (slot->hs_is_node) {
+			iter->_xi_depth++;
+			iter->_xi_nodes[iter->_xi_depth] = slot->hs_node;
+			iter->_xi_slots[iter->_xi_depth] = 0;
+			continue;
+		}
+
+		return (slot->hs_leaf);
+	}
+
+	return (NULL);
+}
+
+void
+xpc_iterator_begin(xpc_iterator_t *iter, xpc_object_t container)
+{
+	struct xpc_object *xo;
+
+	xo = container;
+	memset(iter, 0, sizeof(*iter));
+	iter->_xi_container = container;
+	iter->_xi_depth = -1;
+	iter->index = (size_t)-1;
+
+	switch (xo->xo_xpc_type) {
+	case _XPC_TYPE_DICTIONARY:
+		iter->_xi_cursor = TAILQ_FIRST(&xo->xo_dict);
+		break;
+
+	case _XPC_TYPE_ARRAY:
+		iter->_xi_cursor = TAILQ_FIRST(&xo->xo_array);
+		break;
+
+	case _XPC_TYPE_PDICTIONARY:
+		if (xo->xo_hamt != NULL) {
+			iter->_xi_nodes[0] = xo->xo_hamt;
+			iter->_xi_depth = 0;
+		}
+		break;
+	}
+}
+
+bool
+xpc_iterator_next(xpc_iterator_t *iter)
+{
+	struct xpc_object *xo, *xotmp;
+	struct xpc_dict_pair *pair;
+	struct xpc_hamt_leaf *leaf;
+
+	xo = iter->_xi_container;
+	if (xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY && iter->value != NULL)
+		xpc_release(iter->value);
+
+	iter->key = NULL;
+	iter->value = NULL;
+	iter->index++;
+
+	switch (xo->xo_xpc_type) {
+	case _XPC_TYPE_DICTIONARY:
+		if ((pair = iter->_xi_cursor) == NULL)
+			return (false);
+
+		iter->key = pair->key;
+		iter->value = pair->value;
+		iter->_xi_cursor = TAILQ_NEXT(pair, xo_link);
+		return (true);
+
+	case _XPC_TYPE_ARRAY:
+		if ((xotmp = iter->_xi_cursor) == NULL)
+			return (false);
+
+		iter->value = xotmp;
+		iter->_xi_cursor = TAILQ_NEXT(xotmp, xo_link);
+		return (true);
+
+	case _XPC_TYPE_TYPED_ARRAY:
+		if (iter->index >= xo->xo_size)
+			return (false);
+
+		iter->value = xpc_typed_array_box(xo, iter->index);
+		return (true);
+
+	case _XPC_TYPE_PDICTIONARY:
+		if ((leaf = xpc_iterator_next_leaf(iter)) == NULL)
+			return (false);
+
+		iter->key = leaf->hl_key;
+		iter->value = leaf->hl_value;
+		return (true);
+	}
+
+	return (false);
+}
+
+void
+xpc_iterator_end(xpc_iterator_t *iter)
+{
+	struct xpc_object *xo;
+
+	xo = iter->_xi_container;
+	if (xo != NULL && xo->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY &&
+	    iter->value != NULL)
+		xpc_release(iter->value);
+
+	iter->key = NULL;
+	iter->value = NULL;
+	iter->_xi_container = NULL;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <machine/atomic.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+
+#define	XPC_KEYPATH_MAX_NODES	256
+#define	XPC_KEYPATH_TOP		UINT32_MAX
+
+/*
+ * A compiled set of key paths is a trie flattened into an array: every
+ * node names one step (a dictionary key or an array index) from its
+ * parent, and parents always precede their children. Evaluating the set
+ * is a single pass over the array, so shared prefixes are resolved once.
+ */
+struct xpc_keypath_node {
+	const char *		kn_key;		/* NULL for an array index */
+	size_t			kn_index;
+	uint32_t		kn_parent;
+	uint32_t		kn_hash;	/* HAMT hash of kn_key */
+	bool			kn_interned;	/* from xpc_key_intern() */
+	volatile u_int		kn_hint;	/* last position of kn_key */
+};
+
+struct xpc_keypath {
+	size_t			kp_npaths;
+	size_t			kp_nnodes;
+	size_t			kp_maxnodes;
+	uint32_t *		kp_results;	/* node index for each path */
+	char *			kp_keys;	/* keys the pool had no room for */
+	struct xpc_keypath_node	kp_nodes[];
+};
+
+/*
+ * Finds or adds the child of parent named by the given step. Keys come
+ * from the process-wide pool that key tables intern into, so they can be
+ * matched by address against keys of decoded dictionaries; when the pool
+ * is full they are copied into kp_keys instead.
+ */
+static int
+xpc_keypath_add_node(struct xpc_keypath *kp, uint32_t parent, const char *key,
+    size_t keylen, size_t index, char **keyp)
+{
+	struct xpc_keypath_node *kn;
+	size_t i;
+
+	for (i = 0; i < kp->kp_nnodes; i++) {
+		kn = &kp->kp_nodes[i];
+		if (kn->kn_parent != parent)
+			continue;
+
+		if (key == NULL && kn->kn_key == NULL && kn->kn_index == index)
+			return (i);
+
+		if (key != NULL && kn->kn_key != NULL &&
+		    strncmp(kn->kn_key, key, keylen) == 0 &&
+		    kn->kn_key[keylen] == '\0')
+			return (i);
+	}
+
+	if (kp->kp_nnodes == kp->kp_maxnodes)
+		return (-1);
+
+	kn = &kp->kp_nodes[kp->kp_nnodes];
+	kn->kn_parent = parent;
+	kn->kn_index = index;
+	kn->kn_hint = 0;
+	kn->kn_key = NULL;
+	kn->kn_interned = false;
+
+	if (key != NULL) {
+		kn->kn_key = xpc_key_intern(key, keylen,
+		    (uint32_t)xpc_hash_bytes(key, keylen, 0));
+		if (kn->kn_key != NULL)
+			kn->kn_interned = true;
+		else {
+			memcpy(*keyp, key, keylen);
+			(*keyp)[keylen] = '\0';
+			kn->kn_key = *keyp;
+			*keyp += keylen + 1;
+		}
+
+		kn->kn_hash = xpc_hamt_hash(kn->kn_key);
+	}
+
+	return (kp->kp_nnodes++);
+}
+
+static int
+xpc_keypath_parse(struct xpc_keypath *kp, const char *path, char **keyp)
+{
+	const char *p, *end;
+	uint32_t node;
+	size_t index;
+	char *endp;
+	int ret;
+
+	node = XPC_KEYPATH_TOP;
+	p = path;
+
+	for (;;) {
+		if (*p == '[') {
+			if (p[1] < '0' || p[1] > '9')
+				return (-1);
+
+			errno = 0;
+			index = strtoul(p + 1, &endp, 10);
+			if (errno != 0 || *endp != ']')
+				return (-1);
+
+			ret = xpc_keypath_add_node(kp, node, NULL, 0, index,
+			    keyp);
+			p = endp + 1;
+		} else {
+			end = p + strcspn(p, ".[");
+			if (end == p)
+				return (-1);
+
+			ret = xpc_keypath_add_node(kp, node, p, end - p, 0,
+			    keyp);
+			p = end;
+		}
+
+		if (ret < 0)
+			return (-1);
+
+		node = ret;
+		if (*p == '\0')
+			return (node);
+
+		if (*p == '.')
+			p++;
+	}
+}
+
+xpc_keypath_t
+xpc_keypath_create_multiple(const char * const *paths, size_t count)
+{
+	struct xpc_keypath *kp;
+	size_t i, len, maxnodes;
+	char *keyp;
+	int node;
+
+	/* Every step takes at least one character */
+	len = 0;
+	for (i = 0; i < count; i++)
+		len += strlen(paths[i]) + 1;
+
+	maxnodes = len < XPC_KEYPATH_MAX_NODES ? len : XPC_KEYPATH_MAX_NODES;
+	kp = malloc(sizeof(*kp) + maxnodes * sizeof(kp->kp_nodes[0]));
+	if (kp == NULL)
+		return (NULL);
+
+	kp->kp_npaths = count;
+	kp->kp_nnodes = 0;
+	kp->kp_maxnodes = maxnodes;
+	kp->kp_results = malloc(count * sizeof(*kp->kp_results));
+	kp->kp_keys = keyp = malloc(len);
+	if (kp->kp_results == NULL || kp->kp_keys == NULL)
+		goto fail;
+
+	for (i = 0; i < count; i++) {
+		if ((node = xpc_keypath_parse(kp, paths[i], &keyp)) < 0) {
+			debugf("invalid key path \"%s\"", paths[i]);
+			goto fail;
+		}
+
+		kp->kp_results[i] = node;
+	}
+
+	return (kp);
+
+fail:
+	xpc_keypath_free(kp);
+	return (NULL);
+}
+
+xpc_keypath_t
+xpc_keypath_create(const char *path)
+{
+
+	return (xpc_keypath_create_multiple(&path, 1));
+}
+
+void
+xpc_keypath_free(xpc_keypath_t kp)
+{
+
+	free(kp->kp_results);
+	free(kp->kp_keys);
+	free(kp);
+}
+
+/*
+ * Interned keys are unique per string, so two of them match only if they
+ * are the same pointer. Long keys, and any added once the intern pool is
+ * full, are private copies and still need a string compare.
+ */
+static inline bool
+xpc_keypath_match(struct xpc_dict_pair *pair, struct xpc_keypath_node *kn)
+{
+
+	if (pair->interned && kn->kn_interned)
+		return (pair->key == kn->kn_key);
+
+	return (strcmp(pair->key, kn->kn_key) == 0);
+}
+
+/*
+ * Looks up one step. Messages handled by the same code tend to have the
+ * same shape, so the position a key was last found at is tried first;
+ * in dictionaries decoded from the wire that is a direct array access.
+ */
+static struct xpc_object *
+xpc_keypath_step(struct xpc_object *xo, struct xpc_keypath_node *kn)
+{
+	struct xpc_dict_block *block;
+	struct xpc_dict_pair *pair;
+	u_int hint, i;
+
+	switch (xo->xo_xpc_type) {
+	case _XPC_TYPE_DICTIONARY:
+		if (kn->kn_key == NULL)
+			return (NULL);
+
+		hint = atomic_load_acq_int(&kn->kn_hint);
+		block = (struct xpc_dict_block *)xo;
+		if ((xo->xo_flags & _XPC_DICT_BLOCK) && hint < xo->xo_size &&
+		    hint < block->db_capacity) {
+			pair = &block->db_pairs[hint];
+			if (xpc_keypath_match(pair, kn))
+				return (pair->value);
+		}
+
+		i = 0;
+		TAILQ_FOREACH(pair, &xo->xo_dict, xo_link) {
+			if (xpc_keypath_match(pair, kn)) {
+				if (i != hint)
+					atomic_store_rel_int(&kn->kn_hint, i);
+				return (pair->value);
+			}
+			i++;
+		}
+
+		return (NULL);
+
+	case _XPC_TYPE_PDICTIONARY:
+		if (kn->kn_key == NULL)
+			return (NULL);
+
+		return (xpc_hamt_lookup_hash(xo->xo_hamt, kn->kn_key,
+		    kn->kn_hash));
+
+	case _XPC_TYPE_ARRAY:
+		if (kn->kn_key != NULL)
+			return (NULL);
+
+		return (xpc_array_get_value(xo, kn->kn_index));
+	}
+
+	return (NULL);
+}
+
+void
+xpc_keypath_get_values(xpc_object_t xo, xpc_keypath_t kp,
+    xpc_object_t *values)
+{
+	struct xpc_object *objs[XPC_KEYPATH_MAX_NODES];
+	struct xpc_keypath_node *kn;
+	struct xpc_object *parent;
+	size_t i;
+
+	for (i = 0; i < kp->kp_nnodes; i++) {
+		kn = &kp->kp_nodes[i];
+		parent = kn->kn_parent == XPC_KEYPATH_TOP ? xo :
+		    objs[kn->kn_parent];
+		objs[i] = parent == NULL ? NULL : xpc_keypath_step(parent, kn);
+	}
+
+	for (i = 0; i < kp->kp_npaths; i++)
+		values[i] = objs[kp->kp_results[i]];
+}
+
+xpc_object_t
+xpc_keypath_get_value(xpc_object_t xo, xpc_keypath_t kp)
+{
+	xpc_object_t value;
+
+	if (kp->kp_npaths != 1) {
+		debugf("key path %p holds %zu paths", kp, kp->kp_npaths);
+		return (NULL);
+	}
+
+	xpc_keypath_get_values(xo, kp, &value);
+	return (value);
+}
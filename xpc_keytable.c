@@ -0,0 +1,390 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+
+#define	XPC_KEY_INTERN_MAX	65536
+
+/*
+ * Keys in key tables are interned process-wide, so connections share one
+ * copy of each and decoded dictionaries can point at them instead of
+ * copying every key. Dictionaries intern their short keys as well, which
+ * lets key paths match them by address. Interned keys are never freed;
+ * once the pool is full, new keys fall back to private copies and are
+ * compared as strings.
+ */
+static pthread_mutex_t xpc_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xpc_key *xpc_intern_slots;
+static size_t xpc_intern_nslots;
+static size_t xpc_intern_count;
+
+static int
+xpc_key_intern_grow(void)
+{
+	struct xpc_key *slots, *xk;
+	size_t i, j, nslots;
+
+	nslots = xpc_intern_nslots == 0 ? 256 : xpc_intern_nslots * 2;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return (-1);
+
+	for (i = 0; i < xpc_intern_nslots; i++) {
+		xk = &xpc_intern_slots[i];
+		if (xk->xk_key == NULL)
+			continue;
+
+		for (j = xk->xk_hash & (nslots - 1); slots[j].xk_key != NULL;
+		    j = (j + 1) & (nslots - 1))
+			;
+
+		slots[j] = *xk;
+	}
+
+	free(xpc_intern_slots);
+	xpc_intern_slots = slots;
+	xpc_intern_nslots = nslots;
+	return (0);
+}
+
+__private_extern__ const char *
+xpc_key_intern(const char *key, size_t length, uint32_t hash)
+{
+	struct xpc_key *xk;
+	const char *ret;
+	char *copy;
+	size_t i;
+
+	ret = NULL;
+	xk = NULL;
+	pthread_mutex_lock(&xpc_intern_lock);
+	for (i = hash & (xpc_intern_nslots - 1); xpc_intern_nslots != 0 &&
+	    (xk = &xpc_intern_slots[i])->xk_key != NULL;
+	    i = (i + 1) & (xpc_intern_nslots - 1)) {
+		if (xk->xk_hash == hash && xk->xk_length == length &&
+		    memcmp(xk->xk_key, key, length) == 0) {
+			ret = xk->xk_key;
+			goto out;
+		}
+	}
+
+	/* A full pool still hands out the keys it already has */
+	if ((xpc_intern_count + 1) * 2 > xpc_intern_nslots) {
+		if (xpc_intern_count == XPC_KEY_INTERN_MAX ||
+		    xpc_key_intern_grow() != 0)
+			goto out;
+
+		for (i = hash & (xpc_intern_nslots - 1);
+		    (xk = &xpc_intern_slots[i])->xk_key != NULL;
+		    i = (i + 1) & (xpc_intern_nslots - 1))
+			;
+	}
+
+	if ((copy = malloc(length + 1)) == NULL)
+		goto out;
+
+	memcpy(copy, key, length);
+	copy[length] = '\0';
+	xk->xk_key = ret = copy;
+	xk->xk_length = (uint32_t)length;
+	xk->xk_hash = hash;
+	xk->xk_interned = true;
+	xpc_intern_count++;
+out:
+	pthread_mutex_unlock(&xpc_intern_lock);
+	return (ret);
+}
+
+/*
+ * Interns a dictionary key given as a string, if it is short enough to be
+ * worth sharing. Returns NULL when the caller should keep its own copy.
+ */
+__private_extern__ const char *
+xpc_key_intern_string(const char *key, size_t length)
+{
+
+	if (length > XPC_KEY_MAX_LENGTH)
+		return (NULL);
+
+	return (xpc_key_intern(key, length,
+	    (uint32_t)xpc_hash_bytes(key, length, 0)));
+}
+
+static int
+xpc_key_init(struct xpc_key *xk, const char *key, size_t length,
+    uint32_t hash)
+{
+	char *copy;
+
+	xk->xk_length = (uint32_t)length;
+	xk->xk_hash = hash;
+	xk->xk_interned = true;
+	if ((xk->xk_key = xpc_key_intern(key, length, hash)) != NULL)
+		return (0);
+
+	if ((copy = malloc(length + 1)) == NULL)
+		return (-1);
+
+	memcpy(copy, key, length);
+	copy[length] = '\0';
+	xk->xk_key = copy;
+	xk->xk_interned = false;
+	return (0);
+}
+
+/*
+ * Makes room for one more key in an array that holds n of them. Arrays
+ * grow in powers of two, so the capacity follows from n.
+ */
+static int
+xpc_keys_reserve(struct xpc_key **keys, uint32_t n)
+{
+	struct xpc_key *tmp;
+
+	if (n != 0 && (n < 16 || (n & (n - 1)) != 0))
+		return (0);
+
+	tmp = realloc(*keys, (n < 16 ? 16 : n * 2) * sizeof(**keys));
+	if (tmp == NULL)
+		return (-1);
+
+	*keys = tmp;
+	return (0);
+}
+
+static int
+xpc_keys_rehash(struct xpc_key_table *kt, uint32_t nslots)
+{
+	uint32_t *slots;
+	uint32_t i, j;
+
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return (-1);
+
+	/* In ID order, so xpc_keys_commit() can still unwind the newest */
+	for (i = 0; i < kt->kt_nout; i++) {
+		for (j = kt->kt_out[i].xk_hash & (nslots - 1); slots[j] != 0;
+		    j = (j + 1) & (nslots - 1))
+			;
+
+		slots[j] = i + 1;
+	}
+
+	free(kt->kt_slots);
+	kt->kt_slots = slots;
+	kt->kt_nslots = nslots;
+	return (0);
+}
+
+/*
+ * Writes a map key, by ID if the peer knows it or will learn it from
+ * this frame. New keys get the next ID until the table is full.
+ */
+__private_extern__ void
+xpc_keys_write(struct xpc_key_table *kt, mpack_writer_t *writer,
+    const char *key)
+{
+	struct xpc_key *xk;
+	size_t length;
+	uint32_t hash, i, id;
+
+	length = strlen(key);
+	if (length > XPC_KEY_MAX_LENGTH) {
+		mpack_write_str(writer, key, (uint32_t)length);
+		return;
+	}
+
+	hash = (uint32_t)xpc_hash_bytes(key, length, 0);
+	if (kt->kt_nslots != 0) {
+		for (i = hash & (kt->kt_nslots - 1);
+		    (id = kt->kt_slots[i]) != 0;
+		    i = (i + 1) & (kt->kt_nslots - 1)) {
+			xk = &kt->kt_out[id - 1];
+			if (xk->xk_hash == hash && xk->xk_length == length &&
+			    memcmp(xk->xk_key, key, length) == 0) {
+				mpack_write_uint(writer, id - 1);
+				return;
+			}
+		}
+	}
+
+	if (kt->kt_nout == XPC_KEY_TABLE_MAX ||
+	    xpc_keys_reserve(&kt->kt_out, kt->kt_nout) != 0 ||
+	    ((kt->kt_nout + 1) * 2 > kt->kt_nslots &&
+	    xpc_keys_rehash(kt, kt->kt_nslots == 0 ? 64 :
+	    kt->kt_nslots * 2) != 0) ||
+	    xpc_key_init(&kt->kt_out[kt->kt_nout], key, length, hash) != 0) {
+		mpack_write_str(writer, key, (uint32_t)length);
+		return;
+	}
+
+	for (i = hash & (kt->kt_nslots - 1); kt->kt_slots[i] != 0;
+	    i = (i + 1) & (kt->kt_nslots - 1))
+		;
+
+	kt->kt_slots[i] = ++kt->kt_nout;
+	mpack_write_uint(writer, kt->kt_nout - 1);
+}
+
+/*
+ * Returns the size of the definitions of keys the peer has not been sent
+ * yet, and writes them to buf unless it is NULL.
+ */
+__private_extern__ size_t
+xpc_keys_pending(const struct xpc_key_table *kt, uint8_t *buf)
+{
+	uint8_t tmp[10];
+	const struct xpc_key *xk;
+	size_t size;
+	uint32_t i;
+
+	if (kt->kt_nout == kt->kt_sent)
+		return (0);
+
+	size = xpc_varint_encode(buf != NULL ? buf : tmp,
+	    kt->kt_nout - kt->kt_sent);
+	for (i = kt->kt_sent; i < kt->kt_nout; i++) {
+		xk = &kt->kt_out[i];
+		size += xpc_varint_encode(buf != NULL ? buf + size : tmp,
+		    xk->xk_length);
+		if (buf != NULL)
+			memcpy(buf + size, xk->xk_key, xk->xk_length);
+
+		size += xk->xk_length;
+	}
+
+	return (size);
+}
+
+/*
+ * Called once a frame has been sent or dropped. Keys it would have
+ * defined are forgotten if the peer never saw them. They were the last
+ * ones added, so clearing their slots newest first leaves every probe
+ * chain as it was before.
+ */
+__private_extern__ void
+xpc_keys_commit(struct xpc_key_table *kt, bool sent)
+{
+	struct xpc_key *xk;
+	uint32_t i;
+
+	if (sent) {
+		kt->kt_sent = kt->kt_nout;
+		return;
+	}
+
+	while (kt->kt_nout > kt->kt_sent) {
+		xk = &kt->kt_out[kt->kt_nout - 1];
+		for (i = xk->xk_hash & (kt->kt_nslots - 1);
+		    kt->kt_slots[i] != kt->kt_nout;
+		    i = (i + 1) & (kt->kt_nslots - 1))
+			;
+
+		kt->kt_slots[i] = 0;
+		if (!xk->xk_interned)
+			free(__DECONST(char *, xk->xk_key));
+
+		kt->kt_nout--;
+	}
+}
+
+/* Frees everything a table holds, leaving it empty */
+__private_extern__ void
+xpc_keys_destroy(struct xpc_key_table *kt)
+{
+	uint32_t i;
+
+	for (i = 0; i < kt->kt_nout; i++) {
+		if (!kt->kt_out[i].xk_interned)
+			free(__DECONST(char *, kt->kt_out[i].xk_key));
+	}
+
+	for (i = 0; i < kt->kt_nin; i++) {
+		if (!kt->kt_in[i].xk_interned)
+			free(__DECONST(char *, kt->kt_in[i].xk_key));
+	}
+
+	free(kt->kt_out);
+	free(kt->kt_slots);
+	free(kt->kt_in);
+	memset(kt, 0, sizeof(*kt));
+}
+
+/*
+ * Reads the key definitions at the start of a frame. They are learned
+ * before the body is looked at, so numbering stays in step with the
+ * sender even if the message itself is rejected.
+ */
+__private_extern__ int
+xpc_keys_learn(struct xpc_key_table *kt, const uint8_t **p,
+    const uint8_t *end)
+{
+	uint64_t count, length;
+
+	if (xpc_varint_decode(p, end, &count) != 0 ||
+	    count > XPC_KEY_TABLE_MAX - kt->kt_nin)
+		return (-1);
+
+	for (; count > 0; count--) {
+		if (xpc_varint_decode(p, end, &length) != 0 ||
+		    length > XPC_KEY_MAX_LENGTH ||
+		    length > (uint64_t)(end - *p) ||
+		    memchr(*p, '\0', length) != NULL)
+			return (-1);
+
+		if (xpc_keys_reserve(&kt->kt_in, kt->kt_nin) != 0 ||
+		    xpc_key_init(&kt->kt_in[kt->kt_nin], (const char *)*p,
+		    length, (uint32_t)xpc_hash_bytes(*p, length, 0)) != 0)
+			return (-1);
+
+		kt->kt_nin++;
+		*p += length;
+	}
+
+	return (0);
+}
+
+/*
+ * Returns the key a map key node refers to by ID, or NULL if the node is
+ * not an ID the peer has defined.
+ */
+__private_extern__ const struct xpc_key *
+xpc_keys_get(const struct xpc_key_table *kt, mpack_node_t node)
+{
+	uint64_t id;
+
+	if (kt == NULL || mpack_node_type(node) != mpack_type_uint)
+		return (NULL);
+
+	id = mpack_node_u64(node);
+	return (id < kt->kt_nin ? &kt->kt_in[id] : NULL);
+}
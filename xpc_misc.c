@@ -36,11 +36,22 @@
 #include "xpc_internal.h"
 
 #define RECV_BUFFER_SIZE	65536
+#define STREAM_BUFFER_SIZE	(256 * 1024)
 
 static void xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf,
     int level);
+static void xpc_reclaim(void *context);
+static void xpc_packet_free(struct xpc_packet *pkt);
+static int xpc_batch_add(struct xpc_batch *batch, const struct xpc_packet *pkt,
+    uint64_t features, xpc_port_t local, xpc_port_t remote);
+
+static size_t xpc_reclaim_threshold;
+static dispatch_queue_t xpc_reclaim_queue;
+static pthread_once_t xpc_reclaim_once = PTHREAD_ONCE_INIT;
 
 extern struct xpc_transport unix_transport __attribute__((weak));
+extern struct xpc_transport unix_stream_transport __attribute__((weak));
+extern struct xpc_transport tcp_transport __attribute__((weak));
 extern struct xpc_transport mach_transport __attribute__((weak));
 static struct xpc_transport *selected_transport = NULL;
 
@@ -53,6 +64,12 @@ xpc_get_transport()
 			if (!strcmp(env, "unix"))
 				selected_transport = &unix_transport;
 
+			if (!strcmp(env, "unix-stream"))
+				selected_transport = &unix_stream_transport;
+
+			if (!strcmp(env, "tcp"))
+				selected_transport = &tcp_transport;
+
 			if (!strcmp(env, "mach"))
 				selected_transport = &mach_transport;
 		} else {
@@ -67,91 +84,483 @@ xpc_get_transport()
 	return (selected_transport);
 }
 
+/*
+ * Drops a container's reference on one of its children and, if that was
+ * the last one, pushes the child onto a list of dead objects. The list is
+ * threaded through xo_link, which a dead object no longer needs, so
+ * tearing down a tree needs neither recursion nor extra memory.
+ */
+static inline void
+xpc_object_unref(struct xpc_object *xo, struct xpc_object **dead)
+{
+
+	if (atomic_fetchadd_int(&xo->xo_refcnt, -1) > 1)
+		return;
+
+	TAILQ_NEXT(xo, xo_link) = *dead;
+	*dead = xo;
+}
+
 static void
-xpc_dictionary_destroy(struct xpc_object *dict)
+xpc_reclaim_init(void)
 {
-	struct xpc_dict_head *head;
-	struct xpc_dict_pair *p, *ptmp;
 
-	head = &dict->xo_dict;
+	xpc_reclaim_queue = dispatch_queue_create(
+	    "com.ixsystems.xpc.reclaim", NULL);
+	dispatch_set_target_queue(xpc_reclaim_queue,
+	    dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+}
+
+/*
+ * Frees a list of dead objects along with everything only they referenced.
+ * With a nonzero budget, at most that many objects are freed here and the
+ * rest of the list is handed to the background reclaimer.
+ */
+static void
+xpc_object_free_list(struct xpc_object *dead, size_t budget)
+{
+	struct xpc_object *xo, *child, *ctmp;
+	struct xpc_dict_pair *pair, *ptmp;
+	size_t freed;
+
+	for (freed = 0; (xo = dead) != NULL; freed++) {
+		if (budget != 0 && freed == budget) {
+			pthread_once(&xpc_reclaim_once, xpc_reclaim_init);
+			dispatch_async_f(xpc_reclaim_queue, dead, xpc_reclaim);
+			return;
+		}
 
-	TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp) {
-		TAILQ_REMOVE(head, p, xo_link);
-		xpc_object_destroy(p->value);
-		free(p);
+		dead = TAILQ_NEXT(xo, xo_link);
+
+		switch (xo->xo_xpc_type) {
+		case _XPC_TYPE_DICTIONARY:
+			TAILQ_FOREACH_SAFE(pair, &xo->xo_dict, xo_link, ptmp) {
+				xpc_object_unref(pair->value, &dead);
+				if (!pair->interned)
+					free(__DECONST(char *, pair->key));
+				if (!XPC_DICT_PAIR_INLINE(xo, pair))
+					free(pair);
+			}
+			break;
+
+		case _XPC_TYPE_ARRAY:
+			TAILQ_FOREACH_SAFE(child, &xo->xo_array, xo_link, ctmp)
+				xpc_object_unref(child, &dead);
+			break;
+
+		case _XPC_TYPE_PDICTIONARY:
+			xpc_hamt_release(xo->xo_hamt);
+			break;
+
+		case _XPC_TYPE_TYPED_ARRAY:
+			free(xo->xo_typed.ta_data);
+			break;
+		}
+
+		free(xo);
 	}
 }
 
 static void
-xpc_array_destroy(struct xpc_object *dict)
+xpc_reclaim(void *context)
+{
+
+	xpc_object_free_list(context, 0);
+}
+
+void
+xpc_set_deferred_reclaim_threshold(size_t nodes)
 {
-	struct xpc_object *p, *ptmp;
-	struct xpc_array_head *head;
 
-	head = &dict->xo_array;
+	xpc_reclaim_threshold = nodes;
+}
 
-	TAILQ_FOREACH_SAFE(p, head, xo_link, ptmp) {
-		TAILQ_REMOVE(head, p, xo_link);
-		xpc_object_destroy(p);
+size_t
+xpc_varint_encode(uint8_t *p, uint64_t value)
+{
+	size_t n;
+
+	for (n = 0; value >= 0x80; n++) {
+		p[n] = (uint8_t)value | 0x80;
+		value >>= 7;
 	}
+
+	p[n++] = (uint8_t)value;
+	return (n);
 }
 
-static int
-xpc_pack(struct xpc_object *xo, void **buf, uint64_t id, size_t *size)
+int
+xpc_varint_decode(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+	uint64_t result;
+	int shift;
+
+	result = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (*p == end)
+			return (-1);
+
+		result |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0) {
+			*value = result;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * Encodes the header of a frame with a body of length bytes into hdr,
+ * which must have room for a struct xpc_frame_header (larger than any
+ * v2 header), and returns its size.
+ */
+size_t
+xpc_frame_header(const struct xpc_frame *frame, uint64_t features,
+    size_t length, uint8_t *hdr)
 {
 	struct xpc_frame_header *header;
+	size_t hdrlen;
+
+	/* Hello frames are always v2: v1 peers drop them unread */
+	if ((features & XPC_FEATURE_FRAME_V2) ||
+	    (frame->xf_flags & XPC_FRAME_HELLO)) {
+		hdr[0] = XPC_FRAME_V2_MAGIC;
+		hdr[1] = frame->xf_flags;
+		if (frame->xf_method != 0)
+			hdr[1] |= XPC_FRAME_METHOD;
+
+		hdrlen = 2;
+		hdrlen += xpc_varint_encode(hdr + hdrlen, frame->xf_id);
+		hdrlen += xpc_varint_encode(hdr + hdrlen, length);
+		if (frame->xf_method != 0)
+			hdrlen += xpc_varint_encode(hdr + hdrlen,
+			    frame->xf_method);
+	} else {
+		header = (struct xpc_frame_header *)hdr;
+		memset(header, 0, sizeof(*header));
+		header->length = length;
+		header->id = frame->xf_id;
+		header->method = frame->xf_method;
+		header->version = XPC_PROTOCOL_VERSION;
+		hdrlen = sizeof(*header);
+	}
+
+	return (hdrlen);
+}
+
+int
+xpc_pipe_frame(const struct xpc_frame *frame, uint64_t features,
+    const void *body, size_t length, void **buf, size_t *size)
+{
+	uint8_t hdr[sizeof(struct xpc_frame_header)];
+	size_t hdrlen;
+	char *ret;
+
+	hdrlen = xpc_frame_header(frame, features, length, hdr);
+	if ((ret = malloc(hdrlen + length)) == NULL)
+		return (-1);
+
+	memcpy(ret, hdr, hdrlen);
+	memcpy(ret + hdrlen, body, length);
+	*buf = ret;
+	*size = hdrlen + length;
+	return (0);
+}
+
+/*
+ * Decodes a frame header into frame and its size into hdrlen, without
+ * looking at the body.
+ */
+static int
+xpc_frame_parse_header(const uint8_t *buf, size_t size,
+    struct xpc_frame *frame, size_t *hdrlen)
+{
+	const struct xpc_frame_header *header;
+	const uint8_t *p, *end;
+	uint64_t method;
+
+	end = buf + size;
+	if (size >= 2 && buf[0] == XPC_FRAME_V2_MAGIC) {
+		frame->xf_flags = buf[1];
+		if (frame->xf_flags & ~(XPC_FRAME_HELLO | XPC_FRAME_METHOD |
+		    XPC_FRAME_KEYS | XPC_FRAME_COMPRESSED | XPC_FRAME_BATCH)) {
+			debugf("unknown frame flags %#x", frame->xf_flags);
+			return (-1);
+		}
+
+		p = buf + 2;
+		if (xpc_varint_decode(&p, end, &frame->xf_id) != 0 ||
+		    xpc_varint_decode(&p, end, &frame->xf_length) != 0)
+			return (-1);
+
+		if (frame->xf_flags & XPC_FRAME_METHOD) {
+			if (xpc_varint_decode(&p, end, &method) != 0)
+				return (-1);
+
+			frame->xf_method = (uint32_t)method;
+		}
+	} else {
+		if (size < sizeof(*header))
+			return (-1);
+
+		header = (const struct xpc_frame_header *)buf;
+		if (header->version != XPC_PROTOCOL_VERSION) {
+			debugf("invalid protocol version");
+			return (-1);
+		}
+
+		frame->xf_id = header->id;
+		frame->xf_method = (uint32_t)header->method;
+		frame->xf_length = header->length;
+		p = buf + sizeof(*header);
+	}
+
+	*hdrlen = p - buf;
+	return (0);
+}
+
+static int
+xpc_frame_parse(const uint8_t *buf, size_t size, struct xpc_frame *frame)
+{
+	size_t hdrlen;
+
+	if (xpc_frame_parse_header(buf, size, frame, &hdrlen) != 0)
+		return (-1);
+
+	if (frame->xf_length > size - hdrlen) {
+		debugf("invalid message length");
+		return (-1);
+	}
+
+	frame->xf_body = buf + hdrlen;
+	return (0);
+}
+
+/*
+ * Encodes a message into pkt, to be sent from pkt->xk_iov and then
+ * released with xpc_packet_free(). With a key table, keys the message
+ * uses for the first time are defined ahead of the body. They only
+ * count as sent once the caller calls xpc_keys_commit(). The body,
+ * definitions included, is then compressed if the connection asks for
+ * it; otherwise large leaves are sent from the message itself, which
+ * must stay unchanged until the send is done.
+ */
+static int
+xpc_pack(struct xpc_object *xo, const struct xpc_frame *frame,
+    uint64_t features, struct xpc_key_table *keys, struct xpc_compression *xz,
+    struct xpc_packet *pkt)
+{
+	struct xpc_frame kframe;
+	struct xpc_gather gather, *gp;
 	mpack_writer_t writer;
-	char *packed, *ret;
-	size_t packed_size;
+	char *body;
+	void *compressed;
+	size_t size, defs, length, offset, gathered, i;
+	int n;
+
+	pkt->xk_defs = NULL;
+	pkt->xk_body = NULL;
+	kframe = *frame;
+	gather.xg_count = 0;
+
+	/*
+	 * Compression needs the whole body in one piece. So does mpack's
+	 * write tracking in debug builds, which would find the bytes of
+	 * gathered leaves missing.
+	 */
+#if MPACK_WRITE_TRACKING
+	gp = NULL;
+#else
+	gp = xpc_compression_enabled(xz, features) ? NULL : &gather;
+#endif
 
-	mpack_writer_init_growable(&writer, &packed, &packed_size);
-	xpc2mpack(&writer, xo);
+	if (keys == NULL) {
+		/* Without key ids the size is known up front */
+		gathered = 0;
+		size = xpc2mpack_size(xo, gp != NULL ? &gathered : NULL);
+		if ((pkt->xk_body = malloc(size)) == NULL)
+			return (-1);
 
-	if (mpack_writer_destroy(&writer) != mpack_ok)
+		mpack_writer_init(&writer, pkt->xk_body, size);
+	} else
+		mpack_writer_init_growable(&writer, &pkt->xk_body, &size);
+
+	xpc2mpack(&writer, xo, keys, gp);
+	if (mpack_writer_destroy(&writer) != mpack_ok) {
+		xpc_packet_free(pkt);
 		return (-1);
+	}
 
-	ret = malloc(packed_size + sizeof(*header));
-	memset(ret, 0, packed_size + sizeof(*header));
+	defs = 0;
+	if (keys != NULL && (defs = xpc_keys_pending(keys, NULL)) != 0) {
+		if ((pkt->xk_defs = malloc(defs)) == NULL) {
+			xpc_packet_free(pkt);
+			return (-1);
+		}
 
-	header = (struct xpc_frame_header *)ret;
-	header->length = packed_size;
-	header->id = id;
-	header->version = XPC_PROTOCOL_VERSION;
+		xpc_keys_pending(keys, (uint8_t *)pkt->xk_defs);
+		kframe.xf_flags |= XPC_FRAME_KEYS;
+	}
 
-	memcpy(ret + sizeof(*header), packed, packed_size);
-	*buf = ret;
-	*size = packed_size + sizeof(*header);
+	if (gp == NULL && defs != 0) {
+		if ((body = malloc(defs + size)) == NULL) {
+			xpc_packet_free(pkt);
+			return (-1);
+		}
 
-	free(packed);
+		memcpy(body, pkt->xk_defs, defs);
+		memcpy(body + defs, pkt->xk_body, size);
+		xpc_packet_free(pkt);
+		pkt->xk_body = body;
+		size += defs;
+		defs = 0;
+	}
+
+	if (gp == NULL && xpc_compress(xz, features, pkt->xk_body, size,
+	    &compressed, &size) == 0) {
+		free(pkt->xk_body);
+		pkt->xk_body = compressed;
+		kframe.xf_flags |= XPC_FRAME_COMPRESSED;
+	}
+
+	length = defs + size;
+	for (i = 0; i < gather.xg_count; i++)
+		length += gather.xg_refs[i].gr_length;
+
+	n = 0;
+	pkt->xk_iov[n].iov_base = pkt->xk_header;
+	pkt->xk_iov[n++].iov_len = xpc_frame_header(&kframe, features, length,
+	    pkt->xk_header);
+	if (defs != 0) {
+		pkt->xk_iov[n].iov_base = pkt->xk_defs;
+		pkt->xk_iov[n++].iov_len = defs;
+	}
+
+	offset = 0;
+	for (i = 0; i < gather.xg_count; i++) {
+		pkt->xk_iov[n].iov_base = pkt->xk_body + offset;
+		pkt->xk_iov[n++].iov_len = gather.xg_refs[i].gr_offset - offset;
+		pkt->xk_iov[n].iov_base = (void *)gather.xg_refs[i].gr_base;
+		pkt->xk_iov[n++].iov_len = gather.xg_refs[i].gr_length;
+		offset = gather.xg_refs[i].gr_offset;
+	}
+
+	pkt->xk_iov[n].iov_base = pkt->xk_body + offset;
+	pkt->xk_iov[n++].iov_len = size - offset;
+	pkt->xk_iovcnt = n;
 	return (0);
 }
 
+static void
+xpc_packet_free(struct xpc_packet *pkt)
+{
+
+	free(pkt->xk_defs);
+	free(pkt->xk_body);
+	pkt->xk_defs = NULL;
+	pkt->xk_body = NULL;
+}
+
+/*
+ * Parses buf into the decoder's node pool, growing the pool until the
+ * message fits. A message has at most one node per byte. Messages with
+ * more nodes than XPC_DECODER_NODES_MAX get pages of their own from
+ * mpack, as they do without a decoder.
+ */
+static void
+xpc_decoder_parse(struct xpc_decoder *dec, mpack_tree_t *tree,
+    const char *buf, size_t size)
+{
+	mpack_node_data_t *nodes;
+	size_t n;
+
+	if (dec == NULL) {
+		mpack_tree_init(tree, buf, size);
+		return;
+	}
+
+	for (;;) {
+		if (dec->xd_nnodes != 0) {
+			mpack_tree_init_pool(tree, buf, size, dec->xd_nodes,
+			    dec->xd_nnodes);
+			if (mpack_tree_error(tree) != mpack_error_too_big ||
+			    dec->xd_nnodes > size)
+				return;
+
+			mpack_tree_destroy(tree);
+		}
+
+		n = dec->xd_nnodes != 0 ? dec->xd_nnodes * 2 :
+		    XPC_DECODER_NODES;
+		if (n > XPC_DECODER_NODES && n > size + 1)
+			n = size + 1;
+
+		if (n > XPC_DECODER_NODES_MAX ||
+		    (nodes = realloc(dec->xd_nodes, n * sizeof(*nodes))) == NULL) {
+			mpack_tree_init(tree, buf, size);
+			return;
+		}
+
+		dec->xd_nodes = nodes;
+		dec->xd_nnodes = n;
+	}
+}
+
+void
+xpc_decoder_destroy(struct xpc_decoder *dec)
+{
+
+	free(dec->xd_buffer);
+	free(dec->xd_inflated);
+	free(dec->xd_nodes);
+	memset(dec, 0, sizeof(*dec));
+}
+
 static struct xpc_object *
-xpc_unpack(void *buf, size_t size)
+xpc_unpack(const void *buf, size_t size, struct xpc_schema *schema,
+    const struct xpc_key_table *keys, struct xpc_decoder *dec)
 {
 	mpack_tree_t tree;
 	struct xpc_object *xo;
 
-	mpack_tree_init(&tree, (const char *)buf, size);
+	xpc_decoder_parse(dec, &tree, (const char *)buf, size);
 	if (mpack_tree_error(&tree) != mpack_ok) {
 		debugf("unpack failed: %d", mpack_tree_error(&tree))
+		mpack_tree_destroy(&tree);
+		return (NULL);
+	}
+
+	/* Rejected messages never get as far as allocating objects */
+	if (schema != NULL &&
+	    !xpc_schema_check_tree(schema, mpack_tree_root(&tree), keys)) {
+		debugf("message does not match the connection schema");
+		mpack_tree_destroy(&tree);
+		errno = EBADMSG;
 		return (NULL);
 	}
 
-	xo = mpack2xpc(mpack_tree_root(&tree));
+	xo = mpack2xpc(mpack_tree_root(&tree), keys);
+	if (mpack_tree_error(&tree) != mpack_ok) {
+		debugf("decode failed: %d", mpack_tree_error(&tree));
+		errno = mpack_tree_error(&tree) == mpack_error_memory ?
+		    ENOMEM : EBADMSG;
+		if (xo != NULL)
+			xpc_release(xo);
+
+		xo = NULL;
+	}
+
+	mpack_tree_destroy(&tree);
 	return (xo);
 }
 
 void
 xpc_object_destroy(struct xpc_object *xo)
 {
-	if (xo->xo_xpc_type == _XPC_TYPE_DICTIONARY)
-		xpc_dictionary_destroy(xo);
-
-	if (xo->xo_xpc_type == _XPC_TYPE_ARRAY)
-		xpc_array_destroy(xo);
 
-	free(xo);
+	TAILQ_NEXT(xo, xo_link) = NULL;
+	xpc_object_free_list(xo, xpc_reclaim_threshold);
 }
 
 xpc_object_t
@@ -214,6 +623,7 @@ xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level)
 {
 	struct xpc_object *xo = obj;
 	struct uuid *id;
+	xpc_iterator_t iter;
 	char *uuid_str;
 	uint32_t uuid_status;
 
@@ -226,21 +636,22 @@ xpc_copy_description_level(xpc_object_t obj, struct sbuf *sbuf, int level)
 
 	switch (xo->xo_xpc_type) {
 	case _XPC_TYPE_DICTIONARY:
-		sbuf_printf(sbuf, "\n");
-		xpc_dictionary_apply(xo, ^(const char *k, xpc_object_t v) {
-			sbuf_printf(sbuf, "%*s\"%s\": ", level * 4, " ", k);
-			xpc_copy_description_level(v, sbuf, level + 1);
-			return ((bool)true);
-		});
-		break;
-
+	case _XPC_TYPE_PDICTIONARY:
 	case _XPC_TYPE_ARRAY:
+	case _XPC_TYPE_TYPED_ARRAY:
 		sbuf_printf(sbuf, "\n");
-		xpc_array_apply(xo, ^(size_t idx, xpc_object_t v) {
-			sbuf_printf(sbuf, "%*s%ld: ", level * 4, " ", idx);
-			xpc_copy_description_level(v, sbuf, level + 1);
-			return ((bool)true);
-		});
+		xpc_iterator_begin(&iter, obj);
+		while (xpc_iterator_next(&iter)) {
+			if (iter.key != NULL)
+				sbuf_printf(sbuf, "%*s\"%s\": ", level * 4, " ",
+				    iter.key);
+			else
+				sbuf_printf(sbuf, "%*s%ld: ", level * 4, " ",
+				    iter.index);
+
+			xpc_copy_description_level(iter.value, sbuf, level + 1);
+		}
+		xpc_iterator_end(&iter);
 		break;
 
 	case _XPC_TYPE_BOOL:
@@ -364,43 +775,360 @@ xpc_copy_entitlement_for_token(const char *key __unused, audit_token_t *token __
 }
 #endif
 
+size_t
+xpc_serialized_size(xpc_object_t xobj)
+{
+
+	if (xpc_get_type(xobj) != &_xpc_type_dictionary) {
+		errno = EINVAL;
+		return (0);
+	}
+
+	return (xpc2mpack_size(xobj, NULL));
+}
+
+size_t
+xpc_serialize(xpc_object_t xobj, void *buf, size_t size)
+{
+	mpack_writer_t writer;
+	size_t used;
+
+	if (xpc_get_type(xobj) != &_xpc_type_dictionary) {
+		errno = EINVAL;
+		return (0);
+	}
+
+	mpack_writer_init(&writer, buf, size);
+	xpc2mpack(&writer, xobj, NULL, NULL);
+	used = mpack_writer_buffer_used(&writer);
+	if (mpack_writer_destroy(&writer) != mpack_ok) {
+		errno = ENOBUFS;
+		return (0);
+	}
+
+	return (used);
+}
+
 int
-xpc_pipe_send(xpc_object_t xobj, uint64_t id, xpc_port_t local, xpc_port_t remote)
+xpc_pipe_send(xpc_object_t xobj, const struct xpc_frame *frame,
+    uint64_t features, struct xpc_key_table *keys, struct xpc_compression *xz,
+    struct xpc_batch *batch, xpc_port_t local, xpc_port_t remote)
 {
-	struct xpc_transport *transport = xpc_get_transport();
-	void *buf;
-	size_t size;
+	struct xpc_packet pkt;
+	bool batching;
+	int ret;
 
 	assert(xpc_get_type(xobj) == &_xpc_type_dictionary);
 
-	if (xpc_pack(xobj, &buf, id, &size) != 0) {
+	if ((features & XPC_FEATURE_KEY_TABLE) == 0)
+		keys = NULL;
+
+	if (xpc_pack(xobj, frame, features, keys, xz, &pkt) != 0) {
 		debugf("pack failed");
+		if (keys != NULL)
+			xpc_keys_commit(keys, false);
+
 		return (-1);
 	}
 
-	if (transport->xt_send(local, remote, buf, size, NULL, 0) != 0) {
-		debugf("transport send function failed: %s", strerror(errno));
+	/* Batch headers carry flags, so they need v2 framing */
+	batching = batch != NULL && batch->xb_latency != 0 &&
+	    (features & XPC_FEATURE_BATCH) && (features & XPC_FEATURE_FRAME_V2);
+
+	/*
+	 * A frame defining keys goes out at once, behind what is batched,
+	 * so that its keys are only committed once the peer has them.
+	 */
+	if (batching && (keys == NULL || xpc_keys_pending(keys, NULL) == 0))
+		ret = xpc_batch_add(batch, &pkt, features, local, remote);
+	else if (batching && xpc_pipe_flush(batch, features, local,
+	    remote) != 0)
+		ret = -1;
+	else
+		ret = xpc_pipe_sendv(pkt.xk_iov, pkt.xk_iovcnt, local, remote);
+
+	xpc_packet_free(&pkt);
+	if (keys != NULL)
+		xpc_keys_commit(keys, ret >= 0);
+
+	return (ret);
+}
+
+/*
+ * Appends a packed frame to the batch, flushing first if it would not
+ * fit. Frames that could never fit go out on their own. Returns 1 if
+ * the batch was empty, so the caller starts its flush timer.
+ */
+static int
+xpc_batch_add(struct xpc_batch *batch, const struct xpc_packet *pkt,
+    uint64_t features, xpc_port_t local, xpc_port_t remote)
+{
+	size_t length;
+	int i;
+
+	length = 0;
+	for (i = 0; i < pkt->xk_iovcnt; i++)
+		length += pkt->xk_iov[i].iov_len;
+
+	if (length > batch->xb_max - batch->xb_length &&
+	    xpc_pipe_flush(batch, features, local, remote) != 0)
+		return (-1);
+
+	if (length > batch->xb_max)
+		return (xpc_pipe_sendv(pkt->xk_iov, pkt->xk_iovcnt, local,
+		    remote));
+
+	if (batch->xb_buffer == NULL &&
+	    (batch->xb_buffer = malloc(batch->xb_max)) == NULL)
 		return (-1);
+
+	for (i = 0; i < pkt->xk_iovcnt; i++) {
+		memcpy(batch->xb_buffer + batch->xb_length,
+		    pkt->xk_iov[i].iov_base, pkt->xk_iov[i].iov_len);
+		batch->xb_length += pkt->xk_iov[i].iov_len;
 	}
 
-	return (0);
+	return (batch->xb_count++ == 0 ? 1 : 0);
 }
 
+/*
+ * Sends whatever the batch holds: a lone frame as is, several behind a
+ * batch header.
+ */
 int
-xpc_pipe_receive(xpc_port_t local, xpc_port_t *remote, xpc_object_t *result,
-    uint64_t *id, struct xpc_credentials *creds)
+xpc_pipe_flush(struct xpc_batch *batch, uint64_t features, xpc_port_t local,
+    xpc_port_t remote)
+{
+	struct xpc_frame frame;
+	uint8_t hdr[sizeof(struct xpc_frame_header)];
+	struct iovec iov[2];
+	int ret;
+
+	if (batch->xb_count == 0)
+		return (0);
+
+	batch->xb_generation++;
+	iov[1].iov_base = batch->xb_buffer;
+	iov[1].iov_len = batch->xb_length;
+	if (batch->xb_count == 1)
+		ret = xpc_pipe_sendv(&iov[1], 1, local, remote);
+	else {
+		memset(&frame, 0, sizeof(frame));
+		frame.xf_flags = XPC_FRAME_BATCH;
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = xpc_frame_header(&frame, features,
+		    batch->xb_length, hdr);
+		ret = xpc_pipe_sendv(iov, 2, local, remote);
+	}
+
+	batch->xb_length = 0;
+	batch->xb_count = 0;
+	return (ret);
+}
+
+int
+xpc_pipe_send_hello(uint64_t features, uint32_t dict, xpc_port_t local,
+    xpc_port_t remote)
+{
+	struct xpc_frame frame;
+	uint8_t body[20];
+	void *buf;
+	size_t size, length;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.xf_flags = XPC_FRAME_HELLO;
+	length = xpc_varint_encode(body, features);
+	length += xpc_varint_encode(body + length, dict);
+	if (xpc_pipe_frame(&frame, 0, body, length, &buf, &size) != 0)
+		return (-1);
+
+	return (xpc_pipe_send_frame(buf, size, local, remote));
+}
+
+int
+xpc_pipe_send_frame(void *buf, size_t size, xpc_port_t local,
+    xpc_port_t remote)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	int ret;
+
+	ret = xpc_pipe_sendv(&iov, 1, local, remote);
+	free(buf);
+	return (ret);
+}
+
+int
+xpc_pipe_sendv(const struct iovec *iov, int iovcnt, xpc_port_t local,
+    xpc_port_t remote)
 {
 	struct xpc_transport *transport = xpc_get_transport();
+
+	if (transport->xt_send(local, remote, iov, iovcnt, NULL, 0) != 0) {
+		debugf("transport send function failed: %s", strerror(errno));
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Takes the frame at the start of a stream decoder's buffer, if it has
+ * all of it. Returns 1 if more bytes are needed, with the size of the
+ * frame in need once its header is known, or 0 before that.
+ */
+static int
+xpc_stream_frame(struct xpc_decoder *dec, struct xpc_frame *frame,
+    size_t *need)
+{
+	const uint8_t *p;
+	size_t avail, hdrlen;
+
+	*need = 0;
+	avail = dec->xd_end - dec->xd_start;
+	if (avail == 0)
+		return (1);
+
+	p = (const uint8_t *)dec->xd_buffer + dec->xd_start;
+	memset(frame, 0, sizeof(*frame));
+	if (xpc_frame_parse_header(p, avail, frame, &hdrlen) != 0) {
+		/* No valid header is longer than a v1 one */
+		if (avail < sizeof(struct xpc_frame_header))
+			return (1);
+
+		errno = EBADMSG;
+		return (-1);
+	}
+
+	if (frame->xf_length > XPC_STREAM_FRAME_MAX) {
+		debugf("frame too large: %lu", frame->xf_length);
+		errno = EBADMSG;
+		return (-1);
+	}
+
+	*need = hdrlen + frame->xf_length;
+	if (*need > avail)
+		return (1);
+
+	frame->xf_body = p + hdrlen;
+	dec->xd_start += *need;
+	return (0);
+}
+
+/*
+ * Stream transports deliver bytes, not frames. The decoder's buffer
+ * keeps what has been read but not consumed; frames are taken from it
+ * until a partial one is left, which is then moved to the front and
+ * completed by the next reads. Only one read is made per call, since
+ * the caller only knows the socket has some data: -1 with EAGAIN means
+ * the frame is not complete yet.
+ */
+static int
+xpc_pipe_receive_stream(struct xpc_transport *transport, xpc_port_t local,
+    xpc_port_t *remote, struct xpc_frame *frame, struct xpc_decoder *dec)
+{
+	struct xpc_resource *resources;
+	size_t nresources, need, size;
+	void *buf;
+	int ret;
+
+	if ((ret = xpc_stream_frame(dec, frame, &need)) <= 0)
+		return (ret < 0 ? -1 : (int)need);
+
+	/*
+	 * The buffer is sized to the frame being completed, or back to the
+	 * default once that is small enough. What is left of the frame is
+	 * only moved to the front when it would not fit where it is.
+	 */
+	size = need > STREAM_BUFFER_SIZE ? need : STREAM_BUFFER_SIZE;
+	if (dec->xd_start == dec->xd_end)
+		dec->xd_start = dec->xd_end = 0;
+
+	if (dec->xd_start != 0 && (size != dec->xd_size || dec->xd_start +
+	    (need != 0 ? need : sizeof(struct xpc_frame_header)) >
+	    dec->xd_size)) {
+		memmove(dec->xd_buffer, (char *)dec->xd_buffer +
+		    dec->xd_start, dec->xd_end - dec->xd_start);
+		dec->xd_end -= dec->xd_start;
+		dec->xd_start = 0;
+	}
+
+	if (size != dec->xd_size) {
+		if ((buf = realloc(dec->xd_buffer, size)) == NULL)
+			return (-1);
+
+		dec->xd_buffer = buf;
+		dec->xd_size = size;
+	}
+
+	ret = transport->xt_recv(local, remote,
+	    (char *)dec->xd_buffer + dec->xd_end, size - dec->xd_end,
+	    &resources, &nresources, &dec->xd_creds);
+	if (ret <= 0) {
+		if (ret == 0 && dec->xd_end != 0)
+			debugf("stream closed in the middle of a frame");
+
+		return (ret);
+	}
+
+	dec->xd_end += ret;
+	if ((ret = xpc_stream_frame(dec, frame, &need)) != 0) {
+		if (ret > 0)
+			errno = EAGAIN;
+
+		return (-1);
+	}
+
+	return ((int)need);
+}
+
+bool
+xpc_pipe_pending(const struct xpc_decoder *dec)
+{
+	struct xpc_frame frame;
+	size_t avail, hdrlen;
+
+	if (dec->xd_batch != NULL)
+		return (true);
+
+	avail = dec->xd_end - dec->xd_start;
+	if (avail == 0)
+		return (false);
+
+	memset(&frame, 0, sizeof(frame));
+	if (xpc_frame_parse_header((const uint8_t *)dec->xd_buffer +
+	    dec->xd_start, avail, &frame, &hdrlen) != 0)
+		return (false);
+
+	return (frame.xf_length <= avail - hdrlen);
+}
+
+/*
+ * Reads the next frame from the transport into the decoder's buffer.
+ */
+static int
+xpc_pipe_read(struct xpc_transport *transport, xpc_port_t local,
+    xpc_port_t *remote, struct xpc_frame *frame,
+    struct xpc_credentials *creds, struct xpc_decoder *dec)
+{
 	struct xpc_resource *resources;
-	struct xpc_frame_header *header;
-	void *buffer;
 	size_t nresources;
 	int ret;
 
-	buffer = malloc(RECV_BUFFER_SIZE);
+	if (transport->xt_stream) {
+		/* Stream sockets are connected; replies go back the same way */
+		*remote = NULL;
+		ret = xpc_pipe_receive_stream(transport, local, remote, frame,
+		    dec);
+		*creds = dec->xd_creds;
+	} else {
+		if (dec->xd_buffer == NULL &&
+		    (dec->xd_buffer = malloc(RECV_BUFFER_SIZE)) == NULL)
+			return (-1);
+
+		ret = transport->xt_recv(local, remote, dec->xd_buffer,
+		    RECV_BUFFER_SIZE, &resources, &nresources, creds);
+	}
 
-	ret = transport->xt_recv(local, remote, buffer, RECV_BUFFER_SIZE,
-	    &resources, &nresources, creds);
 	if (ret < 0) {
 		debugf("transport receive function failed: %s", strerror(errno));
 		return (-1);
@@ -411,26 +1139,138 @@ xpc_pipe_receive(xpc_port_t local, xpc_port_t *remote, xpc_object_t *result,
 		return (ret);
 	}
 
-	header = (struct xpc_frame_header *)buffer;
-	if (header->length > (ret - sizeof(*header))) {
-		debugf("invalid message length");
-		return (-1);
+	if (!transport->xt_stream) {
+		memset(frame, 0, sizeof(*frame));
+		if (xpc_frame_parse(dec->xd_buffer, ret, frame) != 0)
+			return (-1);
 	}
 
-	if (header->version != XPC_PROTOCOL_VERSION) {
-		debugf("invalid protocol version")
+	return (ret);
+}
+
+/*
+ * Takes the next frame out of the batch being split up.
+ */
+static int
+xpc_batch_next(struct xpc_decoder *dec, struct xpc_frame *frame)
+{
+	const uint8_t *p;
+
+	p = dec->xd_batch;
+	memset(frame, 0, sizeof(*frame));
+	if (xpc_frame_parse(p, dec->xd_batch_end - p, frame) != 0 ||
+	    (frame->xf_flags & (XPC_FRAME_HELLO | XPC_FRAME_BATCH))) {
+		debugf("invalid frame in batch");
+		dec->xd_batch = NULL;
+		errno = EBADMSG;
 		return (-1);
 	}
 
-	*id = header->id;
+	dec->xd_batch = frame->xf_body + frame->xf_length;
+	if (dec->xd_batch == dec->xd_batch_end)
+		dec->xd_batch = NULL;
 
-	debugf("length=%ld", header->length);
+	return ((int)(frame->xf_body + frame->xf_length - p));
+}
 
-	*result = xpc_unpack(buffer + sizeof(*header), header->length);
+/*
+ * Receives one frame into the decoder's buffer. The frame points into
+ * the decoder until the next call; hello frames carry no message, only
+ * xf_features and xf_dict. Compressed bodies are inflated into a buffer
+ * the decoder keeps for them. Batch frames are split up, one message per
+ * call, with the sender and credentials of the batch. More frames may be
+ * left in the decoder afterwards, in a batch or from a stream read;
+ * xpc_pipe_pending() tells.
+ */
+int
+xpc_pipe_receive(xpc_port_t local, xpc_port_t *remote,
+    struct xpc_frame *frame, struct xpc_credentials *creds,
+    struct xpc_compression *xz, struct xpc_decoder *dec)
+{
+	struct xpc_transport *transport = xpc_get_transport();
+	const uint8_t *body;
+	uint64_t dict;
+	size_t size;
+	int ret;
 
-	if (*result == NULL)
-		return (-1);
+	if (dec->xd_batch != NULL) {
+		*remote = dec->xd_remote;
+		*creds = dec->xd_creds;
+		if ((ret = xpc_batch_next(dec, frame)) < 0)
+			return (-1);
+	} else {
+		ret = xpc_pipe_read(transport, local, remote, frame, creds,
+		    dec);
+		if (ret <= 0)
+			return (ret);
+
+		if (frame->xf_flags & XPC_FRAME_BATCH) {
+			if (frame->xf_flags != XPC_FRAME_BATCH ||
+			    frame->xf_length == 0) {
+				debugf("invalid batch frame");
+				errno = EBADMSG;
+				return (-1);
+			}
+
+			dec->xd_batch = frame->xf_body;
+			dec->xd_batch_end = frame->xf_body + frame->xf_length;
+			dec->xd_remote = *remote;
+			dec->xd_creds = *creds;
+			if ((ret = xpc_batch_next(dec, frame)) < 0)
+				return (-1);
+		}
+	}
+
+	debugf("length=%ld", frame->xf_length);
+
+	body = frame->xf_body;
+	if (frame->xf_flags & XPC_FRAME_HELLO) {
+		if (xpc_varint_decode(&body, body + frame->xf_length,
+		    &frame->xf_features) != 0)
+			return (-1);
+
+		/* Peers from before compression stop after their features */
+		if (xpc_varint_decode(&body, frame->xf_body +
+		    frame->xf_length, &dict) == 0)
+			frame->xf_dict = (uint32_t)dict;
+	}
+
+	if (frame->xf_flags & XPC_FRAME_COMPRESSED) {
+		if (xpc_decompress(xz, frame->xf_body, frame->xf_length,
+		    &dec->xd_inflated, &dec->xd_inflated_size, &size) != 0) {
+			debugf("cannot inflate frame: %s", strerror(errno));
+			return (-1);
+		}
+
+		frame->xf_body = dec->xd_inflated;
+		frame->xf_length = size;
+		frame->xf_flags &= ~XPC_FRAME_COMPRESSED;
+	}
 
-	free(buffer);
 	return (ret);
 }
+
+xpc_object_t
+xpc_pipe_decode(const struct xpc_frame *frame, struct xpc_schema *schema,
+    struct xpc_key_table *keys, struct xpc_decoder *dec)
+{
+	struct xpc_object *xo;
+	const uint8_t *body, *end;
+
+	body = frame->xf_body;
+	end = body + frame->xf_length;
+	if ((frame->xf_flags & XPC_FRAME_KEYS) &&
+	    (keys == NULL || xpc_keys_learn(keys, &body, end) != 0)) {
+		debugf("invalid key definitions");
+		errno = EBADMSG;
+		return (NULL);
+	}
+
+	/* Remembered for xpc_dictionary_create_reply() */
+	if ((xo = xpc_unpack(body, end - body, schema, keys, dec)) != NULL) {
+		xo->xo_flags |= _XPC_FROM_WIRE;
+		xo->xo_id = frame->xf_id;
+	}
+
+	return (xo);
+}
@@ -0,0 +1,636 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <machine/atomic.h>
+#include "xpc/xpc.h"
+#include "xpc_internal.h"
+
+__private_extern__ uint32_t
+xpc_hamt_hash(const char *key)
+{
+
+	return ((uint32_t)xpc_hash_bytes(key, strlen(key), 0));
+}
+
+static struct xpc_hamt_leaf *
+xpc_hamt_leaf_create(const char *key, uint32_t hash, xpc_object_t value)
+{
+	struct xpc_hamt_leaf *leaf;
+	size_t len;
+
+	len = strlen(key);
+	if ((leaf = malloc(sizeof(*leaf) + len + 1)) == NULL)
+		return (NULL);
+
+	leaf->hl_refcnt = 1;
+	leaf->hl_hash = hash;
+	leaf->hl_value = value;
+	memcpy(leaf->hl_key, key, len + 1);
+	xpc_retain(value);
+	return (leaf);
+}
+
+static void
+xpc_hamt_leaf_release(struct xpc_hamt_leaf *leaf)
+{
+
+	if (atomic_fetchadd_int(&leaf->hl_refcnt, -1) > 1)
+		return;
+
+	xpc_release(leaf->hl_value);
+	free(leaf);
+}
+
+static struct xpc_hamt_node *
+xpc_hamt_node_alloc(uint32_t bitmap, size_t count, uint16_t flags)
+{
+	struct xpc_hamt_node *node;
+
+	node = malloc(sizeof(*node) + count * sizeof(struct xpc_hamt_slot));
+	if (node == NULL)
+		return (NULL);
+
+	node->hn_refcnt = 1;
+	node->hn_bitmap = bitmap;
+	node->hn_count = count;
+	node->hn_flags = flags;
+	return (node);
+}
+
+static void
+xpc_hamt_slot_retain(struct xpc_hamt_slot *slot)
+{
+
+	if (slot->hs_is_node)
+		atomic_add_int(&slot->hs_node->hn_refcnt, 1);
+	else
+		atomic_add_int(&slot->hs_leaf->hl_refcnt, 1);
+}
+
+static void
+xpc_hamt_slot_release(struct xpc_hamt_slot *slot)
+{
+
+	if (slot->hs_is_node)
+		xpc_hamt_release(slot->hs_node);
+	else
+		xpc_hamt_leaf_release(slot->hs_leaf);
+}
+
+static void
+xpc_hamt_slot_set_leaf(struct xpc_hamt_slot *slot, struct xpc_hamt_leaf *leaf)
+{
+
+	slot->hs_is_node = false;
+	slot->hs_leaf = leaf;
+}
+
+static void
+xpc_hamt_slot_set_node(struct xpc_hamt_slot *slot, struct xpc_hamt_node *node)
+{
+
+	slot->hs_is_node = true;
+	slot->hs_node = node;
+}
+
+/*
+ * Copies a node, leaving a hole of one slot at index "gap" (or no hole
+ * if gap is -1) and skipping the slot at index "skip" (or none if skip
+ * is -1). Every slot carried over gains a reference.
+ */
+static struct xpc_hamt_node *
+xpc_hamt_node_copy(struct xpc_hamt_node *node, uint32_t bitmap, int gap,
+    int skip)
+{
+	struct xpc_hamt_node *copy;
+	size_t count;
+	int i, j;
+
+	count = node->hn_count + (gap >= 0 ? 1 : 0) - (skip >= 0 ? 1 : 0);
+	copy = xpc_hamt_node_alloc(bitmap, count, node->hn_flags);
+	if (copy == NULL)
+		return (NULL);
+
+	for (i = 0, j = 0; i < node->hn_count; i++) {
+		if (i == skip)
+			continue;
+
+		if (j == gap)
+			j++;
+
+		copy->hn_slots[j] = node->hn_slots[i];
+		xpc_hamt_slot_retain(&copy->hn_slots[j]);
+		j++;
+	}
+
+	return (copy);
+}
+
+/*
+ * Builds the subtree holding two leaves. The references to both move
+ * into it, or are dropped if it cannot be allocated.
+ */
+static struct xpc_hamt_node *
+xpc_hamt_merge(struct xpc_hamt_leaf *l1, struct xpc_hamt_leaf *l2, int shift)
+{
+	struct xpc_hamt_node *node, *child;
+	uint32_t idx1, idx2;
+
+	if (shift >= XPC_HAMT_HASH_BITS) {
+		node = xpc_hamt_node_alloc(0, 2, XPC_HAMT_COLLISION);
+		if (node == NULL)
+			goto fail;
+
+		xpc_hamt_slot_set_leaf(&node->hn_slots[0], l1);
+		xpc_hamt_slot_set_leaf(&node->hn_slots[1], l2);
+		return (node);
+	}
+
+	idx1 = (l1->hl_hash >> shift) & XPC_HAMT_MASK;
+	idx2 = (l2->hl_hash >> shift) & XPC_HAMT_MASK;
+
+	if (idx1 == idx2) {
+		child = xpc_hamt_merge(l1, l2, shift + XPC_HAMT_BITS);
+		if (child == NULL)
+			return (NULL);
+
+		node = xpc_hamt_node_alloc(1u << idx1, 1, 0);
+		if (node == NULL) {
+			xpc_hamt_release(child);
+			return (NULL);
+		}
+
+		xpc_hamt_slot_set_node(&node->hn_slots[0], child);
+		return (node);
+	}
+
+	node = xpc_hamt_node_alloc((1u << idx1) | (1u << idx2), 2, 0);
+	if (node == NULL)
+		goto fail;
+
+	xpc_hamt_slot_set_leaf(&node->hn_slots[idx1 < idx2 ? 0 : 1], l1);
+	xpc_hamt_slot_set_leaf(&node->hn_slots[idx1 < idx2 ? 1 : 0], l2);
+	return (node);
+
+fail:
+	xpc_hamt_leaf_release(l1);
+	xpc_hamt_leaf_release(l2);
+	return (NULL);
+}
+
+/*
+ * Returns a new version of the node with the leaf inserted. The old
+ * node is left untouched; unchanged subtrees are shared with it. The
+ * leaf's reference moves into the new node; if that cannot be allocated,
+ * the reference is dropped and NULL is returned.
+ */
+static struct xpc_hamt_node *
+xpc_hamt_insert(struct xpc_hamt_node *node, int shift,
+    struct xpc_hamt_leaf *leaf, bool *added)
+{
+	struct xpc_hamt_node *copy, *child;
+	struct xpc_hamt_slot *slot;
+	uint32_t bit;
+	int i, idx;
+
+	if (node->hn_flags & XPC_HAMT_COLLISION) {
+		for (i = 0; i < node->hn_count; i++) {
+			slot = &node->hn_slots[i];
+			if (!strcmp(slot->hs_leaf->hl_key, leaf->hl_key)) {
+				copy = xpc_hamt_node_copy(node, 0, -1, -1);
+				if (copy == NULL)
+					goto fail;
+
+				xpc_hamt_slot_release(&copy->hn_slots[i]);
+				xpc_hamt_slot_set_leaf(&copy->hn_slots[i], leaf);
+				return (copy);
+			}
+		}
+
+		copy = xpc_hamt_node_copy(node, 0, node->hn_count, -1);
+		if (copy == NULL)
+			goto fail;
+
+		xpc_hamt_slot_set_leaf(&copy->hn_slots[node->hn_count], leaf);
+		*added = true;
+		return (copy);
+	}
+
+	bit = 1u << ((leaf->hl_hash >> shift) & XPC_HAMT_MASK);
+	idx = __builtin_popcount(node->hn_bitmap & (bit - 1));
+
+	if ((node->hn_bitmap & bit) == 0) {
+		copy = xpc_hamt_node_copy(node, node->hn_bitmap | bit, idx, -1);
+		if (copy == NULL)
+			goto fail;
+
+		xpc_hamt_slot_set_leaf(&copy->hn_slots[idx], leaf);
+		*added = true;
+		return (copy);
+	}
+
+	slot = &node->hn_slots[idx];
+	if (slot->hs_is_node) {
+		child = xpc_hamt_insert(slot->hs_node, shift + XPC_HAMT_BITS,
+		    leaf, added);
+		if (child == NULL)
+			return (NULL);
+
+		copy = xpc_hamt_node_copy(node, node->hn_bitmap, -1, -1);
+		if (copy == NULL) {
+			xpc_hamt_release(child);
+			return (NULL);
+		}
+
+		xpc_hamt_slot_release(&copy->hn_slots[idx]);
+		xpc_hamt_slot_set_node(&copy->hn_slots[idx], child);
+		return (copy);
+	}
+
+	if (slot->hs_leaf->hl_hash == leaf->hl_hash &&
+	    !strcmp(slot->hs_leaf->hl_key, leaf->hl_key)) {
+		copy = xpc_hamt_node_copy(node, node->hn_bitmap, -1, -1);
+		if (copy == NULL)
+			goto fail;
+
+		xpc_hamt_slot_release(&copy->hn_slots[idx]);
+		xpc_hamt_slot_set_leaf(&copy->hn_slots[idx], leaf);
+		return (copy);
+	}
+
+	/* The existing leaf moves down, so the subtree needs its own reference */
+	atomic_add_int(&slot->hs_leaf->hl_refcnt, 1);
+	child = xpc_hamt_merge(slot->hs_leaf, leaf, shift + XPC_HAMT_BITS);
+	if (child == NULL)
+		return (NULL);
+
+	copy = xpc_hamt_node_copy(node, node->hn_bitmap, -1, -1);
+	if (copy == NULL) {
+		xpc_hamt_release(child);
+		return (NULL);
+	}
+
+	xpc_hamt_slot_release(&copy->hn_slots[idx]);
+	xpc_hamt_slot_set_node(&copy->hn_slots[idx], child);
+	*added = true;
+	return (copy);
+
+fail:
+	xpc_hamt_leaf_release(leaf);
+	return (NULL);
+}
+
+/*
+ * Returns a new version of the node without the given key, or NULL if
+ * the resulting node would be empty. If the key is not present, the
+ * original node is returned with an extra reference.
+ */
+static struct xpc_hamt_node *
+xpc_hamt_remove(struct xpc_hamt_node *node, int shift, uint32_t hash,
+    const char *key, bool *removed)
+{
+	struct xpc_hamt_node *copy, *child;
+	struct xpc_hamt_slot *slot;
+	struct xpc_hamt_leaf *leaf;
+	uint32_t bit;
+	int i, idx;
+
+	if (node->hn_flags & XPC_HAMT_COLLISION) {
+		for (i = 0; i < node->hn_count; i++) {
+			if (!strcmp(node->hn_slots[i].hs_leaf->hl_key, key)) {
+				*removed = true;
+				if (node->hn_count == 1)
+					return (NULL);
+
+				return (xpc_hamt_node_copy(node, 0, -1, i));
+			}
+		}
+
+		goto notfound;
+	}
+
+	bit = 1u << ((hash >> shift) & XPC_HAMT_MASK);
+	idx = __builtin_popcount(node->hn_bitmap & (bit - 1));
+
+	if ((node->hn_bitmap & bit) == 0)
+		goto notfound;
+
+	slot = &node->hn_slots[idx];
+	if (!slot->hs_is_node) {
+		if (slot->hs_leaf->hl_hash != hash ||
+		    strcmp(slot->hs_leaf->hl_key, key))
+			goto notfound;
+
+		child = NULL;
+	} else {
+		child = xpc_hamt_remove(slot->hs_node, shift + XPC_HAMT_BITS,
+		    hash, key, removed);
+		if (!*removed) {
+			xpc_hamt_release(child);
+			goto notfound;
+		}
+	}
+
+	*removed = true;
+	if (child == NULL) {
+		if (node->hn_count == 1)
+			return (NULL);
+
+		return (xpc_hamt_node_copy(node, node->hn_bitmap & ~bit, -1,
+		    idx));
+	}
+
+	copy = xpc_hamt_node_copy(node, node->hn_bitmap, -1, -1);
+	xpc_hamt_slot_release(&copy->hn_slots[idx]);
+
+	/* Pull a lone leaf back up so the trie stays as shallow as possible */
+	if (child->hn_count == 1 && !child->hn_slots[0].hs_is_node) {
+		leaf = child->hn_slots[0].hs_leaf;
+		atomic_add_int(&leaf->hl_refcnt, 1);
+		xpc_hamt_release(child);
+		xpc_hamt_slot_set_leaf(&copy->hn_slots[idx], leaf);
+	} else
+		xpc_hamt_slot_set_node(&copy->hn_slots[idx], child);
+
+	return (copy);
+
+notfound:
+	atomic_add_int(&node->hn_refcnt, 1);
+	return (node);
+}
+
+__private_extern__ void
+xpc_hamt_release(struct xpc_hamt_node *node)
+{
+	int i;
+
+	if (node == NULL)
+		return;
+
+	if (atomic_fetchadd_int(&node->hn_refcnt, -1) > 1)
+		return;
+
+	for (i = 0; i < node->hn_count; i++)
+		xpc_hamt_slot_release(&node->hn_slots[i]);
+
+	free(node);
+}
+
+__private_extern__ xpc_object_t
+xpc_hamt_lookup(struct xpc_hamt_node *node, const char *key)
+{
+
+	return (xpc_hamt_lookup_hash(node, key, xpc_hamt_hash(key)));
+}
+
+__private_extern__ xpc_object_t
+xpc_hamt_lookup_hash(struct xpc_hamt_node *node, const char *key,
+    uint32_t hash)
+{
+	struct xpc_hamt_slot *slot;
+	uint32_t bit;
+	int i, shift;
+
+	shift = 0;
+
+	while (node != NULL) {
+		if (node->hn_flags & XPC_HAMT_COLLISION) {
+			for (i = 0; i < node->hn_count; i++) {
+				slot = &node->hn_slots[i];
+				if (!strcmp(slot->hs_leaf->hl_key, key))
+					return (slot->hs_leaf->hl_value);
+			}
+
+			return (NULL);
+		}
+
+		bit = 1u << ((hash >> shift) & XPC_HAMT_MASK);
+		if ((node->hn_bitmap & bit) == 0)
+			return (NULL);
+
+		slot = &node->hn_slots[
+		    __builtin_popcount(node->hn_bitmap & (bit - 1))];
+		if (!slot->hs_is_node) {
+			if (slot->hs_leaf->hl_hash == hash &&
+			    !strcmp(slot->hs_leaf->hl_key, key))
+				return (slot->hs_leaf->hl_value);
+
+			return (NULL);
+		}
+
+		node = slot->hs_node;
+		shift += XPC_HAMT_BITS;
+	}
+
+	return (NULL);
+}
+
+__private_extern__ bool
+xpc_hamt_apply(struct xpc_hamt_node *root, xpc_dictionary_applier_t applier)
+{
+	struct xpc_hamt_node *stack[XPC_HAMT_MAX_DEPTH];
+	int index[XPC_HAMT_MAX_DEPTH];
+	struct xpc_hamt_slot *slot;
+	int depth;
+
+	if (root == NULL)
+		return (true);
+
+	depth = 0;
+	stack[0] = root;
+	index[0] = 0;
+
+	while (depth >= 0) {
+		if (index[depth] == stack[depth]->hn_count) {
+			depth--;
+			continue;
+		}
+
+		slot = &stack[depth]->hn_slots[index[depth]++];
+		if (slot->hs_is_node) {
+			depth++;
+			stack[depth] = slot->hs_node;
+			index[depth] = 0;
+			continue;
+		}
+
+		if (!applier(slot->hs_leaf->hl_key, slot->hs_leaf->hl_value))
+			return (false);
+	}
+
+	return (true);
+}
+
+static xpc_object_t
+xpc_pdictionary_wrap(struct xpc_hamt_node *root, size_t count)
+{
+	xpc_u val;
+
+	val.hamt = root;
+	return (_xpc_prim_create(_XPC_TYPE_PDICTIONARY, val, count));
+}
+
+static struct xpc_hamt_node *
+xpc_pdictionary_insert(struct xpc_hamt_node *root, const char *key,
+    xpc_object_t value, bool *added)
+{
+	struct xpc_hamt_node *node;
+	struct xpc_hamt_leaf *leaf;
+	uint32_t hash;
+
+	hash = xpc_hamt_hash(key);
+	if ((leaf = xpc_hamt_leaf_create(key, hash, value)) == NULL)
+		return (NULL);
+
+	if (root == NULL) {
+		node = xpc_hamt_node_alloc(1u << (hash & XPC_HAMT_MASK), 1, 0);
+		if (node == NULL) {
+			xpc_hamt_leaf_release(leaf);
+			return (NULL);
+		}
+
+		xpc_hamt_slot_set_leaf(&node->hn_slots[0], leaf);
+		*added = true;
+		return (node);
+	}
+
+	return (xpc_hamt_insert(root, 0, leaf, added));
+}
+
+xpc_object_t
+xpc_pdictionary_create(const char * const *keys, const xpc_object_t *values,
+    size_t count)
+{
+	struct xpc_hamt_node *root, *tmp;
+	size_t i, size;
+	bool added;
+
+	root = NULL;
+	size = 0;
+
+	for (i = 0; i < count; i++) {
+		if (values[i] == NULL)
+			continue;
+
+		added = false;
+		tmp = xpc_pdictionary_insert(root, keys[i], values[i], &added);
+		xpc_hamt_release(root);
+		if (tmp == NULL)
+			return (NULL);
+
+		root = tmp;
+		size += added;
+	}
+
+	return (xpc_pdictionary_wrap(root, size));
+}
+
+xpc_object_t
+xpc_pdictionary_create_from_dictionary(xpc_object_t xdict)
+{
+	struct xpc_object *xo;
+	__block struct xpc_hamt_node *root;
+	__block size_t size;
+	__block bool failed;
+
+	xo = xdict;
+	if (xo->xo_xpc_type == _XPC_TYPE_PDICTIONARY)
+		return (xpc_retain(xdict));
+
+	root = NULL;
+	size = 0;
+	failed = false;
+
+	xpc_dictionary_apply(xdict, ^(const char *k, xpc_object_t v) {
+		struct xpc_hamt_node *tmp;
+		bool added = false;
+
+		tmp = xpc_pdictionary_insert(root, k, v, &added);
+		xpc_hamt_release(root);
+		root = tmp;
+		size += added;
+		if (tmp == NULL)
+			failed = true;
+
+		return ((bool)!failed);
+	});
+
+	if (failed)
+		return (NULL);
+
+	return (xpc_pdictionary_wrap(root, size));
+}
+
+xpc_object_t
+xpc_pdictionary_set_value(xpc_object_t xpdict, const char *key,
+    xpc_object_t value)
+{
+	struct xpc_object *xo;
+	struct xpc_hamt_node *root;
+	bool added;
+
+	xo = xpdict;
+	if (xo->xo_xpc_type != _XPC_TYPE_PDICTIONARY)
+		return (NULL);
+
+	if (value == NULL)
+		return (xpc_pdictionary_remove_value(xpdict, key));
+
+	added = false;
+	root = xpc_pdictionary_insert(xo->xo_hamt, key, value, &added);
+	if (root == NULL)
+		return (NULL);
+
+	return (xpc_pdictionary_wrap(root, xo->xo_size + added));
+}
+
+xpc_object_t
+xpc_pdictionary_remove_value(xpc_object_t xpdict, const char *key)
+{
+	struct xpc_object *xo;
+	struct xpc_hamt_node *root;
+	bool removed;
+
+	xo = xpdict;
+	if (xo->xo_xpc_type != _XPC_TYPE_PDICTIONARY)
+		return (NULL);
+
+	if (xo->xo_hamt == NULL)
+		return (xpc_retain(xpdict));
+
+	removed = false;
+	root = xpc_hamt_remove(xo->xo_hamt, 0, xpc_hamt_hash(key), key,
+	    &removed);
+
+	if (!removed) {
+		xpc_hamt_release(root);
+		return (xpc_retain(xpdict));
+	}
+
+	return (xpc_pdictionary_wrap(root, xo->xo_size - 1));
+}
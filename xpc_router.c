@@ -0,0 +1,322 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <machine/atomic.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <Block.h>
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+
+#define	XPC_ROUTER_DEFAULT_KEY	"method"
+#define	XPC_ROUTER_MAX_SEEDS	1024
+
+struct xpc_route {
+	char *			xr_method;
+	uint32_t		xr_id;
+	xpc_router_handler_t	xr_handler;
+	volatile uint64_t	xr_calls;
+	volatile uint64_t	xr_nsec;	/* would wrap in 4s as a 32-bit u_long */
+	volatile uint64_t	xr_max_nsec;
+};
+
+/*
+ * Routes are kept in registration order. xr_slots is a perfect hash of
+ * their method IDs, rebuilt on every registration, holding index + 1 of
+ * the route that owns each slot or 0.
+ */
+struct xpc_router {
+	char *			xr_key;
+	xpc_router_handler_t	xr_default;
+	struct xpc_route *	xr_routes;
+	size_t			xr_nroutes;
+	uint32_t *		xr_slots;
+	uint32_t		xr_mask;
+	uint32_t		xr_seed;
+};
+
+uint32_t
+xpc_router_get_method_id(const char *method)
+{
+	uint32_t id;
+
+	id = (uint32_t)xpc_hash_bytes(method, strlen(method), 0);
+	return (id != 0 ? id : 1);
+}
+
+static inline uint32_t
+xpc_router_slot(uint32_t id, uint32_t seed, uint32_t mask)
+{
+	uint32_t h;
+
+	h = (id ^ seed) * 0x9e3779b1;
+	h ^= h >> 16;
+	return (h & mask);
+}
+
+static int
+xpc_router_build(struct xpc_router *router, size_t nroutes)
+{
+	uint32_t *slots, mask, seed, slot;
+	size_t size, i;
+
+	for (size = 8; size < nroutes * 2; size *= 2)
+		;
+
+	for (;;) {
+		if ((slots = malloc(size * sizeof(*slots))) == NULL)
+			return (-1);
+
+		mask = (uint32_t)size - 1;
+		for (seed = 0; seed < XPC_ROUTER_MAX_SEEDS; seed++) {
+			memset(slots, 0, size * sizeof(*slots));
+			for (i = 0; i < nroutes; i++) {
+				slot = xpc_router_slot(router->xr_routes[i].xr_id,
+				    seed, mask);
+				if (slots[slot] != 0)
+					break;
+
+				slots[slot] = i + 1;
+			}
+
+			if (i == nroutes) {
+				free(router->xr_slots);
+				router->xr_slots = slots;
+				router->xr_mask = mask;
+				router->xr_seed = seed;
+				return (0);
+			}
+		}
+
+		free(slots);
+		size *= 2;
+	}
+}
+
+xpc_router_t
+xpc_router_create(const char *key)
+{
+	struct xpc_router *router;
+
+	if ((router = calloc(1, sizeof(*router))) == NULL)
+		return (NULL);
+
+	router->xr_key = strdup(key != NULL ? key : XPC_ROUTER_DEFAULT_KEY);
+	if (router->xr_key == NULL || xpc_router_build(router, 0) != 0) {
+		xpc_router_free(router);
+		return (NULL);
+	}
+
+	return (router);
+}
+
+void
+xpc_router_free(xpc_router_t router)
+{
+	size_t i;
+
+	for (i = 0; i < router->xr_nroutes; i++) {
+		free(router->xr_routes[i].xr_method);
+		Block_release(router->xr_routes[i].xr_handler);
+	}
+
+	if (router->xr_default != NULL)
+		Block_release(router->xr_default);
+
+	free(router->xr_routes);
+	free(router->xr_slots);
+	free(router->xr_key);
+	free(router);
+}
+
+int
+xpc_router_register(xpc_router_t router, const char *method,
+    xpc_router_handler_t handler)
+{
+	struct xpc_route *routes, *route;
+	uint32_t id;
+	size_t i;
+
+	id = xpc_router_get_method_id(method);
+	for (i = 0; i < router->xr_nroutes; i++) {
+		if (router->xr_routes[i].xr_id == id) {
+			debugf("method \"%s\" collides with \"%s\"", method,
+			    router->xr_routes[i].xr_method);
+			errno = EEXIST;
+			return (-1);
+		}
+	}
+
+	routes = realloc(router->xr_routes,
+	    (router->xr_nroutes + 1) * sizeof(*routes));
+	if (routes == NULL)
+		return (-1);
+
+	router->xr_routes = routes;
+	route = &routes[router->xr_nroutes];
+	memset(route, 0, sizeof(*route));
+	route->xr_id = id;
+	if ((route->xr_method = strdup(method)) == NULL)
+		return (-1);
+
+	if (xpc_router_build(router, router->xr_nroutes + 1) != 0) {
+		free(route->xr_method);
+		return (-1);
+	}
+
+	route->xr_handler = (xpc_router_handler_t)Block_copy(handler);
+	router->xr_nroutes++;
+	return (0);
+}
+
+void
+xpc_router_set_default_handler(xpc_router_t router,
+    xpc_router_handler_t handler)
+{
+
+	if (router->xr_default != NULL)
+		Block_release(router->xr_default);
+
+	router->xr_default = handler != NULL ?
+	    (xpc_router_handler_t)Block_copy(handler) : NULL;
+}
+
+static struct xpc_route *
+xpc_router_lookup_id(struct xpc_router *router, uint32_t id)
+{
+	uint32_t idx;
+
+	idx = router->xr_slots[xpc_router_slot(id, router->xr_seed,
+	    router->xr_mask)];
+	if (idx == 0 || router->xr_routes[idx - 1].xr_id != id)
+		return (NULL);
+
+	return (&router->xr_routes[idx - 1]);
+}
+
+static struct xpc_route *
+xpc_router_lookup(struct xpc_router *router, xpc_object_t message,
+    uint32_t id)
+{
+	struct xpc_route *route;
+	const char *method;
+
+	/* The sender stamped the frame; no need to look at the body */
+	if (id != 0 && (route = xpc_router_lookup_id(router, id)) != NULL)
+		return (route);
+
+	if (xpc_get_type(message) != XPC_TYPE_DICTIONARY)
+		return (NULL);
+
+	method = xpc_dictionary_get_string(message, router->xr_key);
+	if (method == NULL)
+		return (NULL);
+
+	route = xpc_router_lookup_id(router, xpc_router_get_method_id(method));
+	if (route == NULL || strcmp(route->xr_method, method) != 0)
+		return (NULL);
+
+	return (route);
+}
+
+static uint64_t
+xpc_router_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+xpc_router_account(struct xpc_route *route, uint64_t nsec)
+{
+	uint64_t max;
+
+	atomic_add_64(&route->xr_calls, 1);
+	atomic_add_64(&route->xr_nsec, nsec);
+	do {
+		max = atomic_load_acq_64(&route->xr_max_nsec);
+		if (nsec <= max)
+			break;
+	} while (!atomic_cmpset_64(&route->xr_max_nsec, max, nsec));
+}
+
+__private_extern__ bool
+xpc_router_dispatch(struct xpc_router *router, struct xpc_connection *conn,
+    xpc_object_t message, uint32_t id)
+{
+	struct xpc_route *route;
+
+	route = xpc_router_lookup(router, message, id);
+	if (route == NULL) {
+		if (router->xr_default == NULL)
+			return (false);
+
+		xpc_connection_deliver_message(conn, ^{
+			router->xr_default((xpc_connection_t)conn, message);
+		});
+		return (true);
+	}
+
+	xpc_connection_deliver_message(conn, ^{
+		uint64_t start;
+
+		start = xpc_router_now();
+		route->xr_handler((xpc_connection_t)conn, message);
+		xpc_router_account(route, xpc_router_now() - start);
+	});
+	return (true);
+}
+
+xpc_object_t
+xpc_router_copy_statistics(xpc_router_t router)
+{
+	struct xpc_route *route;
+	xpc_object_t result, stats;
+	size_t i;
+
+	result = xpc_dictionary_create(NULL, NULL, 0);
+	for (i = 0; i < router->xr_nroutes; i++) {
+		route = &router->xr_routes[i];
+		stats = xpc_dictionary_create(NULL, NULL, 0);
+		xpc_dictionary_set_uint64(stats, "id", route->xr_id);
+		xpc_dictionary_set_uint64(stats, "calls",
+		    atomic_load_acq_64(&route->xr_calls));
+		xpc_dictionary_set_uint64(stats, "total_nsec",
+		    atomic_load_acq_64(&route->xr_nsec));
+		xpc_dictionary_set_uint64(stats, "max_nsec",
+		    atomic_load_acq_64(&route->xr_max_nsec));
+		xpc_dictionary_set_value(result, route->xr_method, stats);
+		xpc_release(stats);
+	}
+
+	return (result);
+}
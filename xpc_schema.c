@@ -0,0 +1,696 @@
+/*
+ * Copyright 2014-2015 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xpc/xpc.h>
+#include "xpc_internal.h"
+#include "mpack.h"
+
+#define	XPC_SCHEMA_MAX_FIELDS	256
+
+enum xpc_schema_type {
+	XPC_SCHEMA_ANY,
+	XPC_SCHEMA_BOOL,
+	XPC_SCHEMA_INT64,
+	XPC_SCHEMA_UINT64,
+	XPC_SCHEMA_DOUBLE,
+	XPC_SCHEMA_DATE,
+	XPC_SCHEMA_STRING,
+	XPC_SCHEMA_DATA,
+	XPC_SCHEMA_DICTIONARY,
+	XPC_SCHEMA_ARRAY
+};
+
+static const char *xpc_schema_typenames[] = {
+	[XPC_SCHEMA_ANY] = "any",
+	[XPC_SCHEMA_BOOL] = "bool",
+	[XPC_SCHEMA_INT64] = "int64",
+	[XPC_SCHEMA_UINT64] = "uint64",
+	[XPC_SCHEMA_DOUBLE] = "double",
+	[XPC_SCHEMA_DATE] = "date",
+	[XPC_SCHEMA_STRING] = "string",
+	[XPC_SCHEMA_DATA] = "data",
+	[XPC_SCHEMA_DICTIONARY] = "dictionary",
+	[XPC_SCHEMA_ARRAY] = "array"
+};
+
+struct xpc_schema_field {
+	char *			sf_key;
+	size_t			sf_keylen;
+	int			sf_type;
+	bool			sf_required;
+	int			sf_slot;
+	ssize_t			sf_offset;	/* -1 when not bound */
+	struct xpc_schema *	sf_nested;
+};
+
+/*
+ * Fields get slot numbers in description order, with the fields of a
+ * nested dictionary numbered right after the field holding it.
+ */
+struct xpc_schema {
+	size_t			xs_nslots;
+	size_t			xs_nfields;
+	struct xpc_schema_field	xs_fields[];
+};
+
+static struct xpc_schema *xpc_schema_compile(xpc_object_t description,
+    int *nslots);
+
+static int
+xpc_schema_parse_field(struct xpc_schema_field *field, const char *key,
+    xpc_object_t spec, int *nslots)
+{
+	const char *name;
+	size_t len;
+	int i;
+
+	field->sf_key = strdup(key);
+	field->sf_keylen = strlen(key);
+	field->sf_required = true;
+	field->sf_slot = (*nslots)++;
+	field->sf_offset = -1;
+	field->sf_nested = NULL;
+
+	if (xpc_get_type(spec) == XPC_TYPE_DICTIONARY) {
+		field->sf_type = XPC_SCHEMA_DICTIONARY;
+		field->sf_nested = xpc_schema_compile(spec, nslots);
+		return (field->sf_nested == NULL ? -1 : 0);
+	}
+
+	if (xpc_get_type(spec) != XPC_TYPE_STRING)
+		return (-1);
+
+	name = xpc_string_get_string_ptr(spec);
+	len = strlen(name);
+	if (len > 0 && name[len - 1] == '?') {
+		field->sf_required = false;
+		len--;
+	}
+
+	for (i = 0; i <= XPC_SCHEMA_ARRAY; i++) {
+		if (strlen(xpc_schema_typenames[i]) == len &&
+		    strncmp(xpc_schema_typenames[i], name, len) == 0) {
+			field->sf_type = i;
+			return (0);
+		}
+	}
+
+	debugf("unknown schema type \"%s\" for key \"%s\"", name, key);
+	return (-1);
+}
+
+static struct xpc_schema *
+xpc_schema_compile(xpc_object_t description, int *nslots)
+{
+	struct xpc_schema *schema;
+	xpc_iterator_t iter;
+	size_t count;
+	int ret;
+
+	count = xpc_dictionary_get_count(description);
+	if (count > XPC_SCHEMA_MAX_FIELDS)
+		return (NULL);
+
+	schema = calloc(1, sizeof(*schema) +
+	    count * sizeof(schema->xs_fields[0]));
+	if (schema == NULL)
+		return (NULL);
+
+	ret = 0;
+	xpc_iterator_begin(&iter, description);
+	while (ret == 0 && xpc_iterator_next(&iter)) {
+		ret = xpc_schema_parse_field(
+		    &schema->xs_fields[schema->xs_nfields++], iter.key,
+		    iter.value, nslots);
+	}
+	xpc_iterator_end(&iter);
+
+	if (ret != 0) {
+		xpc_schema_free(schema);
+		return (NULL);
+	}
+
+	return (schema);
+}
+
+xpc_schema_t
+xpc_schema_create(xpc_object_t description)
+{
+	struct xpc_schema *schema;
+	int nslots;
+
+	if (xpc_get_type(description) != XPC_TYPE_DICTIONARY)
+		return (NULL);
+
+	nslots = 0;
+	if ((schema = xpc_schema_compile(description, &nslots)) == NULL)
+		return (NULL);
+
+	schema->xs_nslots = nslots;
+	return (schema);
+}
+
+void
+xpc_schema_free(xpc_schema_t schema)
+{
+	size_t i;
+
+	for (i = 0; i < schema->xs_nfields; i++) {
+		free(schema->xs_fields[i].sf_key);
+		if (schema->xs_fields[i].sf_nested != NULL)
+			xpc_schema_free(schema->xs_fields[i].sf_nested);
+	}
+
+	free(schema);
+}
+
+size_t
+xpc_schema_get_slot_count(xpc_schema_t schema)
+{
+
+	return (schema->xs_nslots);
+}
+
+static struct xpc_schema_field *
+xpc_schema_find(struct xpc_schema *schema, const char *key, size_t keylen,
+    size_t hint)
+{
+	struct xpc_schema_field *field;
+	size_t i;
+
+	/* Senders usually encode keys in the order the schema lists them */
+	if (hint < schema->xs_nfields) {
+		field = &schema->xs_fields[hint];
+		if (field->sf_keylen == keylen &&
+		    memcmp(field->sf_key, key, keylen) == 0)
+			return (field);
+	}
+
+	for (i = 0; i < schema->xs_nfields; i++) {
+		field = &schema->xs_fields[i];
+		if (field->sf_keylen == keylen &&
+		    memcmp(field->sf_key, key, keylen) == 0)
+			return (field);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Resolves a dotted key such as "hdr.route" to the field it names.
+ */
+static struct xpc_schema_field *
+xpc_schema_lookup(struct xpc_schema *schema, const char *key)
+{
+	struct xpc_schema_field *field;
+	const char *dot;
+
+	for (;;) {
+		dot = strchr(key, '.');
+		field = xpc_schema_find(schema, key,
+		    dot == NULL ? strlen(key) : (size_t)(dot - key), 0);
+		if (field == NULL || dot == NULL)
+			return (field);
+
+		if ((schema = field->sf_nested) == NULL)
+			return (NULL);
+
+		key = dot + 1;
+	}
+}
+
+int
+xpc_schema_get_slot(xpc_schema_t schema, const char *key)
+{
+	struct xpc_schema_field *field;
+
+	if ((field = xpc_schema_lookup(schema, key)) == NULL)
+		return (-1);
+
+	return (field->sf_slot);
+}
+
+int
+xpc_schema_bind(xpc_schema_t schema, const char *key, size_t offset)
+{
+	struct xpc_schema_field *field;
+
+	if ((field = xpc_schema_lookup(schema, key)) == NULL) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	field->sf_offset = offset;
+	return (0);
+}
+
+static bool
+xpc_schema_match_object(struct xpc_schema_field *field, xpc_object_t xo)
+{
+	xpc_type_t type;
+
+	type = xpc_get_type(xo);
+	switch (field->sf_type) {
+	case XPC_SCHEMA_ANY:
+		return (true);
+
+	case XPC_SCHEMA_BOOL:
+		return (type == XPC_TYPE_BOOL);
+
+	case XPC_SCHEMA_INT64:
+		return (type == XPC_TYPE_INT64 || (type == XPC_TYPE_UINT64 &&
+		    xpc_uint64_get_value(xo) <= INT64_MAX));
+
+	case XPC_SCHEMA_UINT64:
+		return (type == XPC_TYPE_UINT64 || (type == XPC_TYPE_INT64 &&
+		    xpc_int64_get_value(xo) >= 0));
+
+	case XPC_SCHEMA_DOUBLE:
+		return (type == XPC_TYPE_DOUBLE || type == XPC_TYPE_INT64 ||
+		    type == XPC_TYPE_UINT64);
+
+	case XPC_SCHEMA_DATE:
+		return (type == XPC_TYPE_DATE || type == XPC_TYPE_INT64);
+
+	case XPC_SCHEMA_STRING:
+		return (type == XPC_TYPE_STRING);
+
+	case XPC_SCHEMA_DATA:
+		return (type == XPC_TYPE_DATA);
+
+	case XPC_SCHEMA_DICTIONARY:
+		if (type != XPC_TYPE_DICTIONARY)
+			return (false);
+
+		return (field->sf_nested == NULL ||
+		    xpc_schema_validate(field->sf_nested, xo));
+
+	case XPC_SCHEMA_ARRAY:
+		return (type == XPC_TYPE_ARRAY);
+	}
+
+	return (false);
+}
+
+bool
+xpc_schema_validate(xpc_schema_t schema, xpc_object_t xdict)
+{
+	struct xpc_schema_field *field;
+	xpc_object_t value;
+	size_t i;
+
+	if (xpc_get_type(xdict) != XPC_TYPE_DICTIONARY)
+		return (false);
+
+	for (i = 0; i < schema->xs_nfields; i++) {
+		field = &schema->xs_fields[i];
+		value = xpc_dictionary_get_value(xdict, field->sf_key);
+		if (value == NULL) {
+			if (field->sf_required)
+				return (false);
+
+			continue;
+		}
+
+		if (!xpc_schema_match_object(field, value))
+			return (false);
+	}
+
+	return (true);
+}
+
+
+static size_t
+xpc_schema_ctype_size(int type)
+{
+
+	switch (type) {
+	case XPC_SCHEMA_BOOL:
+		return (sizeof(bool));
+
+	case XPC_SCHEMA_INT64:
+	case XPC_SCHEMA_DATE:
+		return (sizeof(int64_t));
+
+	case XPC_SCHEMA_UINT64:
+		return (sizeof(uint64_t));
+
+	case XPC_SCHEMA_DOUBLE:
+		return (sizeof(double));
+
+	case XPC_SCHEMA_STRING:
+		return (sizeof(char *));
+
+	case XPC_SCHEMA_DATA:
+		return (sizeof(struct xpc_schema_bytes));
+	}
+
+	return (sizeof(xpc_object_t));
+}
+
+static bool xpc_schema_decode_node(struct xpc_schema *schema,
+    mpack_node_t node, xpc_schema_value_t *slots, char *base,
+    const struct xpc_key_table *keys);
+
+static bool
+xpc_schema_check_node(struct xpc_schema_field *field, mpack_node_t node)
+{
+	mpack_type_t type;
+
+	type = mpack_node_type(node);
+	switch (field->sf_type) {
+	case XPC_SCHEMA_ANY:
+		return (true);
+
+	case XPC_SCHEMA_BOOL:
+		return (type == mpack_type_bool);
+
+	case XPC_SCHEMA_INT64:
+	case XPC_SCHEMA_DATE:
+		return (type == mpack_type_int || (type == mpack_type_uint &&
+		    mpack_node_u64(node) <= INT64_MAX));
+
+	case XPC_SCHEMA_UINT64:
+		return (type == mpack_type_uint || (type == mpack_type_int &&
+		    mpack_node_i64(node) >= 0));
+
+	case XPC_SCHEMA_DOUBLE:
+		return (type == mpack_type_double || type == mpack_type_float ||
+		    type == mpack_type_int || type == mpack_type_uint);
+
+	case XPC_SCHEMA_STRING:
+		return (type == mpack_type_str);
+
+	case XPC_SCHEMA_DATA:
+		return (type == mpack_type_bin);
+
+	case XPC_SCHEMA_DICTIONARY:
+		return (type == mpack_type_map);
+
+	case XPC_SCHEMA_ARRAY:
+		return (type == mpack_type_array || type == mpack_type_ext);
+	}
+
+	return (false);
+}
+
+/*
+ * Stores a value that already passed xpc_schema_check_node().  A field
+ * bound with xpc_schema_bind() owns what it decodes; otherwise the slot
+ * does.  With neither, nothing is allocated.
+ */
+static bool
+xpc_schema_store(struct xpc_schema_field *field, mpack_node_t node,
+    xpc_schema_value_t *slots, char *base, const struct xpc_key_table *keys)
+{
+	xpc_schema_value_t val;
+	size_t len;
+
+	if (field->sf_nested != NULL) {
+		if (!xpc_schema_decode_node(field->sf_nested, node, slots,
+		    base, keys))
+			return (false);
+
+		if (slots != NULL)
+			slots[field->sf_slot].present = true;
+
+		return (true);
+	}
+
+	if (slots == NULL && (base == NULL || field->sf_offset < 0))
+		return (true);
+
+	memset(&val, 0, sizeof(val));
+	val.present = true;
+
+	switch (field->sf_type) {
+	case XPC_SCHEMA_BOOL:
+		val.v.b = mpack_node_bool(node);
+		break;
+
+	case XPC_SCHEMA_INT64:
+	case XPC_SCHEMA_DATE:
+		val.v.i = mpack_node_i64(node);
+		break;
+
+	case XPC_SCHEMA_UINT64:
+		val.v.u = mpack_node_u64(node);
+		break;
+
+	case XPC_SCHEMA_DOUBLE:
+		val.v.d = mpack_node_double(node);
+		break;
+
+	case XPC_SCHEMA_STRING:
+	case XPC_SCHEMA_DATA:
+		len = mpack_node_data_len(node);
+		if ((val.v.bytes.ptr = malloc(len + 1)) == NULL)
+			return (false);
+
+		memcpy(val.v.bytes.ptr, mpack_node_data(node), len);
+		((char *)val.v.bytes.ptr)[len] = '\0';
+		val.v.bytes.length = len;
+		break;
+
+	default:
+		if ((val.v.object = mpack2xpc(node, keys)) == NULL)
+			return (false);
+		break;
+	}
+
+	if (slots != NULL)
+		slots[field->sf_slot] = val;
+
+	if (base == NULL || field->sf_offset < 0)
+		return (true);
+
+	/* Every union member starts at the same address */
+	memcpy(base + field->sf_offset, &val.v,
+	    xpc_schema_ctype_size(field->sf_type));
+	return (true);
+}
+
+static bool
+xpc_schema_decode_node(struct xpc_schema *schema, mpack_node_t node,
+    xpc_schema_value_t *slots, char *base, const struct xpc_key_table *keys)
+{
+	struct xpc_schema_field *field;
+	const struct xpc_key *xk;
+	mpack_node_t key;
+	uint8_t seen[XPC_SCHEMA_MAX_FIELDS / 8];
+	size_t i, idx, count;
+
+	if (mpack_node_type(node) != mpack_type_map)
+		return (false);
+
+	memset(seen, 0, sizeof(seen));
+	count = mpack_node_map_count(node);
+	for (i = 0; i < count; i++) {
+		key = mpack_node_map_key_at(node, i);
+		if (mpack_node_type(key) == mpack_type_str)
+			field = xpc_schema_find(schema, mpack_node_data(key),
+			    mpack_node_data_len(key), i);
+		else if ((xk = xpc_keys_get(keys, key)) != NULL)
+			field = xpc_schema_find(schema, xk->xk_key,
+			    xk->xk_length, i);
+		else
+			return (false);
+
+		if (field == NULL)
+			continue;
+
+		idx = field - schema->xs_fields;
+		if (seen[idx / 8] & (1 << (idx % 8))) {
+			debugf("duplicate key \"%s\"", field->sf_key);
+			return (false);
+		}
+
+		seen[idx / 8] |= 1 << (idx % 8);
+		if (!xpc_schema_check_node(field,
+		    mpack_node_map_value_at(node, i))) {
+			debugf("key \"%s\" is not of type %s", field->sf_key,
+			    xpc_schema_typenames[field->sf_type]);
+			return (false);
+		}
+
+		if (!xpc_schema_store(field, mpack_node_map_value_at(node, i),
+		    slots, base, keys))
+			return (false);
+	}
+
+	for (idx = 0; idx < schema->xs_nfields; idx++) {
+		if (schema->xs_fields[idx].sf_required &&
+		    !(seen[idx / 8] & (1 << (idx % 8)))) {
+			debugf("missing required key \"%s\"",
+			    schema->xs_fields[idx].sf_key);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+__private_extern__ bool
+xpc_schema_check_tree(struct xpc_schema *schema, mpack_node_t root,
+    const struct xpc_key_table *keys)
+{
+
+	return (xpc_schema_decode_node(schema, root, NULL, NULL, keys));
+}
+
+static void
+xpc_schema_zero_bound(struct xpc_schema *schema, char *base)
+{
+	struct xpc_schema_field *field;
+	size_t i;
+
+	for (i = 0; i < schema->xs_nfields; i++) {
+		field = &schema->xs_fields[i];
+		if (field->sf_nested != NULL)
+			xpc_schema_zero_bound(field->sf_nested, base);
+		else if (field->sf_offset >= 0)
+			memset(base + field->sf_offset, 0,
+			    xpc_schema_ctype_size(field->sf_type));
+	}
+}
+
+static void
+xpc_schema_clear_level(struct xpc_schema *schema, xpc_schema_value_t *slots,
+    char *base)
+{
+	struct xpc_schema_field *field;
+	xpc_schema_value_t *slot;
+	struct xpc_schema_bytes *bytes;
+	xpc_object_t *object;
+	char **str;
+	size_t i;
+
+	for (i = 0; i < schema->xs_nfields; i++) {
+		field = &schema->xs_fields[i];
+		if (field->sf_nested != NULL) {
+			xpc_schema_clear_level(field->sf_nested, slots, base);
+			if (slots != NULL)
+				memset(&slots[field->sf_slot], 0,
+				    sizeof(*slots));
+			continue;
+		}
+
+		if (base != NULL && field->sf_offset >= 0) {
+			switch (field->sf_type) {
+			case XPC_SCHEMA_STRING:
+				str = (char **)(void *)(base + field->sf_offset);
+				free(*str);
+				*str = NULL;
+				break;
+
+			case XPC_SCHEMA_DATA:
+				bytes = (struct xpc_schema_bytes *)(void *)
+				    (base + field->sf_offset);
+				free(bytes->ptr);
+				memset(bytes, 0, sizeof(*bytes));
+				break;
+
+			case XPC_SCHEMA_DICTIONARY:
+			case XPC_SCHEMA_ARRAY:
+			case XPC_SCHEMA_ANY:
+				object = (xpc_object_t *)(void *)
+				    (base + field->sf_offset);
+				if (*object != NULL)
+					xpc_release(*object);
+				*object = NULL;
+				break;
+
+			default:
+				memset(base + field->sf_offset, 0,
+				    xpc_schema_ctype_size(field->sf_type));
+				break;
+			}
+
+			/* The struct owned it; the slot only has a copy */
+			if (slots != NULL)
+				memset(&slots[field->sf_slot], 0,
+				    sizeof(*slots));
+			continue;
+		}
+
+		if (slots == NULL)
+			continue;
+
+		slot = &slots[field->sf_slot];
+		if (slot->present) {
+			if (field->sf_type == XPC_SCHEMA_STRING ||
+			    field->sf_type == XPC_SCHEMA_DATA)
+				free(slot->v.bytes.ptr);
+			else if (field->sf_type >= XPC_SCHEMA_DICTIONARY ||
+			    field->sf_type == XPC_SCHEMA_ANY)
+				xpc_release(slot->v.object);
+		}
+
+		memset(slot, 0, sizeof(*slot));
+	}
+}
+
+void
+xpc_schema_values_clear(xpc_schema_t schema, xpc_schema_value_t *slots,
+    void *base)
+{
+
+	xpc_schema_clear_level(schema, slots, base);
+}
+
+int
+xpc_schema_decode(xpc_schema_t schema, const void *buf, size_t size,
+    xpc_schema_value_t *slots, void *base)
+{
+	mpack_tree_t tree;
+	bool ok;
+
+	if (slots != NULL)
+		memset(slots, 0, schema->xs_nslots * sizeof(*slots));
+
+	/* Zero bound fields so a failed decode leaves nothing to free */
+	if (base != NULL)
+		xpc_schema_zero_bound(schema, base);
+
+	mpack_tree_init(&tree, (const char *)buf, size);
+	ok = mpack_tree_error(&tree) == mpack_ok &&
+	    xpc_schema_decode_node(schema, mpack_tree_root(&tree), slots,
+	    base, NULL) && mpack_tree_error(&tree) == mpack_ok;
+	mpack_tree_destroy(&tree);
+
+	if (!ok) {
+		xpc_schema_values_clear(schema, slots, base);
+		errno = EBADMSG;
+		return (-1);
+	}
+
+	return (0);
+}
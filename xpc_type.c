@@ -69,8 +69,6 @@ xs _xpc_error_connection_interrupted;
 xs _xpc_error_connection_invalid;
 xs _xpc_error_connection_imminent;
 
-static size_t xpc_data_hash(const uint8_t *data, size_t length);
-
 static xpc_type_t xpc_typemap[] = {
 	NULL,
 	XPC_TYPE_DICTIONARY,
@@ -89,7 +87,9 @@ static xpc_type_t xpc_typemap[] = {
 	XPC_TYPE_FD,
 	XPC_TYPE_SHMEM,
 	XPC_TYPE_ERROR,
-	XPC_TYPE_DOUBLE
+	XPC_TYPE_DOUBLE,
+	XPC_TYPE_DICTIONARY,
+	XPC_TYPE_ARRAY
 };
 
 static const char *xpc_typestr[] = {
@@ -110,7 +110,9 @@ static const char *xpc_typestr[] = {
 	"fd",
 	"shmem",
 	"error",
-	"double"
+	"double",
+	"persistent dictionary",
+	"typed array"
 };
 
 __private_extern__ struct xpc_object *
@@ -128,11 +130,22 @@ _xpc_prim_create_flags(int type, xpc_u value, size_t size, uint16_t flags)
 	if ((xo = malloc(sizeof(*xo))) == NULL)
 		return (NULL);
 
+	_xpc_prim_init(xo, type, value, size, flags);
+	return (xo);
+}
+
+__private_extern__ void
+_xpc_prim_init(struct xpc_object *xo, int type, xpc_u value, size_t size,
+    uint16_t flags)
+{
+
 	xo->xo_size = size;
+	xo->xo_hash = 0;
 	xo->xo_xpc_type = type;
 	xo->xo_flags = flags;
 	xo->xo_u = value;
 	xo->xo_refcnt = 1;
+	xo->xo_id = 0;
 #if MACH
 	xo->xo_audit_token = NULL;
 #endif
@@ -142,8 +155,6 @@ _xpc_prim_create_flags(int type, xpc_u value, size_t size, uint16_t flags)
 
 	if (type == _XPC_TYPE_ARRAY)
 		TAILQ_INIT(&xo->xo_array);
-
-	return (xo);
 }
 
 xpc_object_t
@@ -424,6 +435,143 @@ xpc_get_type(xpc_object_t obj)
 	return (xpc_typemap[xo->xo_xpc_type]);
 }
 
+static bool
+xpc_dictionary_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+	struct xpc_dict_pair *p1, *p2;
+	xpc_object_t v2;
+
+	if (xo1->xo_xpc_type != _XPC_TYPE_DICTIONARY ||
+	    xo2->xo_xpc_type != _XPC_TYPE_DICTIONARY) {
+		return (xpc_dictionary_apply(xo1, ^(const char *k, xpc_object_t v) {
+			xpc_object_t other = xpc_dictionary_get_value(xo2, k);
+			return ((bool)(other != NULL && xpc_equal(v, other)));
+		}));
+	}
+
+	/*
+	 * Dictionaries built by the same code tend to have the same key
+	 * order, so walk both lists in lockstep for as long as the keys
+	 * line up and only fall back to lookups for the rest.
+	 */
+	p2 = TAILQ_FIRST(&xo2->xo_dict);
+	TAILQ_FOREACH(p1, &xo1->xo_dict, xo_link) {
+		if (p2 == NULL || strcmp(p1->key, p2->key) != 0)
+			break;
+
+		if (!xpc_equal(p1->value, p2->value))
+			return (false);
+
+		p2 = TAILQ_NEXT(p2, xo_link);
+	}
+
+	for (; p1 != NULL; p1 = TAILQ_NEXT(p1, xo_link)) {
+		v2 = xpc_dictionary_get_value(xo2, p1->key);
+		if (v2 == NULL || !xpc_equal(p1->value, v2))
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool
+xpc_typed_array_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+	struct xpc_object *v1, *v2, *l1, *l2;
+	const double *d1, *d2;
+	const float *f1, *f2;
+	bool ret;
+	size_t i;
+
+	if (xo1->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY &&
+	    xo2->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY &&
+	    xo1->xo_typed.ta_type == xo2->xo_typed.ta_type) {
+		/*
+		 * Floating point values compare as xpc_double objects do,
+		 * with ==, so 0.0 equals -0.0 and NaN equals nothing.
+		 */
+		switch (xo1->xo_typed.ta_type) {
+		case XPC_ARRAY_TYPE_DOUBLE:
+			d1 = xo1->xo_typed.ta_data;
+			d2 = xo2->xo_typed.ta_data;
+			for (i = 0; i < xo1->xo_size; i++) {
+				if (d1[i] != d2[i])
+					return (false);
+			}
+
+			return (true);
+
+		case XPC_ARRAY_TYPE_FLOAT:
+			f1 = xo1->xo_typed.ta_data;
+			f2 = xo2->xo_typed.ta_data;
+			for (i = 0; i < xo1->xo_size; i++) {
+				if (f1[i] != f2[i])
+					return (false);
+			}
+
+			return (true);
+
+		default:
+			/* Integers are equal exactly when their bytes are */
+			return (memcmp(xo1->xo_typed.ta_data,
+			    xo2->xo_typed.ta_data, xo1->xo_size *
+			    xpc_typed_array_element_size(
+			    xo1->xo_typed.ta_type)) == 0);
+		}
+	}
+
+	/* Mixed: compare element by element as objects */
+	l1 = l2 = NULL;
+	for (i = 0; i < xo1->xo_size; i++) {
+		if (xo1->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY)
+			v1 = xpc_typed_array_box(xo1, i);
+		else {
+			l1 = l1 == NULL ? TAILQ_FIRST(&xo1->xo_array) :
+			    TAILQ_NEXT(l1, xo_link);
+			v1 = xpc_retain(l1);
+		}
+
+		if (xo2->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY)
+			v2 = xpc_typed_array_box(xo2, i);
+		else {
+			l2 = l2 == NULL ? TAILQ_FIRST(&xo2->xo_array) :
+			    TAILQ_NEXT(l2, xo_link);
+			v2 = xpc_retain(l2);
+		}
+
+		ret = xpc_equal(v1, v2);
+		xpc_release(v1);
+		xpc_release(v2);
+		if (!ret)
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool
+xpc_array_equal(struct xpc_object *xo1, struct xpc_object *xo2)
+{
+	struct xpc_object *v1, *v2;
+
+	if (xo1->xo_size != xo2->xo_size)
+		return (false);
+
+	if (xo1->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY ||
+	    xo2->xo_xpc_type == _XPC_TYPE_TYPED_ARRAY)
+		return (xpc_typed_array_equal(xo1, xo2));
+
+	v2 = TAILQ_FIRST(&xo2->xo_array);
+	TAILQ_FOREACH(v1, &xo1->xo_array, xo_link) {
+		if (!xpc_equal(v1, v2))
+			return (false);
+
+		v2 = TAILQ_NEXT(v2, xo_link);
+	}
+
+	return (true);
+}
+
 bool
 xpc_equal(xpc_object_t x1, xpc_object_t x2)
 {
@@ -432,7 +580,66 @@ xpc_equal(xpc_object_t x1, xpc_object_t x2)
 	xo1 = x1;
 	xo2 = x2;
 
-	/* FIXME */
+	if (xo1 == xo2)
+		return (true);
+
+	if (xpc_get_type(x1) != xpc_get_type(x2))
+		return (false);
+
+	/* Only immutable objects cache their hash, so a mismatch is final */
+	if (xo1->xo_hash != 0 && xo2->xo_hash != 0 &&
+	    xo1->xo_hash != xo2->xo_hash)
+		return (false);
+
+	switch (xo1->xo_xpc_type) {
+	case _XPC_TYPE_NULL:
+		return (true);
+
+	case _XPC_TYPE_BOOL:
+		return (xo1->xo_bool == xo2->xo_bool);
+
+	case _XPC_TYPE_INT64:
+	case _XPC_TYPE_DATE:
+		return (xo1->xo_int == xo2->xo_int);
+
+	case _XPC_TYPE_UINT64:
+	case _XPC_TYPE_ENDPOINT:
+		return (xo1->xo_uint == xo2->xo_uint);
+
+	case _XPC_TYPE_DOUBLE:
+		return (xo1->xo_d == xo2->xo_d);
+
+	case _XPC_TYPE_FD:
+		return (xo1->xo_fd == xo2->xo_fd);
+
+	case _XPC_TYPE_UUID:
+		return (memcmp(xo1->xo_uuid, xo2->xo_uuid, sizeof(uuid_t)) == 0);
+
+	case _XPC_TYPE_STRING:
+		if (xo1->xo_size != xo2->xo_size)
+			return (false);
+
+		return (memcmp(xo1->xo_str, xo2->xo_str, xo1->xo_size) == 0);
+
+	case _XPC_TYPE_DATA:
+		if (xo1->xo_size != xo2->xo_size)
+			return (false);
+
+		return (memcmp((const void *)xo1->xo_ptr,
+		    (const void *)xo2->xo_ptr, xo1->xo_size) == 0);
+
+	case _XPC_TYPE_DICTIONARY:
+	case _XPC_TYPE_PDICTIONARY:
+		if (xpc_dictionary_get_count(x1) != xpc_dictionary_get_count(x2))
+			return (false);
+
+		return (xpc_dictionary_equal(xo1, xo2));
+
+	case _XPC_TYPE_ARRAY:
+	case _XPC_TYPE_TYPED_ARRAY:
+		return (xpc_array_equal(xo1, xo2));
+	}
+
 	return (false);
 }
 
@@ -463,78 +670,305 @@ xpc_copy(xpc_object_t obj)
 		case _XPC_TYPE_DICTIONARY:
 			xotmp = xpc_dictionary_create(NULL, NULL, 0);
 			xpc_dictionary_apply(obj, ^(const char *k, xpc_object_t v) {
-			    xpc_dictionary_set_value(xotmp, k, xpc_copy(v));
+			    xpc_object_t copy = xpc_copy(v);
+			    xpc_dictionary_set_value(xotmp, k, copy);
+			    xpc_release(copy);
 			    return (bool)true;
 			});
 			return (xotmp);
 
+		case _XPC_TYPE_PDICTIONARY:
+			/* Immutable, so the copy can share the whole trie */
+			return (xpc_retain(obj));
+
 		case _XPC_TYPE_ARRAY:
 			xotmp = xpc_array_create(NULL, 0);
 			xpc_array_apply(obj, ^(size_t idx, xpc_object_t v) {
-			    xpc_array_set_value(xotmp, idx, xpc_copy(v));
+			    xpc_object_t copy = xpc_copy(v);
+			    xpc_array_append_value(xotmp, copy);
+			    xpc_release(copy);
 			    return ((bool)true);
 			});
 			return (xotmp);
+
+		case _XPC_TYPE_TYPED_ARRAY:
+			return (xpc_typed_array_create(xo->xo_typed.ta_type,
+			    xo->xo_typed.ta_data, xo->xo_size));
 	}
 
 	return (0);
 }
 
-static size_t
-xpc_data_hash(const uint8_t *data, size_t length)
+/*
+ * Word-at-a-time multiply-mix hash in the style of wyhash. Inputs longer
+ * than 48 bytes are consumed as three independent lanes so the multiplies
+ * can overlap in the pipeline.
+ */
+#define	XPC_HASH_P0	0xa0761d6478bd642fULL
+#define	XPC_HASH_P1	0xe7037ed1a0b428dbULL
+#define	XPC_HASH_P2	0x8ebc6af09c88c6e3ULL
+#define	XPC_HASH_P3	0x589965cc75374cc3ULL
+
+static inline uint64_t
+xpc_hash_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r;
+
+	r = (__uint128_t)a * b;
+	return ((uint64_t)r ^ (uint64_t)(r >> 64));
+#else
+	uint64_t ha, hb, la, lb, rh, rm0, rm1, rl, lo, hi;
+
+	ha = a >> 32;
+	hb = b >> 32;
+	la = (uint32_t)a;
+	lb = (uint32_t)b;
+	rh = ha * hb;
+	rm0 = ha * lb;
+	rm1 = hb * la;
+	rl = la * lb;
+	lo = rl + (rm0 << 32);
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + (lo < rl);
+	rl = lo;
+	lo += rm1 << 32;
+	hi += (lo < rl);
+	return (lo ^ hi);
+#endif
+}
+
+static inline uint64_t
+xpc_hash_read64(const uint8_t *p)
 {
-    size_t hash = 5381;
+	uint64_t v;
 
-    while (length--)
-        hash = ((hash << 5) + hash) + data[length];
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static inline uint64_t
+xpc_hash_read32(const uint8_t *p)
+{
+	uint32_t v;
 
-    return (hash);
+	memcpy(&v, p, sizeof(v));
+	return (v);
 }
 
-size_t
-xpc_hash(xpc_object_t obj)
+__private_extern__ uint64_t
+xpc_hash_bytes(const void *data, size_t length, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t a, b, s1, s2;
+	size_t i = length;
+
+	seed ^= XPC_HASH_P0;
+
+	if (length <= 16) {
+		if (length >= 4) {
+			a = (xpc_hash_read32(p) << 32) |
+			    xpc_hash_read32(p + ((length >> 3) << 2));
+			b = (xpc_hash_read32(p + length - 4) << 32) |
+			    xpc_hash_read32(p + length - 4 - ((length >> 3) << 2));
+		} else if (length > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+			    p[length - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		if (i > 48) {
+			s1 = s2 = seed;
+			do {
+				seed = xpc_hash_mum(xpc_hash_read64(p) ^ XPC_HASH_P1,
+				    xpc_hash_read64(p + 8) ^ seed);
+				s1 = xpc_hash_mum(xpc_hash_read64(p + 16) ^ XPC_HASH_P2,
+				    xpc_hash_read64(p + 24) ^ s1);
+				s2 = xpc_hash_mum(xpc_hash_read64(p + 32) ^ XPC_HASH_P3,
+				    xpc_hash_read64(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= s1 ^ s2;
+		}
+
+		while (i > 16) {
+			seed = xpc_hash_mum(xpc_hash_read64(p) ^ XPC_HASH_P1,
+			    xpc_hash_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		a = xpc_hash_read64(p + i - 16);
+		b = xpc_hash_read64(p + i - 8);
+	}
+
+	return (xpc_hash_mum(XPC_HASH_P1 ^ length,
+	    xpc_hash_mum(a ^ XPC_HASH_P1, b ^ seed)));
+}
+
+__private_extern__ uint64_t
+xpc_hash_scalar(int type, xpc_u value)
 {
-	struct xpc_object *xo;
-	__block size_t hash = 0;
+	uint64_t bits;
+	double d;
+
+	switch (type) {
+	case _XPC_TYPE_BOOL:
+		return (xpc_hash_mum(value.b ^ XPC_HASH_P1, XPC_HASH_P2));
+
+	case _XPC_TYPE_INT64:
+	case _XPC_TYPE_UINT64:
+	case _XPC_TYPE_DATE:
+	case _XPC_TYPE_ENDPOINT:
+		return (xpc_hash_mum(value.ui ^ XPC_HASH_P1, XPC_HASH_P2));
+
+	case _XPC_TYPE_DOUBLE:
+		/* 0.0 and -0.0 compare equal, so they must hash equal */
+		d = value.d == 0 ? 0 : value.d;
+		memcpy(&bits, &d, sizeof(bits));
+		return (xpc_hash_mum(bits ^ XPC_HASH_P1, XPC_HASH_P2));
+	}
+
+	return (0);
+}
+
+static size_t
+xpc_hash_compute(struct xpc_object *xo)
+{
+	__block uint64_t hash;
+	uint64_t h;
+	xpc_u val;
+	size_t i;
+	int type;
 
-	xo = obj;
 	switch (xo->xo_xpc_type) {
 	case _XPC_TYPE_BOOL:
 	case _XPC_TYPE_INT64:
 	case _XPC_TYPE_UINT64:
 	case _XPC_TYPE_DATE:
 	case _XPC_TYPE_ENDPOINT:
-		return ((size_t)xo->xo_u.ui);
+	case _XPC_TYPE_DOUBLE:
+		return (xpc_hash_scalar(xo->xo_xpc_type, xo->xo_u));
 
 	case _XPC_TYPE_STRING:
-		return (xpc_data_hash(
-		    (const uint8_t *)xpc_string_get_string_ptr(obj),
-		    xpc_string_get_length(obj)));
+		return (xpc_hash_bytes(xo->xo_str, xo->xo_size, 0));
 
 	case _XPC_TYPE_DATA:
-		return (xpc_data_hash(
-		    xpc_data_get_bytes_ptr(obj),
-		    xpc_data_get_length(obj)));
+		return (xpc_hash_bytes((const void *)xo->xo_ptr, xo->xo_size, 0));
+
+	case _XPC_TYPE_UUID:
+		return (xpc_hash_bytes(xo->xo_uuid, sizeof(uuid_t), 0));
 
 	case _XPC_TYPE_DICTIONARY:
-		xpc_dictionary_apply(obj, ^(const char *k, xpc_object_t v) {
-			hash ^= xpc_data_hash((const uint8_t *)k, strlen(k));
-			hash ^= xpc_hash(v);
+	case _XPC_TYPE_PDICTIONARY:
+		/* Iteration order is unspecified: sum well-mixed pairs */
+		hash = 0;
+		xpc_dictionary_apply(xo, ^(const char *k, xpc_object_t v) {
+			hash += xpc_hash_mum(
+			    xpc_hash_bytes(k, strlen(k), 0) ^ XPC_HASH_P1,
+			    xpc_hash(v) ^ XPC_HASH_P2);
 			return ((bool)true);
 		});
-		return (hash);
+		return (xpc_hash_mum(hash ^ XPC_HASH_P3, xo->xo_size));
 
 	case _XPC_TYPE_ARRAY:
-		xpc_array_apply(obj, ^(size_t idx, xpc_object_t v) {
-			hash ^= xpc_hash(v);
+		hash = XPC_HASH_P0;
+		xpc_array_apply(xo, ^(size_t idx __unused, xpc_object_t v) {
+			hash = xpc_hash_mum(hash ^ XPC_HASH_P1,
+			    xpc_hash(v) ^ XPC_HASH_P2);
 			return ((bool)true);
 		});
 		return (hash);
+
+	case _XPC_TYPE_TYPED_ARRAY:
+		/* Same chain as above so equal list and typed arrays agree */
+		hash = XPC_HASH_P0;
+		for (i = 0; i < xo->xo_size; i++) {
+			type = xpc_typed_array_load(xo, i, &val);
+			h = xpc_hash_scalar(type, val);
+			hash = xpc_hash_mum(hash ^ XPC_HASH_P1,
+			    (h == 0 ? 1 : h) ^ XPC_HASH_P2);
+		}
+		return (hash);
 	}
 
 	return (0);
 }
 
+/*
+ * Tells whether the object can never change, its values included, so
+ * that its hash may be cached. A persistent dictionary holds its values
+ * shallowly, and those may be mutable containers. Its values have just
+ * been hashed, so those that are immutable have cached their own hash.
+ */
+static bool
+xpc_hash_immutable(struct xpc_object *xo)
+{
+	__block bool immutable;
+
+	switch (xo->xo_xpc_type) {
+	case _XPC_TYPE_STRING:
+	case _XPC_TYPE_DATA:
+		return (true);
+
+	case _XPC_TYPE_PDICTIONARY:
+		immutable = true;
+		xpc_dictionary_apply(xo, ^(const char *k __unused,
+		    xpc_object_t v) {
+			struct xpc_object *xv = v;
+
+			switch (xv->xo_xpc_type) {
+			case _XPC_TYPE_NULL:
+			case _XPC_TYPE_BOOL:
+			case _XPC_TYPE_INT64:
+			case _XPC_TYPE_UINT64:
+			case _XPC_TYPE_DATE:
+			case _XPC_TYPE_ENDPOINT:
+			case _XPC_TYPE_DOUBLE:
+			case _XPC_TYPE_UUID:
+				break;
+
+			case _XPC_TYPE_STRING:
+			case _XPC_TYPE_DATA:
+			case _XPC_TYPE_PDICTIONARY:
+				if (xv->xo_hash != 0)
+					break;
+				/* FALLTHROUGH */
+
+			default:
+				immutable = false;
+			}
+
+			return ((bool)immutable);
+		});
+		return (immutable);
+	}
+
+	return (false);
+}
+
+size_t
+xpc_hash(xpc_object_t obj)
+{
+	struct xpc_object *xo;
+	size_t hash;
+
+	xo = obj;
+	if (xo->xo_hash != 0)
+		return (xo->xo_hash);
+
+	/* Zero means "not computed yet" in xo_hash */
+	hash = xpc_hash_compute(xo);
+	if (hash == 0)
+		hash = 1;
+
+	if (xpc_hash_immutable(xo))
+		xo->xo_hash = hash;
+
+	return (hash);
+}
+
 __private_extern__ const char *
 _xpc_get_type_name(xpc_object_t obj)
 {
@@ -0,0 +1,804 @@
+#!/usr/bin/env python3
+#-
+# Copyright (c) 2015 iXsystems, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Generates C structures and MessagePack encoders/decoders from an IDL.
+
+The IDL is a list of messages:
+
+    # comment
+    message point {
+        double x;
+        double y;
+    }
+
+    message draw_request {
+        string label;
+        point origin;
+        double[] samples;
+        point[] path;
+    }
+
+Field types are bool, int64, uint64, double, date, string, data and any
+previously declared message. int64, uint64, double, string and message
+fields may be followed by [] to make them arrays.
+
+For each message M the generated code provides:
+
+    int M_encode(mpack_writer_t *writer, const struct M *msg);
+    int M_serialize(const struct M *msg, char **buf, size_t *size);
+    void M_send(xpc_connection_t conn, const struct M *msg);
+    int M_decode(const void *buf, size_t size, struct M *msg);
+    int M_from_object(xpc_object_t xdict, struct M *msg);
+    void M_free(struct M *msg);
+
+The encoders write the same MessagePack that xpc_pack() produces for the
+equivalent dictionary, so receivers that decode into XPC objects need not
+know the message was generated.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+
+SCALARS = {
+    # name: (C type, mpack writer, XPC_ARRAY_TYPE_* for numbers)
+    'bool': ('bool', 'mpack_write_bool', None),
+    'int64': ('int64_t', 'mpack_write_i64', 'XPC_ARRAY_TYPE_INT64'),
+    'uint64': ('uint64_t', 'mpack_write_u64', 'XPC_ARRAY_TYPE_UINT64'),
+    'double': ('double', 'mpack_write_double', 'XPC_ARRAY_TYPE_DOUBLE'),
+    'date': ('int64_t', 'mpack_write_i64', 'XPC_ARRAY_TYPE_INT64'),
+}
+
+TYPED_ARRAYS = {
+    # name: (C type, XPC_ARRAY_TYPE_*); all of them are 64 bits wide
+    'int64': ('int64_t', 'XPC_ARRAY_TYPE_INT64'),
+    'uint64': ('uint64_t', 'XPC_ARRAY_TYPE_UINT64'),
+    'double': ('double', 'XPC_ARRAY_TYPE_DOUBLE'),
+}
+
+# Must match XPC_EXT_TYPED_ARRAY in xpc_internal.h
+EXT_TYPED_ARRAY = 0x10
+
+
+class IDLError(Exception):
+    pass
+
+
+class Field(object):
+    def __init__(self, type, name, array, lineno):
+        self.type = type
+        self.name = name
+        self.array = array
+        self.lineno = lineno
+
+
+class Message(object):
+    def __init__(self, name):
+        self.name = name
+        self.fields = []
+
+
+def parse(text):
+    messages = []
+    names = set()
+    current = None
+
+    for lineno, line in enumerate(text.splitlines(), 1):
+        line = line.split('#', 1)[0].strip()
+        if not line:
+            continue
+
+        if current is None:
+            m = re.match(r'^message\s+([A-Za-z_]\w*)\s*\{$', line)
+            if not m:
+                raise IDLError('{0}: expected "message <name> {{"'.format(lineno))
+
+            if m.group(1) in names:
+                raise IDLError('{0}: duplicate message {1}'.format(lineno, m.group(1)))
+
+            current = Message(m.group(1))
+            continue
+
+        if line == '}':
+            if not current.fields:
+                raise IDLError('{0}: message {1} has no fields'.format(lineno, current.name))
+
+            messages.append(current)
+            names.add(current.name)
+            current = None
+            continue
+
+        m = re.match(r'^([A-Za-z_]\w*)\s*(\[\])?\s+([A-Za-z_]\w*)\s*;$', line)
+        if not m:
+            raise IDLError('{0}: expected "<type> <name>;"'.format(lineno))
+
+        type, array, name = m.group(1), bool(m.group(2)), m.group(3)
+        if type not in SCALARS and type not in ('string', 'data') and type not in names:
+            raise IDLError('{0}: unknown type {1}'.format(lineno, type))
+
+        if array and type not in TYPED_ARRAYS and type != 'string' and type not in names:
+            raise IDLError('{0}: {1} cannot be an array'.format(lineno, type))
+
+        if any(f.name == name for f in current.fields):
+            raise IDLError('{0}: duplicate field {1}'.format(lineno, name))
+
+        current.fields.append(Field(type, name, array, lineno))
+
+    if current is not None:
+        raise IDLError('unterminated message {0}'.format(current.name))
+
+    return messages
+
+
+class Writer(object):
+    def __init__(self):
+        self.lines = []
+
+    def __call__(self, line=''):
+        self.lines.append(line)
+
+    def text(self):
+        return '\n'.join(self.lines) + '\n'
+
+
+def ctype(f):
+    if f.type in SCALARS:
+        return SCALARS[f.type][0]
+
+    if f.type == 'string':
+        return 'char *'
+
+    if f.type == 'data':
+        return 'struct xpc_schema_bytes'
+
+    return 'struct {0}'.format(f.type)
+
+
+def emit_header(w, messages, guard):
+    w('/* Generated by xpcgen. Do not edit. */')
+    w()
+    w('#ifndef {0}'.format(guard))
+    w('#define {0}'.format(guard))
+    w()
+    w('#include <sys/types.h>')
+    w('#include <stdbool.h>')
+    w('#include <stdint.h>')
+    w('#include <xpc/xpc.h>')
+    w('#include "mpack.h"')
+    w()
+    w('__BEGIN_DECLS')
+
+    for msg in messages:
+        w()
+        w('struct {0} {{'.format(msg.name))
+        for f in msg.fields:
+            if f.array:
+                t = ctype(f)
+                w('\t{0}{1}{2};'.format(t, '' if t.endswith('*') else ' ', '*' + f.name))
+                w('\tsize_t {0}_count;'.format(f.name))
+            else:
+                t = ctype(f)
+                w('\t{0}{1}{2};'.format(t, '' if t.endswith('*') else ' ', f.name))
+        w('};')
+
+    for msg in messages:
+        n = msg.name
+        w()
+        w('int {0}_encode(mpack_writer_t *writer, const struct {0} *msg);'.format(n))
+        w('int {0}_serialize(const struct {0} *msg, char **buf, size_t *size);'.format(n))
+        w('void {0}_send(xpc_connection_t conn, const struct {0} *msg);'.format(n))
+        w('int {0}_decode(const void *buf, size_t size, struct {0} *msg);'.format(n))
+        w('int {0}_from_object(xpc_object_t xdict, struct {0} *msg);'.format(n))
+        w('void {0}_free(struct {0} *msg);'.format(n))
+
+    w()
+    w('__END_DECLS')
+    w()
+    w('#endif\t/* {0} */'.format(guard))
+
+
+def emit_common(w):
+    w('static void')
+    w('xpcgen_write_string(mpack_writer_t *writer, const char *str)')
+    w('{')
+    w()
+    w('\tif (str == NULL)')
+    w('\t\tmpack_write_nil(writer);')
+    w('\telse')
+    w('\t\tmpack_write_cstr(writer, str);')
+    w('}')
+    w()
+    w('static int')
+    w('xpcgen_write_typed(mpack_writer_t *writer, int type, const void *data,')
+    w('    size_t count)')
+    w('{')
+    w('#if BYTE_ORDER == BIG_ENDIAN')
+    w('\tconst uint64_t *src;')
+    w('\tuint64_t le;')
+    w('\tsize_t i;')
+    w('#endif')
+    w()
+    w('\tif (count * sizeof(uint64_t) > UINT32_MAX) {')
+    w('\t\tmpack_writer_flag_error(writer, mpack_error_too_big);')
+    w('\t\treturn (-1);')
+    w('\t}')
+    w()
+    w('\t/* Elements are little-endian on the wire */')
+    w('\tmpack_start_ext(writer, XPCGEN_EXT_TYPED_ARRAY + type,')
+    w('\t    (uint32_t)(count * sizeof(uint64_t)));')
+    w('#if BYTE_ORDER == LITTLE_ENDIAN')
+    w('\tmpack_write_bytes(writer, (const char *)data,')
+    w('\t    count * sizeof(uint64_t));')
+    w('#else')
+    w('\tsrc = data;')
+    w('\tfor (i = 0; i < count; i++) {')
+    w('\t\tle = htole64(src[i]);')
+    w('\t\tmpack_write_bytes(writer, (const char *)&le, sizeof(le));')
+    w('\t}')
+    w('#endif')
+    w('\tmpack_finish_ext(writer);')
+    w('\treturn (0);')
+    w('}')
+    w()
+    w('static void *')
+    w('xpcgen_read_typed(mpack_node_t node, int type, size_t *count)')
+    w('{')
+    w('\tuint64_t *dst;')
+    w('\tsize_t i, len;')
+    w()
+    w('\tif (mpack_node_type(node) != mpack_type_ext ||')
+    w('\t    mpack_node_exttype(node) != XPCGEN_EXT_TYPED_ARRAY + type)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\tlen = mpack_node_data_len(node);')
+    w('\tif (len % sizeof(uint64_t) != 0)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\tif ((dst = malloc(len + 1)) == NULL)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\tmemcpy(dst, mpack_node_data(node), len);')
+    w('\t*count = len / sizeof(uint64_t);')
+    w('\tfor (i = 0; i < *count; i++)')
+    w('\t\tdst[i] = le64toh(dst[i]);')
+    w()
+    w('\treturn (dst);')
+    w('}')
+    w()
+    w('static void *')
+    w('xpcgen_copy_bytes(mpack_node_t node, mpack_type_t type, size_t *length)')
+    w('{')
+    w('\tchar *dst;')
+    w('\tsize_t len;')
+    w()
+    w('\tif (mpack_node_type(node) != type)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\tlen = mpack_node_data_len(node);')
+    w('\tif ((dst = malloc(len + 1)) == NULL)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\tmemcpy(dst, mpack_node_data(node), len);')
+    w('\tdst[len] = \'\\0\';')
+    w('\tif (length != NULL)')
+    w('\t\t*length = len;')
+    w()
+    w('\treturn (dst);')
+    w('}')
+    w()
+    w('static bool')
+    w('xpcgen_is_int(mpack_node_t node, bool is_signed)')
+    w('{')
+    w()
+    w('\tswitch (mpack_node_type(node)) {')
+    w('\tcase mpack_type_int:')
+    w('\t\treturn (is_signed || mpack_node_i64(node) >= 0);')
+    w()
+    w('\tcase mpack_type_uint:')
+    w('\t\treturn (!is_signed || mpack_node_u64(node) <= INT64_MAX);')
+    w()
+    w('\tdefault:')
+    w('\t\treturn (false);')
+    w('\t}')
+    w('}')
+    w()
+    w('static bool')
+    w('xpcgen_is_number(mpack_node_t node)')
+    w('{')
+    w()
+    w('\tswitch (mpack_node_type(node)) {')
+    w('\tcase mpack_type_int:')
+    w('\tcase mpack_type_uint:')
+    w('\tcase mpack_type_float:')
+    w('\tcase mpack_type_double:')
+    w('\t\treturn (true);')
+    w()
+    w('\tdefault:')
+    w('\t\treturn (false);')
+    w('\t}')
+    w('}')
+    w()
+    w('/*')
+    w(' * Positive integers come off the wire as uint64 objects, so accept any')
+    w(' * number that fits.')
+    w(' */')
+    w('static int')
+    w('xpcgen_number_from_object(xpc_object_t xo, int type, void *dst)')
+    w('{')
+    w('\tint64_t i;')
+    w('\tuint64_t u;')
+    w('\tdouble d;')
+    w()
+    w('\tif (xpc_get_type(xo) == XPC_TYPE_INT64) {')
+    w('\t\ti = xpc_int64_get_value(xo);')
+    w('\t\tif (i < 0 && type == XPC_ARRAY_TYPE_UINT64)')
+    w('\t\t\treturn (-1);')
+    w()
+    w('\t\tu = (uint64_t)i;')
+    w('\t\td = (double)i;')
+    w('\t} else if (xpc_get_type(xo) == XPC_TYPE_UINT64) {')
+    w('\t\tu = xpc_uint64_get_value(xo);')
+    w('\t\tif (u > INT64_MAX && type == XPC_ARRAY_TYPE_INT64)')
+    w('\t\t\treturn (-1);')
+    w()
+    w('\t\ti = (int64_t)u;')
+    w('\t\td = (double)u;')
+    w('\t} else if (xpc_get_type(xo) == XPC_TYPE_DATE) {')
+    w('\t\ti = xpc_date_get_value(xo);')
+    w('\t\tu = (uint64_t)i;')
+    w('\t\td = (double)i;')
+    w('\t} else if (xpc_get_type(xo) == XPC_TYPE_DOUBLE &&')
+    w('\t    type == XPC_ARRAY_TYPE_DOUBLE) {')
+    w('\t\td = xpc_double_get_value(xo);')
+    w('\t\ti = 0;')
+    w('\t\tu = 0;')
+    w('\t} else')
+    w('\t\treturn (-1);')
+    w()
+    w('\tswitch (type) {')
+    w('\tcase XPC_ARRAY_TYPE_INT64:')
+    w('\t\tmemcpy(dst, &i, sizeof(i));')
+    w('\t\tbreak;')
+    w()
+    w('\tcase XPC_ARRAY_TYPE_UINT64:')
+    w('\t\tmemcpy(dst, &u, sizeof(u));')
+    w('\t\tbreak;')
+    w()
+    w('\tcase XPC_ARRAY_TYPE_DOUBLE:')
+    w('\t\tmemcpy(dst, &d, sizeof(d));')
+    w('\t\tbreak;')
+    w('\t}')
+    w()
+    w('\treturn (0);')
+    w('}')
+    w()
+    w('static void *')
+    w('xpcgen_typed_from_object(xpc_object_t xarray, int type, size_t *count)')
+    w('{')
+    w('\tuint64_t *dst;')
+    w('\tsize_t i;')
+    w()
+    w('\tif (xpc_get_type(xarray) != XPC_TYPE_ARRAY)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\t*count = xpc_array_get_count(xarray);')
+    w('\tif ((dst = calloc(*count + 1, sizeof(uint64_t))) == NULL)')
+    w('\t\treturn (NULL);')
+    w()
+    w('\tif (xpc_typed_array_get_element_type(xarray) == type) {')
+    w('\t\tmemcpy(dst, xpc_typed_array_get_pointer(xarray, NULL),')
+    w('\t\t    *count * sizeof(uint64_t));')
+    w('\t\treturn (dst);')
+    w('\t}')
+    w()
+    w('\tfor (i = 0; i < *count; i++) {')
+    w('\t\tif (xpcgen_number_from_object(xpc_array_get_value(xarray, i),')
+    w('\t\t    type, &dst[i]) != 0) {')
+    w('\t\t\tfree(dst);')
+    w('\t\t\treturn (NULL);')
+    w('\t\t}')
+    w('\t}')
+    w()
+    w('\treturn (dst);')
+    w('}')
+
+
+def emit_encode(w, msg):
+    n = msg.name
+    w()
+    w('int')
+    w('{0}_encode(mpack_writer_t *writer, const struct {0} *msg)'.format(n))
+    w('{')
+    if any(f.array and f.type not in TYPED_ARRAYS for f in msg.fields):
+        w('\tsize_t i;')
+    w()
+    w('\tmpack_start_map(writer, {0});'.format(len(msg.fields)))
+    for f in msg.fields:
+        w('\tmpack_write_cstr(writer, "{0}");'.format(f.name))
+        if f.array and f.type in TYPED_ARRAYS:
+            w('\txpcgen_write_typed(writer, {0}, msg->{1}, msg->{1}_count);'.format(
+                TYPED_ARRAYS[f.type][1], f.name))
+        elif f.array:
+            w('\tmpack_start_array(writer, (uint32_t)msg->{0}_count);'.format(f.name))
+            w('\tfor (i = 0; i < msg->{0}_count; i++)'.format(f.name))
+            if f.type == 'string':
+                w('\t\txpcgen_write_string(writer, msg->{0}[i]);'.format(f.name))
+            else:
+                w('\t\t{0}_encode(writer, &msg->{1}[i]);'.format(f.type, f.name))
+            w('\tmpack_finish_array(writer);')
+        elif f.type in SCALARS:
+            w('\t{0}(writer, msg->{1});'.format(SCALARS[f.type][1], f.name))
+        elif f.type == 'string':
+            w('\txpcgen_write_string(writer, msg->{0});'.format(f.name))
+        elif f.type == 'data':
+            w('\tmpack_write_bin(writer, msg->{0}.ptr, (uint32_t)msg->{0}.length);'.format(f.name))
+        else:
+            w('\t{0}_encode(writer, &msg->{1});'.format(f.type, f.name))
+    w('\tmpack_finish_map(writer);')
+    w()
+    w('\treturn (mpack_writer_error(writer) == mpack_ok ? 0 : -1);')
+    w('}')
+    w()
+    w('int')
+    w('{0}_serialize(const struct {0} *msg, char **buf, size_t *size)'.format(n))
+    w('{')
+    w('\tmpack_writer_t writer;')
+    w()
+    w('\tmpack_writer_init_growable(&writer, buf, size);')
+    w('\t{0}_encode(&writer, msg);'.format(n))
+    w('\tif (mpack_writer_destroy(&writer) != mpack_ok) {')
+    w('\t\terrno = EINVAL;')
+    w('\t\treturn (-1);')
+    w('\t}')
+    w()
+    w('\treturn (0);')
+    w('}')
+    w()
+    w('void')
+    w('{0}_send(xpc_connection_t conn, const struct {0} *msg)'.format(n))
+    w('{')
+    w('\tchar *buf;')
+    w('\tsize_t size;')
+    w()
+    w('\tif ({0}_serialize(msg, &buf, &size) != 0)'.format(n))
+    w('\t\treturn;')
+    w()
+    w('\txpc_connection_send_serialized(conn, buf, size);')
+    w('\tfree(buf);')
+    w('}')
+
+
+def emit_decode(w, msg):
+    n = msg.name
+    w()
+    w('static int')
+    w('{0}_decode_node(mpack_node_t node, struct {0} *msg)'.format(n))
+    w('{')
+    w('\tmpack_node_t key, value;')
+    w('\tconst char *name;')
+    w('\tsize_t i, len;')
+    if any(f.array and f.type not in TYPED_ARRAYS for f in msg.fields):
+        w('\tsize_t j;')
+    w()
+    w('\tif (mpack_node_type(node) != mpack_type_map)')
+    w('\t\treturn (-1);')
+    w()
+    w('\tfor (i = 0; i < mpack_node_map_count(node); i++) {')
+    w('\t\tkey = mpack_node_map_key_at(node, i);')
+    w('\t\tvalue = mpack_node_map_value_at(node, i);')
+    w('\t\tif (mpack_node_type(key) != mpack_type_str)')
+    w('\t\t\treturn (-1);')
+    w()
+    w('\t\tname = mpack_node_data(key);')
+    w('\t\tlen = mpack_node_data_len(key);')
+    first = True
+    for f in msg.fields:
+        cond = 'len == {0} && memcmp(name, "{1}", {0}) == 0'.format(len(f.name), f.name)
+        w('\t\t{0}if ({1}) {{'.format('' if first else '} else ', cond))
+        first = False
+        m = 'msg->' + f.name
+        if f.array and f.type in TYPED_ARRAYS:
+            w('\t\t\tif ({0} != NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0} = xpcgen_read_typed(value, {1}, &{0}_count);'.format(m, TYPED_ARRAYS[f.type][1]))
+            w('\t\t\tif ({0} == NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+        elif f.array:
+            w('\t\t\tif ({0} != NULL || mpack_node_type(value) != mpack_type_array)'.format(m))
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0}_count = mpack_node_array_length(value);'.format(m))
+            w('\t\t\t{0} = calloc({0}_count + 1, sizeof({0}[0]));'.format(m))
+            w('\t\t\tif ({0} == NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\tfor (j = 0; j < {0}_count; j++) {{'.format(m))
+            if f.type == 'string':
+                w('\t\t\t\tif (mpack_node_type(mpack_node_array_at(value, j)) ==')
+                w('\t\t\t\t    mpack_type_nil)')
+                w('\t\t\t\t\tcontinue;')
+                w()
+                w('\t\t\t\t{0}[j] = xpcgen_copy_bytes('.format(m))
+                w('\t\t\t\t    mpack_node_array_at(value, j), mpack_type_str,')
+                w('\t\t\t\t    NULL);')
+                w('\t\t\t\tif ({0}[j] == NULL)'.format(m))
+                w('\t\t\t\t\treturn (-1);')
+            else:
+                w('\t\t\t\tif ({0}_decode_node(mpack_node_array_at(value, j),'.format(f.type))
+                w('\t\t\t\t    &{0}[j]) != 0)'.format(m))
+                w('\t\t\t\t\treturn (-1);')
+            w('\t\t\t}')
+        elif f.type == 'bool':
+            w('\t\t\tif (mpack_node_type(value) != mpack_type_bool)')
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0} = mpack_node_bool(value);'.format(m))
+        elif f.type in ('int64', 'date'):
+            w('\t\t\tif (!xpcgen_is_int(value, true))')
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0} = mpack_node_i64(value);'.format(m))
+        elif f.type == 'uint64':
+            w('\t\t\tif (!xpcgen_is_int(value, false))')
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0} = mpack_node_u64(value);'.format(m))
+        elif f.type == 'double':
+            w('\t\t\tif (!xpcgen_is_number(value))')
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0} = mpack_node_double(value);'.format(m))
+        elif f.type == 'string':
+            w('\t\t\tif ({0} != NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\tif (mpack_node_type(value) == mpack_type_nil)')
+            w('\t\t\t\tcontinue;')
+            w()
+            w('\t\t\t{0} = xpcgen_copy_bytes(value, mpack_type_str, NULL);'.format(m))
+            w('\t\t\tif ({0} == NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+        elif f.type == 'data':
+            w('\t\t\tif ({0}.ptr != NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+            w()
+            w('\t\t\t{0}.ptr = xpcgen_copy_bytes(value, mpack_type_bin,'.format(m))
+            w('\t\t\t    &{0}.length);'.format(m))
+            w('\t\t\tif ({0}.ptr == NULL)'.format(m))
+            w('\t\t\t\treturn (-1);')
+        else:
+            w('\t\t\tif ({0}_decode_node(value, &{1}) != 0)'.format(f.type, m))
+            w('\t\t\t\treturn (-1);')
+    w('\t\t}')
+    w('\t}')
+    w()
+    w('\treturn (0);')
+    w('}')
+    w()
+    w('int')
+    w('{0}_decode(const void *buf, size_t size, struct {0} *msg)'.format(n))
+    w('{')
+    w('\tmpack_tree_t tree;')
+    w('\tint ret;')
+    w()
+    w('\tmemset(msg, 0, sizeof(*msg));')
+    w('\tmpack_tree_init(&tree, buf, size);')
+    w('\tret = mpack_tree_error(&tree) == mpack_ok ?')
+    w('\t    {0}_decode_node(mpack_tree_root(&tree), msg) : -1;'.format(n))
+    w('\tif (mpack_tree_destroy(&tree) != mpack_ok)')
+    w('\t\tret = -1;')
+    w()
+    w('\tif (ret != 0) {')
+    w('\t\t{0}_free(msg);'.format(n))
+    w('\t\terrno = EBADMSG;')
+    w('\t}')
+    w()
+    w('\treturn (ret);')
+    w('}')
+
+
+def emit_from_object(w, msg):
+    n = msg.name
+    w()
+    w('static int')
+    w('{0}_from_object_1(xpc_object_t xdict, struct {0} *msg)'.format(n))
+    w('{')
+    w('\txpc_object_t value;')
+    if any(f.array and f.type not in TYPED_ARRAYS for f in msg.fields):
+        w('\tsize_t i;')
+    w()
+    w('\tif (xpc_get_type(xdict) != XPC_TYPE_DICTIONARY)')
+    w('\t\treturn (-1);')
+    for f in msg.fields:
+        m = 'msg->' + f.name
+        w()
+        w('\tvalue = xpc_dictionary_get_value(xdict, "{0}");'.format(f.name))
+        if f.array and f.type in TYPED_ARRAYS:
+            w('\tif (value != NULL) {')
+            w('\t\t{0} = xpcgen_typed_from_object(value, {1}, &{0}_count);'.format(
+                m, TYPED_ARRAYS[f.type][1]))
+            w('\t\tif ({0} == NULL)'.format(m))
+            w('\t\t\treturn (-1);')
+            w('\t}')
+        elif f.array:
+            w('\tif (value != NULL) {')
+            w('\t\tif (xpc_get_type(value) != XPC_TYPE_ARRAY)')
+            w('\t\t\treturn (-1);')
+            w()
+            w('\t\t{0}_count = xpc_array_get_count(value);'.format(m))
+            w('\t\t{0} = calloc({0}_count + 1, sizeof({0}[0]));'.format(m))
+            w('\t\tif ({0} == NULL)'.format(m))
+            w('\t\t\treturn (-1);')
+            w()
+            w('\t\tfor (i = 0; i < {0}_count; i++) {{'.format(m))
+            if f.type == 'string':
+                w('\t\t\tif (xpc_array_get_string(value, i) != NULL &&')
+                w('\t\t\t    ({0}[i] = strdup('.format(m))
+                w('\t\t\t    xpc_array_get_string(value, i))) == NULL)')
+                w('\t\t\t\treturn (-1);')
+            else:
+                w('\t\t\tif ({0}_from_object_1('.format(f.type))
+                w('\t\t\t    xpc_array_get_value(value, i), &{0}[i]) != 0)'.format(m))
+                w('\t\t\t\treturn (-1);')
+            w('\t\t}')
+            w('\t}')
+        elif f.type == 'bool':
+            w('\tif (value != NULL) {')
+            w('\t\tif (xpc_get_type(value) != XPC_TYPE_BOOL)')
+            w('\t\t\treturn (-1);')
+            w()
+            w('\t\t{0} = xpc_bool_get_value(value);'.format(m))
+            w('\t}')
+        elif f.type in SCALARS:
+            w('\tif (value != NULL &&')
+            w('\t    xpcgen_number_from_object(value, {0}, &{1}) != 0)'.format(SCALARS[f.type][2], m))
+            w('\t\treturn (-1);')
+        elif f.type == 'string':
+            w('\tif (xpc_get_type(value) == XPC_TYPE_STRING &&')
+            w('\t    ({0} = strdup(xpc_string_get_string_ptr(value))) == NULL)'.format(m))
+            w('\t\treturn (-1);')
+        elif f.type == 'data':
+            w('\tif (xpc_get_type(value) == XPC_TYPE_DATA) {')
+            w('\t\t{0}.length = xpc_data_get_length(value);'.format(m))
+            w('\t\tif (({0}.ptr = malloc({0}.length + 1)) == NULL)'.format(m))
+            w('\t\t\treturn (-1);')
+            w()
+            w('\t\tmemcpy({0}.ptr, xpc_data_get_bytes_ptr(value), {0}.length);'.format(m))
+            w('\t\t((char *){0}.ptr)[{0}.length] = \'\\0\';'.format(m))
+            w('\t}')
+        else:
+            w('\tif (value != NULL &&')
+            w('\t    {0}_from_object_1(value, &{1}) != 0)'.format(f.type, m))
+            w('\t\treturn (-1);')
+    w()
+    w('\treturn (0);')
+    w('}')
+    w()
+    w('int')
+    w('{0}_from_object(xpc_object_t xdict, struct {0} *msg)'.format(n))
+    w('{')
+    w()
+    w('\tmemset(msg, 0, sizeof(*msg));')
+    w('\tif ({0}_from_object_1(xdict, msg) != 0) {{'.format(n))
+    w('\t\t{0}_free(msg);'.format(n))
+    w('\t\terrno = EINVAL;')
+    w('\t\treturn (-1);')
+    w('\t}')
+    w()
+    w('\treturn (0);')
+    w('}')
+
+
+def emit_free(w, msg):
+    n = msg.name
+    w()
+    w('void')
+    w('{0}_free(struct {0} *msg)'.format(n))
+    w('{')
+    if any(f.array and f.type not in TYPED_ARRAYS for f in msg.fields):
+        w('\tsize_t i;')
+    w()
+    for f in msg.fields:
+        m = 'msg->' + f.name
+        if f.array and f.type == 'string':
+            w('\tfor (i = 0; {0} != NULL && i < {0}_count; i++)'.format(m))
+            w('\t\tfree({0}[i]);'.format(m))
+            w('\tfree({0});'.format(m))
+        elif f.array and f.type not in TYPED_ARRAYS:
+            w('\tfor (i = 0; {0} != NULL && i < {0}_count; i++)'.format(m))
+            w('\t\t{0}_free(&{1}[i]);'.format(f.type, m))
+            w('\tfree({0});'.format(m))
+        elif f.array or f.type == 'string':
+            w('\tfree({0});'.format(m))
+        elif f.type == 'data':
+            w('\tfree({0}.ptr);'.format(m))
+        elif f.type not in SCALARS:
+            w('\t{0}_free(&{1});'.format(f.type, m))
+    w('\tmemset(msg, 0, sizeof(*msg));')
+    w('}')
+
+
+def emit_source(w, messages, header):
+    w('/* Generated by xpcgen. Do not edit. */')
+    w()
+    w('#include <sys/types.h>')
+    w('#include <sys/endian.h>')
+    w('#include <errno.h>')
+    w('#include <stdlib.h>')
+    w('#include <string.h>')
+    w('#include "{0}"'.format(header))
+    w()
+    w('#define\tXPCGEN_EXT_TYPED_ARRAY\t0x{0:02x}'.format(EXT_TYPED_ARRAY))
+    w()
+    for msg in messages:
+        w('static int {0}_decode_node(mpack_node_t node, struct {0} *msg);'.format(msg.name))
+        w('static int {0}_from_object_1(xpc_object_t xdict, struct {0} *msg);'.format(msg.name))
+    w()
+    emit_common(w)
+    for msg in messages:
+        emit_encode(w, msg)
+        emit_decode(w, msg)
+        emit_from_object(w, msg)
+        emit_free(w, msg)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate XPC message encoders from an IDL')
+    parser.add_argument('-o', '--output-dir', default='.', help='directory to write to')
+    parser.add_argument('idl', help='IDL file')
+    args = parser.parse_args()
+
+    with open(args.idl) as f:
+        try:
+            messages = parse(f.read())
+        except IDLError as e:
+            print('{0}:{1}'.format(args.idl, e), file=sys.stderr)
+            return 1
+
+    base = os.path.splitext(os.path.basename(args.idl))[0]
+    guard = '_XPCGEN_{0}_H'.format(re.sub(r'\W', '_', base).upper())
+
+    header = Writer()
+    emit_header(header, messages, guard)
+    source = Writer()
+    emit_source(source, messages, base + '.h')
+
+    with open(os.path.join(args.output_dir, base + '.h'), 'w') as f:
+        f.write(header.text())
+
+    with open(os.path.join(args.output_dir, base + '.c'), 'w') as f:
+        f.write(source.text())
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())